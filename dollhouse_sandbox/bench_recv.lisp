@@ -0,0 +1,13 @@
+; the receiving half of the peer benchmark, see bench_send.lisp. prints the rate at which the messages arrived, from the
+; first to the -1 after the last.
+(define n 0)
+(define start 0)
+(define arrived (lambda (l)
+  (while l
+    (begin
+      (if (eq? n 0) (setq start (clock)) ())
+      (if (eq? (first l) -1)
+          (println "received " n " messages in " (int (- (clock) start)) " ms, " (int (/ (* n 1000) (- (clock) start))) " msg/s")
+          (setq n (+ n 1)))
+      (setq l (next l))))))
+(interface "bench" "num" "list" arrived 1 1 256)
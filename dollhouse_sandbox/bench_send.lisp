@@ -0,0 +1,14 @@
+; the sending half of the peer benchmark: sends bench-n messages on interface bench to the daemon of another dollhouse
+; that runs bench_recv.lisp, then -1, and prints the rate at which it sent them. start the receiver first, both from the
+; top of the repository:
+;   DH_LISTEN=unix:/tmp/dollhouse.sock DH_MAIN=dollhouse_sandbox/bench_recv.lisp ./dollhouse
+;   DH_PEERS=unix:/tmp/dollhouse.sock DH_MAIN=dollhouse_sandbox/bench_send.lisp ./dollhouse
+; unixpacket: and tcp: addresses work as well.
+(define bench-n 1000000)
+(interface "bench" "num" "list" (lambda (x) x) 0 0)
+(while (not (assoc 'interlinks (stats))) (yield 10)) ; until the receiver offered its interface
+(define i 0)
+(define start (clock))
+(while (< i bench-n) (begin (output "bench" i) (setq i (+ i 1))))
+(output "bench" -1)
+(println "sent " i " messages in " (int (- (clock) start)) " ms, " (int (/ (* i 1000) (- (clock) start))) " msg/s")
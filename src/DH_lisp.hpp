@@ -60,6 +60,30 @@ void using_history() { }
 #define ALWAYS_GC 0
 #endif
 
+/* TRACE_LEVEL: the most detailed trace output that is compiled in, 0 compiles all tracing out, 1 traces evaluation steps,
+   2 also traces events such as garbage collections and 3 also every variable lookup and program read. the default is 3
+   with DEBUG, 0 with NDEBUG and 1 otherwise */
+#ifndef TRACE_LEVEL
+#if defined(DEBUG)
+#define TRACE_LEVEL 3
+#elif defined(NDEBUG)
+#define TRACE_LEVEL 0
+#else
+#define TRACE_LEVEL 1
+#endif
+#endif
+
+/* trace categories, the bits of the tr flags of a LispEnv that are set with (trace flags) */
+#define TRACE_STEPS 3                           /* evaluation steps, 1 to trace and 2 to also wait for a key after each step */
+#define TRACE_GC    4                           /* garbage collections and heap resizes */
+#define TRACE_VARS  8                           /* variable lookups and definitions */
+#define TRACE_READ  16                          /* programs that are read */
+
+/* TRACING(level, category, lispenv) is nonzero when the trace output of category at level is compiled in and enabled,
+   TRACE(level, category, lispenv, format, ...) logs it to stderr. both are constant 0 above TRACE_LEVEL */
+#define TRACING(l, c, lispenv) ((l) <= TRACE_LEVEL && ((lispenv)->tr & (c)))
+#define TRACE(l, c, lispenv, ...) (TRACING(l, c, lispenv) ? fprintf(stderr, __VA_ARGS__) : 0)
+
 #define MAX_GOSUB_RECURSE 10
 
 #ifndef DOLLHOUSE_HPP_
@@ -100,8 +124,11 @@ typedef L       *P;                             /* pointer to a root variable wi
 /* T(x) returns the tag bits of a NaN-boxed Lisp expression x */
 #define T(x) (*(I*)&x >> 48)
 
-/* primitive, atom, string, pair, closure, macro, GC forward, GC var pointer and nil tags (reserve 0x7ff8 for nan) */
-enum { PRIMITIVE=0x7ff9, ATOM=0x7ffa, STRING=0x7ffb, PAIR=0x7ffc, CLOSURE=0x7ffe, MACRO=0x7fff, FORW=0xfffd, VARP=0xfffe, NIL=0xffff };
+/* primitive, atom, string, pair, file slice, closure, macro, frame, global and local variable reference, code address, GC
+   forward, GC var pointer and nil tags (reserve 0x7ff8 for nan and 0xfff8 for -nan). a SLICE is not on the heap, unlike
+   the PAIR, CLOSURE and MACRO it shares the tag bits with */
+enum { PRIMITIVE=0x7ff9, ATOM=0x7ffa, STRING=0x7ffb, PAIR=0x7ffc, SLICE=0x7ffd, CLOSURE=0x7ffe, MACRO=0x7fff,
+       FRAME=0xfff9, GLOBAL=0xfffa, LOCAL=0xfffb, CODE=0xfffc, FORW=0xfffd, VARP=0xfffe, NIL=0xffff };
 
 /* NaN-boxing specific functions */
 L box(I t, I i) { i |= t<<48; return *(P)&i; }          /* return NaN-boxed double with tag t and 48 bit ordinal i */
@@ -113,11 +140,12 @@ I equ(L x, L y) { return *(I*)&x == *(I*)&y; }          /* return nonzero if x e
  |      ERROR HANDLING AND ERROR MESSAGES                                     |
 \*----------------------------------------------------------------------------*/
 
-/* state of the setjump-longjmp exception handler with jump buffer jb and number of active root variables n */
+/* state of the setjump-longjmp exception handler of a thread with jump buffer jb, each thread that evaluates has its own.
+   the number of active root variables is counted per environment, in var_num */
 struct State {
   jmp_buf jb;
-  int n;
-} state;
+};
+thread_local struct State state;
 
 /* report and throw an exception */
 #define ERR(n, ...) (fprintf(stderr, __VA_ARGS__), err(n))
@@ -135,6 +163,26 @@ const char *errors[ERRORS+1] = {
 #define A(lispenv) (char*)lispenv->cell                           /* address of the atom heap */
 #define B(lispenv) (char*)lispenv->from                           /* address of the atom "from" heap during garbage collection */
 #define W sizeof(S)                             /* width of the size field of an atom string on the heap, in bytes */
+#define ATOM_TABLE_SIZE 64                      /* initial number of slots in the atom index, must be a power of two */
+#define GLOBALS_SIZE 128                        /* initial number of global variable slots */
+#define SLOT_BITS 24                            /* a LOCAL reference has the depth in the upper and the slot in the lower bits */
+#define SLICE_BITS 24                           /* a SLICE has the generation in the upper and the index in the lower bits */
+#define CODE_SIZE 1024                          /* initial number of instruction words of compiled code */
+#define CONSTS_SIZE 128                         /* initial number of constants of compiled code */
+#define STACK_SIZE 256                          /* initial size of the stack of the virtual machine */
+#define STACK_MAX (1 << 20)                     /* maximum size of the stack of the virtual machine */
+#define REMEMBERED_SIZE 64                      /* initial size of the remembered set of old cells */
+#ifndef NURSERY
+#define NURSERY 8                               /* the nursery of young cells is 1/NURSERY of the size of a heap */
+#endif
+#define NURSERY_CELLS(n) ((n)/NURSERY < 8 ? 8 : (n)/NURSERY)
+#define HEAP_MAX (1 << 20)                      /* default maximum number of cells of a heap */
+
+/* an atom index slot: heap offset i of an ATOM string (0 when empty) and its global variable slot+1 (0 when it has none) */
+typedef struct AtomSlot{
+	I i;
+	unsigned int global;
+}AtomSlot;
 //#define N 8192                                  /* heap size */
 
 
@@ -143,18 +191,58 @@ const char *errors[ERRORS+1] = {
 
 
 
+/* a file mapped by DH_read(), or shared by dibs on it, and the number of slices of it, see f_open() and f_dibs() */
+typedef struct Mapping{
+	Buffer buf;
+	unsigned int refs;
+	Dibs *dibs;   /* NULL if the file was mapped by DH_read() */
+}Mapping;
+
+/* the bytes [offset, offset+size) of a mapped file, a SLICE is its index in the slices of an environment and the
+   generation of the index, which changes when the slice is closed. map is NULL when the slice is closed */
+typedef struct Slice{
+	Mapping *map;
+	unsigned int offset, size;
+	unsigned int gen;
+	unsigned int seen;   /* reachable, marked by major() */
+}Slice;
+
+/* the closure that the messages arriving on input interface name are passed to, see f_interface() and deliver() */
+typedef struct Handler{
+	char name[DH_INTERFACE_NAME_LEN];
+	L f;
+}Handler;
+
+/* what an environment did, see f_stats() */
+typedef struct LispStats{
+	uint64_t steps;              /* the instructions the virtual machine ran and the steps of eval() */
+	uint64_t alloc_bytes;        /* allocated for pairs, frames, atoms and strings */
+	uint64_t minors, majors;     /* the garbage collections of the nursery and of all generations */
+	uint64_t gc_ns, copied_bytes; /* the time they took and the bytes they copied */
+}LispStats;
+
 typedef struct LispEnv{
 	/* hp: heap pointer, A+hp with hp=0 points to the first atom string in heap[]
 	   sp: stack pointer, the stack starts at the top of the primary heap cell[] with sp=N
-	   tr: 0 when tracing is off, 1 or 2 to trace Lisp evaluation steps */
+	   tr: the enabled TRACE_ categories, 0 when tracing is off */
 	I hp;
 	I sp;
 	I tr;
-	unsigned int N;
+	/* N: the number of cells of a heap, which grows and shrinks between N_min and N_max after a full garbage collection */
+	unsigned int N, N_min, N_max;
 	/* we use two heaps: a primary heap cell[] and a secondary heap for the copying garbage collector */
 	L  *cell, *from;
-	/* the roots of the garbage collector is a Lisp list of VARP pointers to global and local variables */
+	/* new pairs and frames are allocated in a nursery of Y cells after the two heaps, which has the indices young to young+Y
+	   relative to cell[] and grows down from ysp. a minor collection promotes its live cells to the old generation in cell[] */
+	I ysp, young;
+	unsigned int Y;
+	/* the remembered set: indices of the old cells that were set to a young cell, marked in card[] to remember them once */
+	I *remembered;
+	unsigned int rem_num, rem_cap;
+	char *card;
+	/* the roots of the garbage collector is a Lisp list of VARP pointers to global and local variables, var_num of them */
 	L vars;
+	int var_num;
 	/* Lisp constant expressions () (nil), #t and the global environment env */
 	L nil, tru, env;
     //char* main_program;
@@ -162,15 +250,50 @@ typedef struct LispEnv{
 
 	L *heap;
 
+	/* open-addressing index of the interned atoms: each slot holds the heap offset of an ATOM string, 0 when empty.
+	   the index is rebuilt by move() while gc() copies the live atoms to the "to" heap */
+	AtomSlot *atoms;
+	unsigned int atom_cap, atom_num;
+
+	/* global variable slots, GC roots: the (v . x) binding pair of a defined global in env, or the ATOM v while unbound */
+	L *globals;
+	unsigned int global_num, global_cap;
+
+	/* compiled code: instruction words of the virtual machine and the constants they use, which are GC roots */
+	uint32_t *code;
+	unsigned int code_num, code_cap;
+	L *consts;
+	unsigned int const_num, const_cap;
+
+	/* stack of the virtual machine with its return addresses, environments and values, which are GC roots */
+	L *vstack;
+	unsigned int vsp, vstack_cap;
+
+	/* the slices of files that are open */
+	Slice *slices;
+	unsigned int slice_num;
+
+	/* the closures that wait for file operations on the I/O threads, GC roots, () when the slot is free, see submit() */
+	L *waits;
+	unsigned int wait_num;
+
+	/* the closures of the input interfaces of the daemon, GC roots */
+	Handler *handlers;
+	unsigned int handler_num;
+
+	LispStats stats;
+
+	/* the top-level forms of the daemon's program, parsed once by load(), and the cursor at the form that runs next, GC roots */
+	L program, cursor;
+
 	// dollhouse daemon
 	Daemon *daemon;
 	char yield; // if true, this lisp env wants to yield control.
-	Buffer output_buffer;
-	char outputName[DH_INTERFACE_NAME_LEN];
+	unsigned int sleep; // milliseconds to wait after a yield before the daemon runs again.
 
 
 	Buffer program_stack[MAX_GOSUB_RECURSE];
-	uint16_t prog_idx_stack[MAX_GOSUB_RECURSE];
+	unsigned int prog_idx_stack[MAX_GOSUB_RECURSE];
 	uint8_t prog_stack_idx;
 
 
@@ -185,31 +308,104 @@ typedef struct LispEnv{
 
 
 Buffer output(L, LispEnv*);
+struct Encoding *message(L, LispEnv*);
+struct Encoding *copy_message(struct Encoding*);
+void free_message(struct Encoding*);
+char *pack_message(struct Encoding*, size_t*);
+struct Encoding *unpack_message(const char*, size_t);
+int encoded(const char*, size_t);
+L unpack(const char*, size_t, LispEnv*);
+int SaveLispImage(const char*, LispEnv*);
 
 
 LispEnv *NewLispEnvironment(unsigned int size, Daemon *daemon){
 	LispEnv *new_environment=(LispEnv*)malloc(sizeof(LispEnv));//+sizeof(L)*2*size);
-	new_environment->heap = (L*)calloc(sizeof(L), 2*size);
+	new_environment->Y = NURSERY_CELLS(size);
+	new_environment->heap = (L*)calloc(sizeof(L), 2*size+new_environment->Y);
 	new_environment->hp=0;
-	new_environment->tr=1;
+	new_environment->tr=0;
+	new_environment->var_num=0;
 	new_environment->cell = new_environment->heap;
 	new_environment->sp = size;
 	new_environment->N = size;
+	new_environment->N_min = size;
+	new_environment->N_max = size > HEAP_MAX ? size : HEAP_MAX;
+	new_environment->young = 2*size;
+	new_environment->ysp = 2*size+new_environment->Y;
+	new_environment->rem_cap = REMEMBERED_SIZE;
+	new_environment->rem_num = 0;
+	new_environment->remembered = (I*)malloc(sizeof(I)*REMEMBERED_SIZE);
+	new_environment->card = (char*)calloc(1, size);
 	new_environment->daemon=daemon;
 	new_environment->yield = 0;
-	new_environment->output_buffer.size=0;
-	new_environment->output_buffer.data=nullptr;
+	new_environment->sleep = 0;
 	new_environment->see='\n';
 	new_environment->ptr="";
 	new_environment->line=NULL;
-	new_environment->prog_stack_idx;
+	new_environment->prog_stack_idx=0;
+	memset(new_environment->program_stack, 0, sizeof(new_environment->program_stack));
+	memset(new_environment->prog_idx_stack, 0, sizeof(new_environment->prog_idx_stack));
+	new_environment->atom_cap = ATOM_TABLE_SIZE;
+	new_environment->atom_num = 0;
+	new_environment->atoms = (AtomSlot*)calloc(sizeof(AtomSlot), ATOM_TABLE_SIZE);
+	new_environment->global_cap = GLOBALS_SIZE;
+	new_environment->global_num = 0;
+	new_environment->globals = (L*)malloc(sizeof(L)*GLOBALS_SIZE);
+	new_environment->code_cap = CODE_SIZE;
+	new_environment->code_num = 0;
+	new_environment->code = (uint32_t*)malloc(sizeof(uint32_t)*CODE_SIZE);
+	new_environment->const_cap = CONSTS_SIZE;
+	new_environment->const_num = 0;
+	new_environment->consts = (L*)malloc(sizeof(L)*CONSTS_SIZE);
+	new_environment->vstack_cap = STACK_SIZE;
+	new_environment->vsp = 0;
+	new_environment->vstack = (L*)malloc(sizeof(L)*STACK_SIZE);
+	new_environment->slices = NULL;
+	new_environment->slice_num = 0;
+	new_environment->waits = NULL;
+	new_environment->wait_num = 0;
+	new_environment->handlers = NULL;
+	new_environment->handler_num = 0;
+	memset(&new_environment->stats, 0, sizeof(LispStats));
+	new_environment->program = new_environment->cursor = box(NIL, 0);
 	return new_environment;
 }
 
 
+/* release a mapping when its last slice is closed */
+void unmap(Mapping *map){
+	if(map->dibs){
+		DH_release_dibs(map->dibs);
+		free(map->dibs);
+	}else
+		DH_release(map->buf);
+	free(map);
+}
+
+/* close slice s, its index is reused by a new slice of the next generation */
+void close_slice(Slice *s){
+	if(--s->map->refs == 0)
+		unmap(s->map);
+	s->map = NULL;
+	s->gen = (s->gen+1) & ((1 << (48-SLICE_BITS))-1);
+}
+
+/* free what an environment allocated, the LispEnv itself is freed by whoever allocated it, see startDaemon() */
 void EraseLispEnvironment(LispEnv *lispenv){
+	free(lispenv->atoms);
+	free(lispenv->globals);
+	free(lispenv->code);
+	free(lispenv->consts);
+	free(lispenv->vstack);
+	free(lispenv->remembered);
+	free(lispenv->card);
 	free(lispenv->heap);
-	free(lispenv);
+	for(unsigned int k=0; k<lispenv->slice_num; k++)
+		if(lispenv->slices[k].map && --lispenv->slices[k].map->refs==0)
+			unmap(lispenv->slices[k].map);
+	free(lispenv->slices);
+	free(lispenv->waits);
+	free(lispenv->handlers);
 }
 
 void print(L, LispEnv*);
@@ -230,25 +426,77 @@ void debugHeapPrintType(int idx, int len, LispEnv *lispenv){
 }
 
 
+/* FNV-1a hash of the atom name s */
+I hash(const char *s) {
+  I h = 14695981039346656037ULL;
+  while (*s)
+    h = (h ^ (unsigned char)*s++) * 1099511628211ULL;
+  return h;
+}
+
+/* return the atom index slot holding the atom named s, or the empty slot where it belongs */
+AtomSlot *atom_slot(const char *s, LispEnv *lispenv) {
+  I mask = lispenv->atom_cap-1, k = hash(s) & mask;
+  while (lispenv->atoms[k].i && strcmp(A(lispenv)+lispenv->atoms[k].i, s))   /* linear probing until a match or an empty slot */
+    k = (k+1) & mask;
+  return &lispenv->atoms[k];
+}
+
+/* add the atom string at heap offset i to the atom index, unless an atom with the same name is indexed */
+void intern(I i, LispEnv *lispenv) {
+  AtomSlot *slot = atom_slot(A(lispenv)+i, lispenv);
+  if (slot->i)
+    return;
+  slot->i = i;
+  slot->global = 0;
+  if (++lispenv->atom_num*4 > lispenv->atom_cap*3) {              /* keep the load factor below 3/4 */
+    AtomSlot *old = lispenv->atoms;
+    I k, cap = lispenv->atom_cap;
+    lispenv->atom_cap *= 2;
+    lispenv->atoms = (AtomSlot*)calloc(sizeof(AtomSlot), lispenv->atom_cap);
+    for (k = 0; k < cap; ++k)
+      if (old[k].i)
+        *atom_slot(A(lispenv)+old[k].i, lispenv) = old[k];
+    free(old);
+  }
+}
+
 /* move ATOM/STRING/PAIR/CLOSURE/MACRO/VARP x from the 1st to the 2nd heap or use its forwarding index, return updated x */
 L move(L x, LispEnv *lispenv) {
-  I t = T(x), i = ord(x);                       /* save the tag and ordinal of x */
+  I t = T(x), i = ord(x), j;                    /* save the tag and ordinal of x */
   if (t == VARP) {                              /* if x is a VARP */
     *(P)i = move(*(P)i, lispenv);                        /*   update the variable by moving its value to the "to" heap */
     return x;                                   /*   return VARP x */
   }
   if ((t & ~(ATOM^STRING)) == ATOM) {             /* if x is an ATOM or a STRING */
-    I j = i-W;                                  /*   j is the index of the size field located before the string */
+    if (lispenv->from == lispenv->cell)         /*   a minor collection does not move atoms and strings */
+      return x;
+    j = i-W;                                    /*   j is the index of the size field located before the string */
     S n = *(S*)(B(lispenv)+j);                           /*   get size n of the string at the "from" heap to move */
     if (n < 0)                                  /*   if the size is negative, it is a forwarding index */
       return box(t, -n);                        /*     return ATOM with forwarded index to the location on "to" heap */
     memcpy(A(lispenv)+lispenv->hp, B(lispenv)+j, W+n);                     /*   move the size field and string from the "from" to the "to" heap */
     *(S*)(B(lispenv)+j) = -(S)(W+lispenv->hp);                    /*   leave a negative forwarding index on the "from" heap */
     lispenv->hp += W+n;                                  /*   increment heap pointer by the number of allocated bytes */
+    if (t == ATOM && *(A(lispenv)+lispenv->hp-n))  /* if x is a named ATOM (alloc() collects before it copies the name) */
+      intern(lispenv->hp-n, lispenv);                    /*     add it to the rebuilt atom index */
     return box(t, lispenv->hp-n);                        /*   return ATOM/STRING with index of the string on the "to" heap */
   }
-  if ((t & ~(PAIR^MACRO)) != PAIR)               /* if x is not a PAIR/CLOSURE/MACRO pair */
+  if (t == SLICE && lispenv->from != lispenv->cell && (i & ((1 << SLICE_BITS)-1)) < lispenv->slice_num)
+    lispenv->slices[i & ((1 << SLICE_BITS)-1)].seen = 1;  /* a major collection marks the slices that are reachable */
+  if (t != FRAME && ((t & ~(PAIR^MACRO)) != PAIR || t == SLICE))  /* if x is not a FRAME or a PAIR/CLOSURE/MACRO pair */
     return x;                                   /*   return x */
+  if (lispenv->from == lispenv->cell && i < lispenv->young)
+    return x;                                   /* a minor collection only moves the young cells */
+  if (t == FRAME) {                             /* if x is a FRAME */
+    if (T(lispenv->from[i]) == FORW)                     /*   if x has a forwarding index on the "from" heap */
+      return box(t, ord(lispenv->from[i]));              /*     return x with updated index pointing to "to" heap */
+    j = 2+(I)lispenv->from[i];                           /*   the header cell holds the number of slots, plus the header and the names */
+    lispenv->sp -= j;                                    /*   move the frame cells from the "from" to the "to" heap */
+    memcpy(&lispenv->cell[lispenv->sp], &lispenv->from[i], sizeof(L)*j);
+    lispenv->from[i] = box(FORW, lispenv->sp);                    /*   leave a forwarding index on the "from" heap */
+    return box(t, lispenv->sp);                          /*   return FRAME with index to the location on the "to" heap */
+  }
   if (T(lispenv->from[i]) == FORW)                       /* if x is a PAIR/CLOSURE/MACRO with forwarding index on the "from" heap */
     return box(t, ord(lispenv->from[i]));                /*   return x with updated index pointing to "to" heap */
   lispenv->cell[--lispenv->sp] = lispenv->from[i+1];                       /* move PAIR/CLOSURE/MACRO pair from the "from" to the "to" heap */
@@ -257,33 +505,190 @@ L move(L x, LispEnv *lispenv) {
   return box(t, lispenv->sp);                            /* return PAIR/CLOSURE/MACRO with index to the location on the "to" heap */
 }
 
-/* garbage collect with root p, returns (moved) p; p=1 forces garbage collection */
-L gc(L p, LispEnv *lispenv) {
-  if (lispenv->hp > (lispenv->sp-2)<<3 || equ(p, 1) || ALWAYS_GC) {
-    BREAK_OFF;                                  /* do not interrupt GC */
-    I i = lispenv->N;                                    /* scan pointer starts at the top of the 2nd heap */
-    lispenv->hp = 0;                                     /* heap pointer starts at the bottom of the 2nd heap */
-    lispenv->sp = lispenv->N;                                     /* stack pointer starts at the top of the 2nd heap */
-    lispenv->from = lispenv->cell;                                /* move cells from the original 1st "from" heap cell[] */
+/* move the roots of the garbage collector: the registered variables, globals, constants, stack, program, waits and
+   interface closures */
+void roots(LispEnv *lispenv) {
+  I k;
+  lispenv->vars = move(lispenv->vars, lispenv);                          /* move the roots */
+  for (k = 0; k < lispenv->global_num; ++k)            /* move the global variable slots */
+    lispenv->globals[k] = move(lispenv->globals[k], lispenv);
+  for (k = 0; k < lispenv->const_num; ++k)             /* move the constants of the compiled code */
+    lispenv->consts[k] = move(lispenv->consts[k], lispenv);
+  for (k = 0; k < lispenv->vsp; ++k)                   /* move the stack of the virtual machine */
+    lispenv->vstack[k] = move(lispenv->vstack[k], lispenv);
+  lispenv->program = move(lispenv->program, lispenv);  /* move the program and its cursor */
+  lispenv->cursor = move(lispenv->cursor, lispenv);
+  for (k = 0; k < lispenv->wait_num; ++k)              /* move the closures that wait for file operations */
+    lispenv->waits[k] = move(lispenv->waits[k], lispenv);
+  for (k = 0; k < lispenv->handler_num; ++k)           /* move the closures of the input interfaces */
+    lispenv->handlers[k].f = move(lispenv->handlers[k].f, lispenv);
+}
+
+/* forget the remembered set and empty the nursery */
+void forget(LispEnv *lispenv) {
+  while (lispenv->rem_num)
+    lispenv->card[lispenv->remembered[--lispenv->rem_num]] = 0;
+  lispenv->ysp = lispenv->young+lispenv->Y;
+}
+
+/* garbage collect all generations with root p into heaps of n cells, returns (moved) p. when n differs from N, the live cells
+   are copied to the first of two new heaps of n cells, which replace the old heaps. the slices that are no longer reachable
+   are closed */
+L major(L p, I n, LispEnv *lispenv) {
+  L *heap = lispenv->heap, *to = NULL;
+  char *card = NULL;
+  I i, k;
+  uint64_t t = monotonicNs();
+  if (n != lispenv->N) {                        /* allocate the new heaps, or keep the old ones when we cannot */
+    to = (L*)calloc(sizeof(L), 2*n+NURSERY_CELLS(n));
+    card = (char*)calloc(1, n);
+    if (!to || !card) {
+      free(to);
+      free(card);
+      to = NULL;
+    }
+  }
+  BREAK_OFF;                                    /* do not interrupt GC */
+  forget(lispenv);
+  lispenv->from = lispenv->cell;                                  /* move cells from the original 1st "from" heap cell[] */
+  if (!to)
     lispenv->cell = &lispenv->heap[lispenv->N *(lispenv->cell == lispenv->heap)];               /* ... to the 2nd heap, which becomes the 1st "to" heap cell[] */
-    lispenv->vars = move(lispenv->vars, lispenv);                          /* move the roots */
-    p = move(p, lispenv);                                /* move p */
-    while (--i >= lispenv->sp)                           /* while the scan pointer did not pass the stack pointer */
-    	lispenv->cell[i] = move(lispenv->cell[i], lispenv);                  /*   move the cell from the "from" heap to the "to" heap */
-    BREAK_ON;                                   /* enable interrupt */
-    if (lispenv->hp > (lispenv->sp-2)<<3)                         /* if the heap is still full after garbage collection */
-      err(7);                                   /*   we ran out of memory */
+  else {                                        /* ... or to the first of the new heaps */
+    lispenv->N = n;
+    lispenv->Y = NURSERY_CELLS(n);
+    lispenv->cell = lispenv->heap = to;
+    free(lispenv->card);
+    lispenv->card = card;
+  }
+  i = lispenv->N;                                        /* scan pointer starts at the top of the 2nd heap */
+  lispenv->hp = 0;                                       /* heap pointer starts at the bottom of the 2nd heap */
+  lispenv->sp = lispenv->N;                                       /* stack pointer starts at the top of the 2nd heap */
+  memset(lispenv->atoms, 0, sizeof(AtomSlot)*lispenv->atom_cap);  /* the atom index is rebuilt as live atoms are moved */
+  lispenv->atom_num = 0;
+  for (k = 0; k < lispenv->slice_num; ++k)               /* the slices are marked as they are moved */
+    lispenv->slices[k].seen = 0;
+  roots(lispenv);
+  p = move(p, lispenv);                                  /* move p */
+  while (--i >= lispenv->sp)                             /* while the scan pointer did not pass the stack pointer */
+    lispenv->cell[i] = move(lispenv->cell[i], lispenv);                  /*   move the cell from the "from" heap to the "to" heap */
+  for (k = 0; k < lispenv->global_num; ++k) {            /* link the atoms of the global variables to their slots again */
+    L v = lispenv->globals[k];
+    if (T(v) == PAIR)                           /*   the car of a binding pair is its variable */
+      v = lispenv->cell[ord(v)+1];
+    intern(ord(v), lispenv);
+    atom_slot(A(lispenv)+ord(v), lispenv)->global = k+1;
   }
+  for (k = 0; k < lispenv->slice_num; ++k)               /* close the open slices that were not marked */
+    if (lispenv->slices[k].map && !lispenv->slices[k].seen)
+      close_slice(&lispenv->slices[k]);
+  if (heap != lispenv->heap)
+    free(heap);
+  lispenv->young = 2*lispenv->N-(lispenv->cell-lispenv->heap);  /* the nursery after the heaps is empty */
+  lispenv->ysp = lispenv->young+lispenv->Y;
+  lispenv->stats.majors++;
+  lispenv->stats.copied_bytes += (lispenv->N-lispenv->sp)*sizeof(L)+lispenv->hp;
+  lispenv->stats.gc_ns += monotonicNs()-t;
+  BREAK_ON;                                     /* enable interrupt */
+  return p;
+}
+
+/* garbage collect all generations with root p to make room for m more cells, returns (moved) p. the heaps grow by doubling
+   while more than half of a heap would be in use and shrink by halving while less than an eighth is, within N_min and N_max */
+L full(L p, I m, LispEnv *lispenv) {
+  I n = lispenv->N, k = lispenv->N-lispenv->sp+((lispenv->hp+7)>>3)+lispenv->young+lispenv->Y-lispenv->ysp;
+  while (k > n)                                 /* the old and the young cells may not fit in a heap of N cells together, */
+    n *= 2;                                     /*   then collect into a larger heap, which is resized below */
+  p = major(p, n, lispenv);
+  n = lispenv->N;
+  k = lispenv->N-lispenv->sp+((lispenv->hp+7)>>3)+m+2;  /* the number of cells in use */
+  TRACE(2, TRACE_GC, lispenv, "gc %llu of %llu cells in use\n", (unsigned long long)k, (unsigned long long)n);
+  while (k > n/2 && n < lispenv->N_max)
+    n = 2*n < lispenv->N_max ? 2*n : lispenv->N_max;
+  while ((k < n/8 || n > lispenv->N_max) && n/2 >= lispenv->N_min && n/2 >= k)
+    n /= 2;
+  if (n > lispenv->N_max && k <= lispenv->N_max)
+    n = lispenv->N_max;
+  if (n != lispenv->N) {
+    p = major(p, n, lispenv);
+    TRACE(2, TRACE_GC, lispenv, "heap resized to %u cells\n", lispenv->N);
+  }
+  if (lispenv->hp+((m+2)<<3) > lispenv->sp<<3 || lispenv->N > lispenv->N_max)  /* if the heap is still full after GC */
+    err(7);                                     /*   we ran out of memory */
+  return p;
+}
+
+/* garbage collect the nursery with root p, returns (moved) p. the live young cells are promoted to the old generation below
+   sp, their roots are the roots of major() and the old cells in the remembered set, so the time it takes is proportional to
+   the young cells that are still live, not to all live cells */
+L minor(L p, LispEnv *lispenv) {
+  BREAK_OFF;
+  I i = lispenv->sp, k;                                  /* scan pointer starts at the old cells that are promoted next */
+  L v;
+  uint64_t t = monotonicNs();
+  lispenv->from = lispenv->cell;                         /* the young "from" cells are in the nursery after cell[] */
+  for (v = lispenv->vars; T(v) == PAIR; v = lispenv->cell[ord(v)])  /* update the registered variables, including those */
+    move(lispenv->cell[ord(v)+1], lispenv);              /*   in old VARP pairs, which are not scanned */
+  roots(lispenv);
+  p = move(p, lispenv);
+  for (k = 0; k < lispenv->rem_num; ++k) {               /* move the young cells that the remembered old cells hold */
+    I j = lispenv->remembered[k];
+    lispenv->cell[j] = move(lispenv->cell[j], lispenv);
+  }
+  while (--i >= lispenv->sp)                             /* scan the promoted cells */
+    lispenv->cell[i] = move(lispenv->cell[i], lispenv);
+  TRACE(2, TRACE_GC, lispenv, "minor gc promoted %llu cells\n", (unsigned long long)(i+1-lispenv->sp));
+  forget(lispenv);
+  lispenv->stats.minors++;
+  lispenv->stats.copied_bytes += (i+1-lispenv->sp)*sizeof(L);
+  lispenv->stats.gc_ns += monotonicNs()-t;
+  BREAK_ON;
+  return p;
+}
+
+/* collect the nursery, or all garbage when the old generation has no room for the cells the nursery may promote */
+L collect(L p, LispEnv *lispenv) {
+  I n = lispenv->young+lispenv->Y-lispenv->ysp;
+  return lispenv->hp+((n+2)<<3) > lispenv->sp<<3 ? full(p, n, lispenv) : minor(p, lispenv);
+}
+
+/* garbage collect with root p when the old generation or the nursery is full, returns (moved) p; p=1 forces garbage
+   collection of all generations */
+L gc(L p, LispEnv *lispenv) {
+  if (lispenv->hp > (lispenv->sp-2)<<3 || equ(p, 1) || ALWAYS_GC)
+    return full(p, 0, lispenv);
+  if (lispenv->ysp < lispenv->young+2)                   /* no room for a new pair in the nursery */
+    return collect(p, lispenv);
   return p;
 }
 
+/* the write barrier: set *p, a root variable or a cell, to x. an old cell that is set to a young cell is remembered, since
+   it is a root of minor(). returns x */
+L set(P p, L x, LispEnv *lispenv) {
+  I k = (I)(p-lispenv->cell);
+  *p = x;
+  if (k < lispenv->N && (T(x) == FRAME || ((T(x) & ~(PAIR^MACRO)) == PAIR && T(x) != SLICE)) && ord(x) >= lispenv->young &&
+      !lispenv->card[k]) {
+    if (lispenv->rem_num == lispenv->rem_cap) {
+      lispenv->rem_cap *= 2;
+      lispenv->remembered = (I*)realloc(lispenv->remembered, sizeof(I)*lispenv->rem_cap);
+    }
+    lispenv->card[k] = 1;
+    lispenv->remembered[lispenv->rem_num++] = k;
+  }
+  return x;
+}
+
 /*----------------------------------------------------------------------------*\
  |      LISP EXPRESSION PAIRTRUCTION AND INSPECTION                           |
 \*----------------------------------------------------------------------------*/
 
 /* allocate n bytes on the heap, returns NaN-boxed t=ATOM or t=STRING */
 L alloc(I t, S n, LispEnv *lispenv) {
-  L x = box(t, W+lispenv->hp);                           /* NaN-boxed ATOM or STRING points to bytes after the size field W */
+  L x;
+  if (lispenv->hp+W+n > (lispenv->sp-2)<<3)             /* make room for the string first, the heaps may grow */
+    full(1, (W+n+7)/8, lispenv);
+  x = box(t, W+lispenv->hp);                           /* NaN-boxed ATOM or STRING points to bytes after the size field W */
+  lispenv->stats.alloc_bytes += W+n;
   *(S*)(A(lispenv)+lispenv->hp) = n;                              /* save size n field in front of the to-be-saved string on the heap */
   *(A(lispenv)+W+lispenv->hp) = 0;                                /* make string empty, just in case */
   lispenv->hp += W+n;                                    /* try to allocate W+n bytes on the heap */
@@ -307,10 +712,13 @@ L dup_n(I t, const char *s, S n, LispEnv *lispenv) {
 
 /* interning of atom names (Lisp symbols), returns a unique NaN-boxed ATOM */
 L atom(const char *s, LispEnv *lispenv) {
-  I i = 0;
-  while (i < lispenv->hp && strcmp(A(lispenv)+W+i, s))            /* search for a matching atom name on the heap */
-    i += W+*(S*)(A(lispenv)+i);
-  return i < lispenv->hp ? box(ATOM, W+i) : dup_(ATOM, s, lispenv);/* if found then return ATOM else copy string to the heap */
+  I i = atom_slot(s, lispenv)->i;                       /* look up the atom name in the atom index */
+  L x;
+  if (i)
+    return box(ATOM, i);                        /* if found then return ATOM */
+  x = dup_(ATOM, s, lispenv);                            /* else copy string to the heap, which may GC and rebuild the index */
+  intern(ord(x), lispenv);
+  return x;
 }
 
 /* store string s on the heap, returns a NaN-boxed STRING with heap offset */
@@ -322,23 +730,24 @@ L stringn(const char *s, unsigned int n, LispEnv *lispenv) {
   return dup_n(STRING, s, n, lispenv);                          /* copy string+\0 to the heap, return NaN-boxed STRING */
 }
 
-/* construct pair (x . y) returns a NaN-boxed PAIR */
+/* construct pair (x . y) in the nursery, which always has room for it, returns a NaN-boxed PAIR */
 L pair(L x, L y, LispEnv *lispenv) {
-  lispenv->cell[--lispenv->sp] = x;                               /* push the car value x, this protects x from getting GC'ed */
-  lispenv->cell[--lispenv->sp] = y;                               /* push the cdr value y, this protects y from getting GC'ed */
-  return gc(box(PAIR, lispenv->sp), lispenv);                     /* make sure we have enough space for the (next) new cons pair */
+  lispenv->stats.alloc_bytes += 2*sizeof(L);
+  lispenv->cell[--lispenv->ysp] = x;                              /* push the car value x, this protects x from getting GC'ed */
+  lispenv->cell[--lispenv->ysp] = y;                              /* push the cdr value y, this protects y from getting GC'ed */
+  return gc(box(PAIR, lispenv->ysp), lispenv);                    /* make sure we have enough space for the (next) new cons pair */
 }
 
 /* return the car of a pair or ERR if not a pair */
 #define FIRST(p, lispenv) lispenv->cell[ord(p)+1]
 L first(L p, LispEnv *lispenv) {
-  return (T(p)&~(PAIR^MACRO)) == PAIR ? FIRST(p, lispenv) : err(1);
+  return (T(p)&~(PAIR^MACRO)) == PAIR && T(p) != SLICE ? FIRST(p, lispenv) : err(1);
 }
 
 /* return the cdr of a pair or ERR if not a pair */
 #define NEXT(p, lispenv) lispenv->cell[ord(p)]
 L next(L p, LispEnv *lispenv) {
-  return (T(p)&~(PAIR^MACRO)) == PAIR ? NEXT(p, lispenv) : err(1);
+  return (T(p)&~(PAIR^MACRO)) == PAIR && T(p) != SLICE ? NEXT(p, lispenv) : err(1);
 }
 
 /* construct a pair to add to environment *e, returns the list ((v . x) . *e) */
@@ -359,18 +768,128 @@ L macro(L v, L x, LispEnv *lispenv) {
   return box(MACRO, ord(pair(v, x, lispenv)));
 }
 
+/* return slot k of a frame, slot 0 holds the variables of the frame */
+#define SLOT(f, k, lispenv) lispenv->cell[ord(f)+1+(k)]
+
+/* construct a frame with a nil slot for each variable in the root variable *v, returns a NaN-boxed FRAME */
+L frame(P v, LispEnv *lispenv) {
+  I n = 0, k, i;
+  L s;
+  for (s = *v; T(s) == PAIR; s = NEXT(s, lispenv))
+    ++n;
+  if (T(s) != NIL)                              /* a dotted variable gets the list of the remaining arguments */
+    ++n;
+  if (n+4 <= lispenv->Y) {                      /* a frame is young when it fits in the nursery with room for a pair */
+    if (lispenv->ysp < lispenv->young+n+4)
+      collect(1, lispenv);
+    lispenv->ysp -= n+2;
+    i = lispenv->ysp;
+  }
+  else {                                        /* a large frame is made in the old generation */
+    if (lispenv->hp+((n+4)<<3) > lispenv->sp<<3)        /* make room for the header, the variables and n slots */
+      full(1, n+2, lispenv);
+    lispenv->sp -= n+2;
+    i = lispenv->sp;
+  }
+  lispenv->stats.alloc_bytes += (n+2)*sizeof(L);
+  lispenv->cell[i] = n;                                  /* the header is the number of slots, which GC leaves as is */
+  set(&lispenv->cell[i+1], *v, lispenv);
+  for (k = 2; k < n+2; ++k)
+    lispenv->cell[i+k] = lispenv->nil;
+  return box(FRAME, i);
+}
+
+/* look up a symbol in an environment of (v . x) pairs and frames, return a pointer to its value or NULL if not found */
+P lookup(L v, L e, LispEnv *lispenv) {
+  for (; T(e) == PAIR; e = NEXT(e, lispenv)) {
+    L d = FIRST(e, lispenv), s;
+    I k = 1;
+    if (T(d) != FRAME) {
+      if (equ(v, first(d, lispenv)))
+        return &NEXT(d, lispenv);
+      continue;
+    }
+    for (s = SLOT(d, 0, lispenv); T(s) == PAIR; s = NEXT(s, lispenv), ++k)
+      if (equ(v, FIRST(s, lispenv)))
+        return &SLOT(d, k, lispenv);
+    if (equ(v, s))
+      return &SLOT(d, k, lispenv);
+  }
+  return NULL;
+}
+
+/* return a pointer to the value of a LOCAL variable reference v: a (v . x) pair or frame slot at a depth in environment e */
+P local(L v, L e, LispEnv *lispenv) {
+  I k = ord(v) >> SLOT_BITS;
+  while (k--)
+    e = NEXT(e, lispenv);
+  e = FIRST(e, lispenv);
+  k = ord(v) & ((1 << SLOT_BITS)-1);
+  return k ? &SLOT(e, k, lispenv) : &NEXT(e, lispenv);
+}
+
+/* return the global variable slot of atom v, allocate an unbound slot for v if it has none */
+unsigned int global(L v, LispEnv *lispenv) {
+  AtomSlot *a = atom_slot(A(lispenv)+ord(v), lispenv);
+  if (!a->i) {                                  /* an atom that was never interned, e.g. made by read */
+    intern(ord(v), lispenv);
+    a = atom_slot(A(lispenv)+ord(v), lispenv);
+  }
+  if (!a->global) {
+    if (lispenv->global_num == lispenv->global_cap) {
+      lispenv->global_cap *= 2;
+      lispenv->globals = (L*)realloc(lispenv->globals, sizeof(L)*lispenv->global_cap);
+    }
+    lispenv->globals[lispenv->global_num] = v;
+    a->global = ++lispenv->global_num;
+  }
+  return a->global-1;
+}
+
+/* bind global variable slot k to x, an unbound slot gets a new (v . x) pair in the global environment */
+void bind(unsigned int k, L x, LispEnv *lispenv) {
+  if (T(lispenv->globals[k]) == PAIR)
+    set(&NEXT(lispenv->globals[k], lispenv), x, lispenv);
+  else {
+    lispenv->env = env_pair(lispenv->globals[k], x, &lispenv->env, lispenv);
+    lispenv->globals[k] = FIRST(lispenv->env, lispenv);
+  }
+}
+
+/* return the name of variable v, which is an ATOM or a GLOBAL or LOCAL variable reference in environment e */
+L name(L v, L e, LispEnv *lispenv) {
+  I k;
+  if (T(v) == GLOBAL) {
+    v = lispenv->globals[ord(v)];
+    return T(v) == PAIR ? FIRST(v, lispenv) : v;
+  }
+  if (T(v) != LOCAL)
+    return v;
+  for (k = ord(v) >> SLOT_BITS; k--; e = NEXT(e, lispenv))
+    continue;
+  e = FIRST(e, lispenv);
+  if (!(k = ord(v) & ((1 << SLOT_BITS)-1)))
+    return FIRST(e, lispenv);
+  for (e = SLOT(e, 0, lispenv); --k; e = NEXT(e, lispenv))
+    continue;
+  return T(e) == PAIR ? FIRST(e, lispenv) : e;
+}
+
+/* return the value of a GLOBAL variable reference v or ERR if unbound */
+L value(L v, LispEnv *lispenv) {
+  L x = ord(v) < lispenv->global_num ? lispenv->globals[ord(v)] : lispenv->nil;
+  return T(x) == PAIR ? NEXT(x, lispenv) : T(x) == ATOM ? ERR(3, "unbound %s ", A(lispenv)+ord(x)) : err(3);
+}
+
 /* look up a symbol in an environment, return its value or ERR if not found */
 L assoc(L v, L e, LispEnv *lispenv) {
+  P p;
   if(strlen(A(lispenv)+ord(v))==0) return lispenv->nil; // empty atoms are nil.
 
-  while (T(e) == PAIR && !equ(v, first(first(e, lispenv), lispenv)))
-    e = next(e, lispenv);
-
+  p = lookup(v, e, lispenv);
 
-  printf("heap @: %i\n", ord(v));
-  //if(ord(v)==2850)
-  //  debugHeapPrint(0,1<<12, lispenv);
-  return T(e) == PAIR ? next(first(e, lispenv), lispenv) : T(v) == ATOM ? ERR(3, "unbound %s ", A(lispenv)+ord(v)) : err(3);
+  TRACE(3, TRACE_VARS, lispenv, "lookup %s\n", A(lispenv)+ord(v));
+  return p ? *p : T(v) == ATOM ? ERR(3, "unbound %s ", A(lispenv)+ord(v)) : err(3);
 }
 
 /* not(x) is nonzero if x is the Lisp () empty list */
@@ -386,14 +905,14 @@ I more(L t, LispEnv *lispenv) {
 /* register n variables as roots for garbage collection, all but the first should be nil */
 void var(int n, LispEnv *lispenv, ...) {
   va_list v;
-  for (va_start(v, n); n--; ++state.n)
+  for (va_start(v, n); n--; ++lispenv->var_num)
 	  lispenv->vars = pair(box(VARP, (I)va_arg(v, P)), lispenv->vars, lispenv);
   va_end(v);
 }
 
 /* release n registered variables */
 void unwind(int n, LispEnv *lispenv) {
-  state.n -= n;
+  lispenv->var_num -= n;
   while (n--)
 	  lispenv->vars = next(lispenv->vars, lispenv);
 }
@@ -423,11 +942,11 @@ void print(L, LispEnv*);
 /* tokenization buffer, the next character we're looking at, the readline line, prompt and input file */
 //char buf[256], see = '\n', *ptr = "", *line = NULL, ps[20];
 
-/* advance to the next character */
+/* advance to the next character, which is 0 at the end of the input */
 void look(LispEnv *lispenv) {
-
-  lispenv->see = lispenv->program_stack[lispenv->prog_stack_idx].data[lispenv->prog_idx_stack[lispenv->prog_stack_idx]++];
-  return;
+  Buffer *b = &lispenv->program_stack[lispenv->prog_stack_idx];
+  unsigned int *k = &lispenv->prog_idx_stack[lispenv->prog_stack_idx];
+  lispenv->see = *k < b->size ? b->data[(*k)++] : 0;
 }
 
 //  int c;
@@ -478,14 +997,21 @@ char get(LispEnv* lispenv) {
   return c;
 }
 
-/* tokenize into buf[], return first character of buf[] */
-char scan(LispEnv *lispenv) {
-  int i = 0;
-  while (seeing(' ',lispenv) || seeing(';',lispenv))            /* skip white space and ;-comments */
+/* skip white space and ;-comments, the input ends when we see 0 afterwards */
+void skip(LispEnv *lispenv) {
+  while (seeing(' ',lispenv) || seeing(';',lispenv))
     if (get(lispenv) == ';')
-      while (!seeing('\n',lispenv))                     /* skip ;-comment until newline */
+      while (!seeing('\n',lispenv) && lispenv->see)    /* skip ;-comment until newline */
         look(lispenv);
-  if (seeing('"',lispenv)) {                            /* tokenize a quoted string */
+}
+
+/* tokenize into buf[], return first character of buf[], which is 0 at the end of the input */
+char scan(LispEnv *lispenv) {
+  int i = 0;
+  skip(lispenv);
+  if (!lispenv->see)
+    ;
+  else if (seeing('"',lispenv)) {                            /* tokenize a quoted string */
     do {
       lispenv->buf[i++] = get(lispenv);
       while (seeing('\\',lispenv) && i < sizeof(lispenv->buf)-1) {
@@ -496,7 +1022,7 @@ char scan(LispEnv *lispenv) {
         lispenv->buf[i++] = esc ? esc-abtnvfr+7 : lispenv->see;   /* replace \x with an escaped code or x itself */
         get(lispenv);
       }
-    } while (i <  sizeof(lispenv->buf)-1 && !seeing('"',lispenv) && !seeing('\n',lispenv));
+    } while (i <  sizeof(lispenv->buf)-1 && !seeing('"',lispenv) && !seeing('\n',lispenv) && lispenv->see);
     if (get(lispenv) != '"')
       ERR(8, "missing \" ");
   }
@@ -504,7 +1030,7 @@ char scan(LispEnv *lispenv) {
 	  lispenv->buf[i++] = get(lispenv);                           /* ( ) ' ` , are single-character tokens */
   else                                          /* tokenize a symbol or a number */
     do lispenv->buf[i++] = get(lispenv);
-    while (i <  sizeof(lispenv->buf)-1 && !seeing('(',lispenv) && !seeing(')',lispenv) && !seeing(' ',lispenv));
+    while (i <  sizeof(lispenv->buf)-1 && !seeing('(',lispenv) && !seeing(')',lispenv) && !seeing(' ',lispenv) && lispenv->see);
   lispenv->buf[i] = 0;
 
   return *lispenv->buf;                                  /* return first character of token in buf[] */
@@ -586,8 +1112,7 @@ L betterreadlisp2(const char* string, LispEnv *lispenv){
 
 /* return the Lisp expression parsed and read from input */
 L readlisp(LispEnv *lispenv) {
-  //printf("%s", lispenv->program_stack[lispenv->prog_stack_idx].data+lispenv->prog_idx_stack[lispenv->prog_stack_idx]);
-  printf("%s\n", lispenv->ptr);
+  TRACE(3, TRACE_READ, lispenv, "read %s\n", lispenv->ptr);
   scan(lispenv);
   return parse(lispenv);
 }
@@ -609,15 +1134,17 @@ L list(LispEnv *lispenv) {
   L t = lispenv->nil, p = lispenv->nil, x;
   var(2, lispenv, &t, &p);
   while (scan(lispenv) != ')') {
+    if (!*lispenv->buf)                         /* the input ended before the list */
+      ERR(8, "expecting ) ");
     if (*lispenv->buf == '.' && !lispenv->buf[1]) {               /* parse list with dot pair ( <expr> ... <expr> . <expr> ) */
       x = readlisp(lispenv);                           /* read expression to replace the last nil at the end of the list */
       if (scan(lispenv) != ')')
         ERR(8, "expecting ) ");
-      *(T(p) == PAIR ? &NEXT(p, lispenv) : &t) = x;
+      set(T(p) == PAIR ? &NEXT(p, lispenv) : &t, x, lispenv);
       break;
     }
     x = pair(parse(lispenv), lispenv->nil, lispenv);                     /* next parsed expression for the list, construct before using p and t */
-    p = *(T(p) == PAIR ? &NEXT(p, lispenv) : &t) = x;     /* p is the cdr or head of the list to replace with rest of the list */
+    p = set(T(p) == PAIR ? &NEXT(p, lispenv) : &t, x, lispenv);     /* p is the cdr or head of the list to replace with rest of the list */
   }
   return return_value(2, t, lispenv);
 }
@@ -633,11 +1160,11 @@ L betterlist(Buffer buffer, LispEnv *lispenv) {
       x = betterreadlisp(buffer, lispenv);                           // read expression to replace the last nil at the end of the list
       if (buffer[i] != ')')
         ERR(8, "expecting ) ");
-      *(T(p) == PAIR ? &NEXT(p, lispenv) : &t) = x;
+      set(T(p) == PAIR ? &NEXT(p, lispenv) : &t, x, lispenv);
       break;
     }
     x = pair(betterParse(buffer, lispenv), lispenv->nil, lispenv);                     // next parsed expression for the list, construct before using p and t
-    p = *(T(p) == PAIR ? &NEXT(p, lispenv) : &t) = x;     // p is the cdr or head of the list to replace with rest of the list
+    p = set(T(p) == PAIR ? &NEXT(p, lispenv) : &t, x, lispenv);     // p is the cdr or head of the list to replace with rest of the list
   }
   return return_value(2, t, lispenv);
 }
@@ -656,15 +1183,17 @@ L tick(LispEnv *lispenv) {
   var(2, lispenv, &t, &p);
   t = p = pair(atom("list", lispenv), lispenv->nil, lispenv);
   while (scan(lispenv) != ')') {
+    if (!*lispenv->buf)
+      ERR(8, "expecting ) ");
     if (*lispenv->buf == '.' && !lispenv->buf[1]) {               /* tick list with dot pair ( <expr> ... <expr> . <expr> ) */
       x = readlisp(lispenv);                           /* read expression to replace the last nil at the end of the list */
       if (scan(lispenv) != ')')
         ERR(8, "expecing ) ");
-      *(T(p) == PAIR ? &NEXT(p,lispenv) : &t) = x;
+      set(T(p) == PAIR ? &NEXT(p,lispenv) : &t, x, lispenv);
       break;
     }
     x = pair(tick(lispenv), lispenv->nil, lispenv);                      /* next ticked item for the list, construct before using p */
-    p = NEXT(p,lispenv) = x;                             /* p is the cdr to replace it with the rest of the list */
+    p = set(&NEXT(p, lispenv), x, lispenv);                             /* p is the cdr to replace it with the rest of the list */
   }
   return return_value(2, t, lispenv);                             /* return (list <expr> ... <expr>) */
 }
@@ -688,11 +1217,11 @@ L bettertick(Buffer buf, LispEnv *lispenv) {
       x = readlisp(lispenv);                           // read expression to replace the last nil at the end of the list
       if (scan() != ')')
         ERR(8, "expecting ) ");
-      *(T(p) == PAIR ? &NEXT(p,lispenv) : &t) = x;
+      set(T(p) == PAIR ? &NEXT(p,lispenv) : &t, x, lispenv);
       break;
     }
     x = pair(tick(lispenv), lispenv->nil, lispenv);                      // next ticked item for the list, construct before using p
-    p = NEXT(p,lispenv) = x;                             // p is the cdr to replace it with the rest of the list
+    p = set(&NEXT(p, lispenv), x, lispenv);                             // p is the cdr to replace it with the rest of the list
   }
   return return_value(2, t, lispenv);                             // return (list <expr> ... <expr>)
 }
@@ -709,6 +1238,7 @@ L parse(LispEnv *lispenv) {
     case '`':  scan(lispenv); return tick(lispenv);           /* if token is a ` then list/quote-convert an expression */
     case '"':  return string(lispenv->buf+1, lispenv);            /* if token is a string, then return a new string */
     case ')':  return ERR(8, "unexpected ) ");
+    case 0:    return ERR(8, "unexpected end ");
   }
   if (sscanf(lispenv->buf, "%lg%n", &x, &i) > 0 && !lispenv->buf[i])
     return x;                                   /* return a number, including inf, -inf and nan */
@@ -744,8 +1274,8 @@ L betterParse(Buffer buf, LispEnv *lispenv){
  |      PRIMITIVEITIVES -- SEE THE TABLE WITH COMMENTS FOR DETAILS                 |
 \*----------------------------------------------------------------------------*/
 
-/* the file we are writing to, stdout by default */
-FILE *out = stdout;
+/* the file the thread is writing to, stdout by default */
+thread_local FILE *out = stdout;
 
 
 
@@ -755,88 +1285,155 @@ L evlis(P t, P e, LispEnv *lispenv) {
   var(2, lispenv, &s, &p);                               /* register s and p for GC updates */
   for (; T(*t) == PAIR; *t = next(*t, lispenv)) {         /* iterate over the list of arguments */
     L x = pair(eval(first(*t, lispenv), e, lispenv), lispenv->nil, lispenv);          /* evaluate argument */
-    p = *(T(p) == PAIR ? &NEXT(p, lispenv) : &s) = x;     /* build the evaluated list s */
+    p = set(T(p) == PAIR ? &NEXT(p, lispenv) : &s, x, lispenv);     /* build the evaluated list s */
   }
   if (T(*t) != NIL) {                           /* dot list arguments? */
     L x = eval(*t, e, lispenv);                          /* evaluate the dotted argument */
-    *(T(p) == PAIR ? &NEXT(p, lispenv) : &s) = x;         /* build the evaluated list s */
+    set(T(p) == PAIR ? &NEXT(p, lispenv) : &s, x, lispenv);         /* build the evaluated list s */
   }
   return return_value(2, s, lispenv);                             /* return the list s of evaluated arguments */
 }
 
-L f_type(P t, P e, LispEnv *lispenv) {
-  L x = first(evlis(t, e, lispenv), lispenv);
+void push(L, LispEnv*);
+
+/* apply function primitive fn to the values of the arguments in list t evaluated in environment e. the values are pushed
+   on the stack of the virtual machine, which is a root for garbage collection, and fn takes them there in place */
+L apply(L (*fn)(L*, int, LispEnv*), P t, P e, LispEnv *lispenv) {
+  unsigned int base = lispenv->vsp;
+  L x;
+  for (; T(*t) == PAIR; set(t, next(*t, lispenv), lispenv)) {
+    x = eval(first(*t, lispenv), e, lispenv);
+    push(x, lispenv);
+  }
+  if (T(*t) != NIL) {                           /* dot list arguments: push the items of the list it evaluates to */
+    for (x = eval(*t, e, lispenv); T(x) == PAIR; x = NEXT(x, lispenv))
+      push(FIRST(x, lispenv), lispenv);
+    if (T(x) != NIL)
+      push(x, lispenv);
+  }
+  x = fn(lispenv->vstack+base, lispenv->vsp-base, lispenv);
+  lispenv->vsp = base;
+  return x;
+}
+
+/* the k-th of the n arguments a[] passed to a function primitive, ERR if there are fewer */
+L arg(L *a, int n, int k, LispEnv *lispenv) {
+  return k < n ? a[k] : err(1);
+}
+
+/* return the open slice x, an error if x is not a slice or it was closed */
+Slice *slice(L x, LispEnv *lispenv) {
+  I k = ord(x) & ((1 << SLICE_BITS)-1);
+  if (T(x) != SLICE || k >= lispenv->slice_num || !lispenv->slices[k].map || lispenv->slices[k].gen != ord(x) >> SLICE_BITS)
+    err(5);
+  return &lispenv->slices[k];
+}
+
+/* return a new SLICE of the bytes [offset, offset+size) of mapped file map */
+L new_slice(Mapping *map, unsigned int offset, unsigned int size, LispEnv *lispenv) {
+  unsigned int k;
+  for (k = 0; k < lispenv->slice_num && lispenv->slices[k].map; ++k)     /* reuse a closed slice */
+    continue;
+  if (k == (1 << SLICE_BITS)-1)
+    err(7);
+  if (k == lispenv->slice_num && !(k & (k+1)))                            /* all 2^m-1 slices are used, grow to 2^(m+1)-1 */
+    lispenv->slices = (Slice*)realloc(lispenv->slices, sizeof(Slice)*(2*k+1));
+  if (k == lispenv->slice_num) {
+    ++lispenv->slice_num;
+    lispenv->slices[k].gen = 0;
+  }
+  lispenv->slices[k].map = map;
+  lispenv->slices[k].offset = offset;
+  lispenv->slices[k].size = size;
+  ++map->refs;
+  return box(SLICE, (I)lispenv->slices[k].gen << SLICE_BITS | k);
+}
+
+/* the type of x, the integer part of n, x < y and x eq? y, shared by the primitives and the virtual machine */
+L lisp_type(L x) {
   return T(x) == NIL ? -1.0 : T(x) >= PRIMITIVE && T(x) <= MACRO ? T(x) - PRIMITIVE + 1 : 0.0;
 }
 
-L f_eval(P t, P e, LispEnv *lispenv) {
-  return first(evlis(t, e, lispenv), lispenv);
+L lisp_int(L n) {
+  return n < 1e16 && n > -1e16 ? (int64_t)n : n;
+}
+
+L lisp_lt(L x, L y, LispEnv *lispenv) {
+  return (T(x) == T(y) && (T(x) & ~(ATOM^STRING)) == ATOM ? strcmp(A(lispenv)+ord(x), A(lispenv)+ord(y)) < 0 :
+      x == x && y == y ? x < y :
+      T(x) < T(y)) ? lispenv->tru : lispenv->nil;
+}
+
+L lisp_eq(L x, L y, LispEnv *lispenv) {
+  return (T(x) == STRING && T(y) == STRING ? !strcmp(A(lispenv)+ord(x), A(lispenv)+ord(y)) : equ(x, y)) ? lispenv->tru : lispenv->nil;
+}
+
+L f_type(L *a, int n, LispEnv *lispenv) {
+  return lisp_type(arg(a, n, 0, lispenv));
+}
+
+L f_eval(L *a, int n, LispEnv *lispenv) {
+  return arg(a, n, 0, lispenv);
 }
 
 L f_quote(P t, P _, LispEnv *lispenv) {
   return first(*t, lispenv);
 }
 
-L f_pair(P t, P e, LispEnv *lispenv) {
-  L s = evlis(t, e, lispenv);
-  return pair(first(s, lispenv), first(next(s, lispenv), lispenv), lispenv);
+L f_pair(L *a, int n, LispEnv *lispenv) {
+  return pair(arg(a, n, 0, lispenv), arg(a, n, 1, lispenv), lispenv);
 }
 
-L f_first(P t, P e, LispEnv *lispenv) {
-  return first(first(evlis(t, e, lispenv), lispenv), lispenv);
+L f_first(L *a, int n, LispEnv *lispenv) {
+  return first(arg(a, n, 0, lispenv), lispenv);
 }
 
-L f_next(P t, P e, LispEnv *lispenv) {
-  return next(first(evlis(t, e, lispenv), lispenv), lispenv);
+L f_next(L *a, int n, LispEnv *lispenv) {
+  return next(arg(a, n, 0, lispenv), lispenv);
 }
 
-L f_add(P t, P e, LispEnv *lispenv) {
-  L s = evlis(t, e, lispenv), n = first(s, lispenv);
-  while (!lisp_not(s = next(s, lispenv)))
-    n += first(s, lispenv);
-  return num(n);
+L f_add(L *a, int n, LispEnv *lispenv) {
+  L x = arg(a, n, 0, lispenv);
+  for (int k = 1; k < n; ++k)
+    x += a[k];
+  return num(x);
 }
 
-L f_sub(P t, P e, LispEnv *lispenv) {
-  L s = evlis(t, e, lispenv), n = lisp_not(next(s, lispenv)) ? -first(s, lispenv) : first(s, lispenv);
-  while (!lisp_not(s = next(s, lispenv)))
-    n -= first(s, lispenv);
-  return num(n);
+L f_sub(L *a, int n, LispEnv *lispenv) {
+  L x = n == 1 ? -a[0] : arg(a, n, 0, lispenv);
+  for (int k = 1; k < n; ++k)
+    x -= a[k];
+  return num(x);
 }
 
-L f_mul(P t, P e, LispEnv *lispenv) {
-  L s = evlis(t, e, lispenv), n = first(s, lispenv);
-  while (!lisp_not(s = next(s, lispenv)))
-    n *= first(s, lispenv);
-  return num(n);
+L f_mul(L *a, int n, LispEnv *lispenv) {
+  L x = arg(a, n, 0, lispenv);
+  for (int k = 1; k < n; ++k)
+    x *= a[k];
+  return num(x);
 }
 
-L f_div(P t, P e, LispEnv *lispenv) {
-  L s = evlis(t, e, lispenv), n = lisp_not(next(s, lispenv)) ? 1.0/first(s, lispenv) : first(s, lispenv);
-  while (!lisp_not(s = next(s, lispenv)))
-    n /= first(s, lispenv);
-  return num(n);
+L f_div(L *a, int n, LispEnv *lispenv) {
+  L x = n == 1 ? 1.0/a[0] : arg(a, n, 0, lispenv);
+  for (int k = 1; k < n; ++k)
+    x /= a[k];
+  return num(x);
 }
 
-L f_int(P t, P e, LispEnv *lispenv) {
-  L n = first(evlis(t, e, lispenv), lispenv);
-  return n < 1e16 && n > -1e16 ? (int64_t)n : n;
+L f_int(L *a, int n, LispEnv *lispenv) {
+  return lisp_int(arg(a, n, 0, lispenv));
 }
 
-L f_lt(P t, P e, LispEnv *lispenv) {
-  L s = evlis(t, e, lispenv), x = first(s, lispenv), y = first(next(s, lispenv), lispenv);
-  return (T(x) == T(y) && (T(x) & ~(ATOM^STRING)) == ATOM ? strcmp(A(lispenv)+ord(x), A(lispenv)+ord(y)) < 0 :
-      x == x && y == y ? x < y :
-      T(x) < T(y)) ? lispenv->tru : lispenv->nil;
+L f_lt(L *a, int n, LispEnv *lispenv) {
+  return lisp_lt(arg(a, n, 0, lispenv), arg(a, n, 1, lispenv), lispenv);
 }
 
-L f_eq(P t, P e, LispEnv *lispenv) {
-  L s = evlis(t, e, lispenv), x = first(s, lispenv), y = first(next(s, lispenv), lispenv);
-  return (T(x) == STRING && T(y) == STRING ? !strcmp(A(lispenv)+ord(x), A(lispenv)+ord(y)) : equ(x, y)) ? lispenv->tru : lispenv->nil;
+L f_eq(L *a, int n, LispEnv *lispenv) {
+  return lisp_eq(arg(a, n, 0, lispenv), arg(a, n, 1, lispenv), lispenv);
 }
 
-L f_not(P t, P e, LispEnv *lispenv) {
-  return lisp_not( first(evlis(t, e, lispenv), lispenv)) ? lispenv->tru : lispenv->nil;;
+L f_not(L *a, int n, LispEnv *lispenv) {
+  return lisp_not(arg(a, n, 0, lispenv)) ? lispenv->tru : lispenv->nil;
 }
 
 L f_or(P t, P e, LispEnv *lispenv) {
@@ -853,8 +1450,11 @@ L f_and(P t, P e, LispEnv *lispenv) {
   return x;
 }
 
-L f_list(P t, P e, LispEnv *lispenv) {
-  return evlis(t, e, lispenv);
+L f_list(L *a, int n, LispEnv *lispenv) {
+  L x = lispenv->nil;
+  while (n--)
+    x = pair(a[n], x, lispenv);
+  return x;
 }
 
 L f_begin(P t, P e, LispEnv *lispenv) {
@@ -893,23 +1493,24 @@ L f_macro(P t, P e, LispEnv *lispenv) {
 }
 
 L f_define(P t, P e, LispEnv *lispenv) {
-  L x = eval(first(next(*t, lispenv), lispenv), e, lispenv), v = first(*t, lispenv), d;
-
-  for (d = *e; T(d) == PAIR && !equ(v, first(first(d, lispenv), lispenv)); d = next(d, lispenv))
-    continue;
-  if (T(d) == PAIR)
-    NEXT(first(d, lispenv), lispenv) = x;
+  L x = eval(first(next(*t, lispenv), lispenv), e, lispenv), v = first(*t, lispenv);
+  P p;
+
+  if (T(v) == LOCAL)
+    set(local(v, *e, lispenv), x, lispenv);
+  else if (T(v) == ATOM && (p = lookup(v, *e, lispenv)))
+    set(p, x, lispenv);
+  else if (T(v) == GLOBAL || T(v) == ATOM)
+    bind(T(v) == GLOBAL ? ord(v) : global(v, lispenv), x, lispenv);
   else
-	lispenv->env = env_pair(v, x, &lispenv->env, lispenv);
-
-  print(lispenv->env, lispenv);
+    err(5);
+  TRACE(3, TRACE_VARS, lispenv, "define %s\n", A(lispenv)+ord(name(first(*t, lispenv), *e, lispenv)));
 
-  return first(*t, lispenv);
+  return name(first(*t, lispenv), *e, lispenv);
 }
 
-L f_assoc(P t, P e, LispEnv *lispenv) {
-  L s = evlis(t, e, lispenv);
-  return assoc(first(s, lispenv), first(next(s, lispenv), lispenv), lispenv);
+L f_assoc(L *a, int n, LispEnv *lispenv) {
+  return assoc(arg(a, n, 0, lispenv), arg(a, n, 1, lispenv), lispenv);
 }
 
 L f_env(P _, P e, LispEnv *lispenv) {
@@ -946,7 +1547,7 @@ L f_letrec(P t, P e, LispEnv *lispenv) {
   for (s = *e; more(*t, lispenv); s = next(s, lispenv), *t = next(*t, lispenv)) {
     x = next(first(*t, lispenv), lispenv);
     x = eval(f_begin(&x, e, lispenv), e, lispenv);
-    NEXT(first(s,lispenv),lispenv) = x;
+    set(&NEXT(first(s,lispenv),lispenv), x, lispenv);
   }
   return return_value(2, T(*t) == NIL ? lispenv->nil : first(*t, lispenv), lispenv);
 }
@@ -958,47 +1559,49 @@ L f_letreca(P t, P e, LispEnv *lispenv) {
     *e = env_pair(first(first(*t, lispenv), lispenv), lispenv->nil, e, lispenv);
     s = next(first(*t, lispenv), lispenv);
     x = eval(f_begin(&s, e, lispenv), e, lispenv);
-    NEXT(first(*e,lispenv),lispenv) = x;
+    set(&NEXT(first(*e,lispenv),lispenv), x, lispenv);
   }
   return return_value(1, T(*t) == NIL ? lispenv->nil : first(*t, lispenv), lispenv);
 }
 
 L f_setq(P t, P e, LispEnv *lispenv) {
-  L x = eval(first(next(*t, lispenv), lispenv), e, lispenv), v = first(*t, lispenv), d;
-  for (d = *e; T(d) == PAIR && !equ(v, first(first(d, lispenv), lispenv)); d = next(d, lispenv))
-    continue;
-  return T(d) == PAIR ? NEXT(first(d,lispenv),lispenv) = x : T(v) == ATOM ? ERR(3, "unbound %s ", A(lispenv)+ord(v)) : err(3);
+  L x = eval(first(next(*t, lispenv), lispenv), e, lispenv), v = first(*t, lispenv);
+  P p = T(v) == LOCAL ? local(v, *e, lispenv) : T(v) == ATOM ? lookup(v, *e, lispenv) : NULL;
+  if (p)
+    return set(p, x, lispenv);
+  if (T(v) == GLOBAL && T(lispenv->globals[ord(v)]) == PAIR)
+    return set(&NEXT(lispenv->globals[ord(v)], lispenv), x, lispenv);
+  v = name(v, *e, lispenv);
+  return T(v) == ATOM ? ERR(3, "unbound %s ", A(lispenv)+ord(v)) : err(3);
 }
 
-L f_setfirst(P t, P e, LispEnv *lispenv) {
-  L s = evlis(t, e, lispenv), p = first(s, lispenv);
-  return (T(p) == PAIR) ? FIRST(p,lispenv) = first(next(s,lispenv),lispenv) : err(1);
+L f_setfirst(L *a, int n, LispEnv *lispenv) {
+  L p = arg(a, n, 0, lispenv);
+  return (T(p) == PAIR) ? set(&FIRST(p,lispenv), arg(a, n, 1, lispenv), lispenv) : err(1);
 }
 
-L f_setnext(P t, P e, LispEnv *lispenv) {
-  L s = evlis(t, e, lispenv), p = first(s, lispenv);
-  return (T(p) == PAIR) ? NEXT(p,lispenv) = first(next(s,lispenv),lispenv) : err(1);
+L f_setnext(L *a, int n, LispEnv *lispenv) {
+  L p = arg(a, n, 0, lispenv);
+  return (T(p) == PAIR) ? set(&NEXT(p,lispenv), arg(a, n, 1, lispenv), lispenv) : err(1);
 }
 
 
 
-L f_print(P t, P e, LispEnv *lispenv) {
-  L s;
-  for (s = evlis(t, e, lispenv); T(s) != NIL; s = next(s, lispenv))
-    print(first(s, lispenv), lispenv);
+L f_print(L *a, int n, LispEnv *lispenv) {
+  for (int k = 0; k < n; ++k)
+    print(a[k], lispenv);
   return lispenv->nil;
 }
 
-L f_println(P t, P e, LispEnv *lispenv) {
-  f_print(t, e, lispenv);
+L f_println(L *a, int n, LispEnv *lispenv) {
+  f_print(a, n, lispenv);
   putc('\n', out);
   return lispenv->nil;
 }
 
-L f_write(P t, P e, LispEnv *lispenv) {
-  L s;
-  for (s = evlis(t, e, lispenv); T(s) != NIL; s = next(s, lispenv)) {
-    L x = first(s, lispenv);
+L f_write(L *a, int n, LispEnv *lispenv) {
+  for (int k = 0; k < n; ++k) {
+    L x = a[k];
     if (T(x) == STRING)
       fprintf(out, "%s", A(lispenv)+ord(x));
     else
@@ -1007,31 +1610,37 @@ L f_write(P t, P e, LispEnv *lispenv) {
   return lispenv->nil;
 }
 
-L f_string(P t, P e, LispEnv *lispenv) {
-  L s, x; S n;
-  for (n = 0, s = *t = evlis(t, e, lispenv); T(s) != NIL; s = next(s, lispenv)) {
-    L y = first(s, lispenv);
+L f_string(L *a, int n, LispEnv *lispenv) {
+  L x; S i; int k;
+  for (i = 0, k = 0; k < n; ++k) {
+    L y = a[k];
     if ((T(y) & ~(ATOM^STRING)) == ATOM)
-      n += strlen(A(lispenv)+ord(y));
+      i += strlen(A(lispenv)+ord(y));
     else if (T(y) == PAIR)
       for (; T(y) == PAIR; y = next(y, lispenv))
-        ++n;
+        ++i;
+    else if (T(y) == SLICE)
+      i += slice(y, lispenv)->size;
     else if (y == y)
-      n += snprintf(lispenv->buf, sizeof(lispenv->buf), FLOAT, y);
+      i += snprintf(lispenv->buf, sizeof(lispenv->buf), FLOAT, y);
   }
-  x = alloc(STRING, n+1, lispenv);
-  n = ord(x);
-  for (s = *t; T(s) != NIL; s = next(s, lispenv)) {
-    L y = first(s, lispenv);
+  x = alloc(STRING, i+1, lispenv);              /* may collect garbage, which updates the arguments a[] in place */
+  i = ord(x);
+  for (k = 0; k < n; ++k) {
+    L y = a[k];
     if ((T(y) & ~(ATOM^STRING)) == ATOM)
-      n += strlen(strcpy(A(lispenv)+n, A(lispenv)+ord(y)));
+      i += strlen(strcpy(A(lispenv)+i, A(lispenv)+ord(y)));
     else if (T(y) == PAIR)
       for (; T(y) == PAIR; y = next(y, lispenv))
-        *(A(lispenv)+n++) = first(y, lispenv);
+        *(A(lispenv)+i++) = first(y, lispenv);
+    else if (T(y) == SLICE) {                   /* copy the bytes of the file, up to a 0 */
+      Slice *s = slice(y, lispenv);
+      i += strnlen((char*)memcpy(A(lispenv)+i, s->map->buf.data+s->offset, s->size), s->size);
+    }
     else if (y == y)
-      n += snprintf(A(lispenv)+n, sizeof(lispenv->buf), FLOAT, y);
+      i += snprintf(A(lispenv)+i, sizeof(lispenv->buf), FLOAT, y);
   }
-  *(A(lispenv)+n) = 0;
+  *(A(lispenv)+i) = 0;
   return x;
 }
 
@@ -1047,7 +1656,7 @@ L f_string(P t, P e, LispEnv *lispenv) {
 //TODO: ###################################################################################################################################################
 void gosub(P t, P e, LispEnv *lispenv) {
   if(lispenv->prog_stack_idx<MAX_GOSUB_RECURSE){
-	  L x =f_string(t, e, lispenv);
+	  L x = apply(f_string, t, e, lispenv);
 	  //eraseBuffer(lispenv->program_stack);
 	  lispenv->prog_stack_idx++;
 	  lispenv->program_stack[lispenv->prog_stack_idx].size=strlen(A(lispenv)+ord(x))+strlen("(eval\n") + strlen("\n)");
@@ -1061,7 +1670,7 @@ void gosub(P t, P e, LispEnv *lispenv) {
 	  strcpy(strchr(lispenv->program_stack[lispenv->prog_stack_idx].data,'\0'), A(lispenv)+ord(x));
 	  strcpy(strchr(lispenv->program_stack[lispenv->prog_stack_idx].data,'\0'), "\n)");
 
-	  printf("%s\n", lispenv->program_stack[lispenv->prog_stack_idx].data);
+	  TRACE(3, TRACE_READ, lispenv, "gosub %s\n", lispenv->program_stack[lispenv->prog_stack_idx].data);
 
 	  lispenv->prog_idx_stack[lispenv->prog_stack_idx]=0;
 
@@ -1092,16 +1701,247 @@ L f_gosub(P t, P e, LispEnv *lispenv){
 
 
 // read data from file.
-L f_read(P t, P e, LispEnv *lispenv){
+L f_read(L *a, int n, LispEnv *lispenv){
 
-  L x =f_string(t, e, lispenv);
+  L x = f_string(a, n, lispenv);
   Buffer data = DH_read(A(lispenv)+ord(x));
-  // add null terminator.
-  data.data = (char*)realloc(data.data, data.size+1);
-  data.data[data.size++]='\0';
-  //printf("Data: %s Size: %i",(char*)data.data, data.size);
   if(data.size>0)
-	  return dup_n(ATOM, (char*)data.data, data.size, lispenv);
+	  x = dup_n(ATOM, (char*)data.data, data.size, lispenv); // copies the 0 that follows the data
+  else
+	  x = lispenv->nil;
+  DH_release(data);
+  return x;
+}
+
+// (open <filename>) maps file <filename> and returns a slice of all of it, or () if it cannot be read. the slices of a
+// file share its mapping, which is released when they are all closed. a slice that is no longer reachable is closed by
+// the next garbage collection of all generations, closing it with (close <slice>) releases the file sooner.
+L f_open(L *a, int n, LispEnv *lispenv){
+  L x = f_string(a, n, lispenv);
+  Buffer data = DH_read(A(lispenv)+ord(x));
+  Mapping *map;
+  if(!data.data)
+    return lispenv->nil;
+  map = (Mapping*)calloc(1, sizeof(Mapping));
+  map->buf = data;
+  return new_slice(map, 0, data.size, lispenv);
+}
+
+// (dibs <filename> <mode> [<size>]) calls dibs on file <filename> and returns a slice of it. the daemons with dibs on a
+// file share its pages, see DH_call_dibs(). <mode> is dont-care, can-fill, wanted or needed, only a can-fill slice can be
+// written with poke, and can-fill creates the file and extends it to <size> bytes. returns () if the file cannot be
+// mapped, which is an error for needed.
+L f_dibs(L *a, int n, LispEnv *lispenv){
+  L x = arg(a, n, 1, lispenv);
+  Dibs *dibs;
+  Mapping *map;
+  int mode;
+  if ((T(x) & ~(ATOM^STRING)) != ATOM)
+    return err(5);
+  for (mode = NEEDED; mode >= DONT_CARE && strcmp(A(lispenv)+ord(x), DIBS_MODE_NAMES[mode]); --mode)
+    continue;
+  if (mode < DONT_CARE)
+    return err(5);
+  x = f_string(a, 1, lispenv);
+  dibs = (Dibs*)calloc(1, sizeof(Dibs));
+  strncpy(dibs->filename, A(lispenv)+ord(x), DH_FILENAME_LEN-1);
+  dibs->mode = (DIBS_MODES)mode;
+  dibs->len = n > 2 && a[2] > 0 ? (size_t)a[2] : 0;
+  if (DH_call_dibs(dibs) != 0) {
+    free(dibs);
+    return mode == NEEDED ? ERR(5, "no dibs on %s ", A(lispenv)+ord(x)) : lispenv->nil;
+  }
+  map = (Mapping*)calloc(1, sizeof(Mapping));
+  map->buf.data = (char*)dibs->start;
+  map->buf.size = dibs->len;
+  map->dibs = dibs;
+  return new_slice(map, 0, dibs->len, lispenv);
+}
+
+// (slice <slice> <offset> [<size>]) => the slice of <size> bytes at <offset> in <slice>, or all bytes after <offset>.
+// the bytes are not copied.
+L f_slice(L *a, int n, LispEnv *lispenv){
+  Slice *s = slice(arg(a, n, 0, lispenv), lispenv);
+  L k = arg(a, n, 1, lispenv);
+  unsigned int offset = k > 0 ? k < s->size ? (unsigned int)k : s->size : 0, size = s->size-offset;
+  if(n > 2 && a[2] >= 0 && a[2] < size)
+    size = (unsigned int)a[2];
+  return new_slice(s->map, s->offset+offset, size, lispenv);
+}
+
+// (size <slice>) => the number of bytes of <slice>.
+L f_size(L *a, int n, LispEnv *lispenv){
+  return slice(arg(a, n, 0, lispenv), lispenv)->size;
+}
+
+// (byte <slice> <k>) => the byte at index <k> of <slice>, or () if there is none.
+L f_byte(L *a, int n, LispEnv *lispenv){
+  Slice *s = slice(arg(a, n, 0, lispenv), lispenv);
+  L k = arg(a, n, 1, lispenv);
+  return k >= 0 && k < s->size ? (L)(unsigned char)s->map->buf.data[s->offset+(unsigned int)k] : lispenv->nil;
+}
+
+// (poke <slice> <k> <value>) writes byte <value>, or the bytes of string <value>, at index <k> of a can-fill <slice>.
+// returns #t, or () if <slice> cannot be written or the bytes do not fit in it. a <value> that is not a number in
+// 0..255 or a string is an error.
+L f_poke(L *a, int n, LispEnv *lispenv){
+  Slice *s = slice(arg(a, n, 0, lispenv), lispenv);
+  L k = arg(a, n, 1, lispenv), x = arg(a, n, 2, lispenv);
+  size_t len = (T(x) & ~(ATOM^STRING)) == ATOM ? strlen(A(lispenv)+ord(x)) : 1;
+  if ((T(x) & ~(ATOM^STRING)) != ATOM && !(x >= 0 && x <= 255))   /* false for the NaN boxes of the other types */
+    return err(5);
+  if (!s->map->dibs || s->map->dibs->mode != CAN_FILL || !(k >= 0 && k+len <= s->size))
+    return lispenv->nil;
+  if ((T(x) & ~(ATOM^STRING)) == ATOM)
+    memcpy(s->map->buf.data+s->offset+(unsigned int)k, A(lispenv)+ord(x), len);
+  else
+    s->map->buf.data[s->offset+(unsigned int)k] = (char)(int)x;
+  return lispenv->tru;
+}
+
+// (publish <slice>) publishes the changes poked into the file of a can-fill <slice>, and returns the new version of the
+// file, or () if <slice> cannot be written. see DH_publish().
+L f_publish(L *a, int n, LispEnv *lispenv){
+  Slice *s = slice(arg(a, n, 0, lispenv), lispenv);
+  uint64_t version = s->map->dibs ? DH_publish(s->map->dibs) : 0;
+  return version ? (L)version : lispenv->nil;
+}
+
+// (version <slice>) => the number of changes published to the file of <slice>, 0 if it was not called dibs on. a daemon
+// that reads a new version sees the bytes poked before it was published.
+L f_version(L *a, int n, LispEnv *lispenv){
+  Slice *s = slice(arg(a, n, 0, lispenv), lispenv);
+  return s->map->dibs ? (L)DH_dibs_version(s->map->dibs) : 0;
+}
+
+// (append <filename> x1 x2 ... xk) appends the string of x1 x2 ... xk to file <filename>. the file stays open and the
+// bytes are buffered, see DH_append(). returns #t, or () if the file cannot be written.
+L f_append(L *a, int n, LispEnv *lispenv){
+  L x = f_string(a+1, n > 1 ? n-1 : 0, lispenv), f = arg(a, n, 0, lispenv);
+  Buffer buf;
+  if ((T(f) & ~(ATOM^STRING)) != ATOM)
+    return err(5);
+  buf.data = A(lispenv)+ord(x);
+  buf.size = strlen(buf.data);
+  return DH_append(A(lispenv)+ord(f), buf) == 0 ? lispenv->tru : lispenv->nil;
+}
+
+// (flush [<filename>]) writes the bytes appended to file <filename>, or to all files, that are still buffered. returns
+// #t, or () if they cannot be written.
+L f_flush(L *a, int n, LispEnv *lispenv){
+  if (n > 0 && (T(a[0]) & ~(ATOM^STRING)) != ATOM)
+    return err(5);
+  return DH_sync(n > 0 ? A(lispenv)+ord(a[0]) : NULL) == 0 ? lispenv->tru : lispenv->nil;
+}
+
+// (store <filename> x) replaces the contents of file <filename> with the encoding of x, see encode(). returns #t, or ()
+// if the file cannot be written.
+L f_store(L *a, int n, LispEnv *lispenv){
+  L f = arg(a, n, 0, lispenv);
+  Buffer buf;
+  size_t len;
+  int r;
+  if ((T(f) & ~(ATOM^STRING)) != ATOM)
+    return err(5);
+  buf.data = pack_message(message(arg(a, n, 1, lispenv), lispenv), &len);
+  buf.size = len;
+  r = DH_write(A(lispenv)+ord(f), buf);
+  free(buf.data);
+  return r == 0 ? lispenv->tru : lispenv->nil;
+}
+
+// (fetch <filename>|<slice>) => the value stored in file <filename>, or encoded in the bytes of <slice>, which are decoded
+// where they are mapped. () if the file cannot be read, an error if the bytes are not the encoding of a value.
+L f_fetch(L *a, int n, LispEnv *lispenv){
+  L x = arg(a, n, 0, lispenv);
+  Slice *s;
+  Buffer data;
+  if (T(x) == SLICE) {
+    s = slice(x, lispenv);
+    return unpack(s->map->buf.data+s->offset, s->size, lispenv);
+  }
+  if ((T(x) & ~(ATOM^STRING)) != ATOM)
+    return err(5);
+  data = DH_read(A(lispenv)+ord(x));
+  if (!data.data)
+    return lispenv->nil;
+  if (!encoded(data.data, data.size)) {
+    DH_release(data);
+    return err(8);
+  }
+  x = unpack(data.data, data.size, lispenv);
+  DH_release(data);
+  return x;
+}
+
+// (image <filename>) saves the environment as heap image <filename>, which daemons with image:<filename> in their .daemon
+// file start from, see SaveLispImage(). returns #t, or () if the image cannot be written.
+L f_image(L *a, int n, LispEnv *lispenv){
+  L f = arg(a, n, 0, lispenv);
+  char filename[DH_FILENAME_LEN];
+  if ((T(f) & ~(ATOM^STRING)) != ATOM)
+    return err(5);
+  strncpy(filename, A(lispenv)+ord(f), DH_FILENAME_LEN-1);  /* f moves when the heap is collected */
+  filename[DH_FILENAME_LEN-1] = 0;
+  return SaveLispImage(filename, lispenv) == 0 ? lispenv->tru : lispenv->nil;
+}
+
+// submit file operation op on file <name> with the bytes of buf for the daemon, and keep closure f to call with its result,
+// see complete(). the daemon goes on with its form, and does not run its next form until the result was passed to f.
+// returns #t, or () if there is no daemon to wait.
+L submit(int op, L name, Buffer buf, L f, LispEnv *lispenv) {
+  IORequest *req;
+  unsigned int k;
+  if ((T(name) & ~(ATOM^STRING)) != ATOM || (T(f) != CLOSURE && T(f) != NIL)) {
+    free(buf.data);
+    return err(5);
+  }
+  if (!lispenv->daemon) {
+    free(buf.data);
+    return lispenv->nil;
+  }
+  for (k = 0; k < lispenv->wait_num && T(lispenv->waits[k]) != NIL; ++k)  /* reuse a free slot */
+    continue;
+  if (k == lispenv->wait_num && !(k & (k+1)))                              /* all 2^m-1 slots are used, grow to 2^(m+1)-1 */
+    lispenv->waits = (L*)realloc(lispenv->waits, sizeof(L)*(2*k+1));
+  if (k == lispenv->wait_num)
+    ++lispenv->wait_num;
+  lispenv->waits[k] = T(f) == CLOSURE ? f : lispenv->tru;                  /* #t waits without a closure */
+  req = (IORequest*)calloc(1, sizeof(IORequest));
+  req->op = op;
+  strncpy(req->filename, A(lispenv)+ord(name), DH_FILENAME_LEN-1);
+  req->buf = buf;
+  req->slot = k;
+  submitIO(lispenv->daemon, req);
+  return lispenv->tru;
+}
+
+// (read-async <filename> <closure>) reads file <filename> on an I/O thread, while the daemon goes on with its form. it does
+// not run its next form until <closure> was called with the contents of the file, or () if it cannot be read. returns #t,
+// or () if there is no daemon to wait.
+L f_read_async(L *a, int n, LispEnv *lispenv){
+  Buffer buf = {0};
+  return submit(IO_READ, arg(a, n, 0, lispenv), buf, n > 1 ? a[1] : lispenv->nil, lispenv);
+}
+
+// (write-async <filename> <value> [<closure>]) writes the string of <value> to file <filename> on an I/O thread, as
+// read-async reads, and calls <closure> with #t, or () if it cannot be written.
+L f_write_async(L *a, int n, LispEnv *lispenv){
+  L x = f_string(a+1, n > 1 ? 1 : 0, lispenv);
+  Buffer buf;
+  buf.size = strlen(A(lispenv)+ord(x));
+  buf.data = (char*)malloc(buf.size+1);
+  memcpy(buf.data, A(lispenv)+ord(x), buf.size);
+  return submit(IO_WRITE, arg(a, n, 0, lispenv), buf, n > 2 ? a[2] : lispenv->nil, lispenv);
+}
+
+// (close <slice>) closes <slice>, the file is unmapped, or its dibs released, when its last slice is closed.
+// (close <filename>) writes the bytes appended to file <filename> and closes it.
+L f_close(L *a, int n, LispEnv *lispenv){
+  L x = arg(a, n, 0, lispenv);
+  if ((T(x) & ~(ATOM^STRING)) == ATOM)
+    return DH_close_file(A(lispenv)+ord(x)) == 0 ? lispenv->tru : lispenv->nil;
+  close_slice(slice(x, lispenv));
   return lispenv->nil;
 }
 
@@ -1128,10 +1968,13 @@ L f_trace(P t, P e, LispEnv *lispenv) {
 L f_catch(P t, P e, LispEnv *lispenv) {
   L x;
   struct State saved = state;
+  int n = lispenv->var_num;
+  unsigned int vsp = lispenv->vsp;
   if (!(x = setjmp(state.jb)))
     x = eval(first(*t, lispenv), e, lispenv);
   else {
-    unwind(state.n-saved.n, lispenv);
+    unwind(lispenv->var_num-n, lispenv);
+    lispenv->vsp = vsp;                         /* pop what the virtual machine left on its stack */
     x = pair(atom("ERR", lispenv), x, lispenv);
   }
   state = saved;
@@ -1146,103 +1989,161 @@ L f_quit(P t, P _, LispEnv *lispenv) {
   exit(0);
 }
 
-// (reg-interface <name> <type> <format> <closure>)
-// If direction==1, closure must accept DH_messages.
-// if direction==0, closure must output DH_messages.
-// can be called by dollhouse by ( <name> <message details>)
-L f_register_interface(P t, P e, LispEnv *lispenv){
-
-	L interface_closure = first(next(next(next(*t,lispenv),lispenv),lispenv), lispenv);
-
-	if(T(interface_closure)!=CLOSURE) return lispenv->nil;
-
-
-	char *interface_name =	A(lispenv)+ord(f_string(&FIRST(*t, lispenv), e, lispenv));
-
-	char *interface_type = 	A(lispenv)+ord(f_string(&FIRST(next(*t, lispenv), lispenv), e, lispenv));
-	char *interface_format =A(lispenv)+ord(f_string(&FIRST(next(next(*t,lispenv),lispenv), lispenv), e, lispenv));
-
-	uint8_t direction = ord(first(next(next(next(next(*t,lispenv),lispenv),lispenv),lispenv), lispenv));
-	uint8_t triggering = ord(first(next(next(next(next(next(*t,lispenv),lispenv),lispenv),lispenv),lispenv), lispenv));
-	Interface *new_interface=(Interface*)malloc(sizeof(Interface));       // FREE INTERFACES UPON EXIT
-	strncpy(new_interface->name, interface_name, DH_INTERFACE_NAME_LEN);
-	strncpy(new_interface->type, interface_type, DH_TYPE_LEN);
-	strncpy(new_interface->format, interface_format, DH_FORMAT_LEN);
-	new_interface->direction = direction;
-	new_interface->triggering=triggering;
-	new_interface->daemon = lispenv->daemon;
-	registerDaemonInterface(new_interface);
-
-	pair(interface_closure, first(*t, lispenv), lispenv);
-	return f_define( lispenv->cell-2, e, lispenv);
+// (interface <name> <type> <format> <closure> <direction> <triggering> [<batch>]) registers an interface of the daemon.
+// If direction==1, data arriving on the interface is passed to <closure>, see deliver().
+// with a <batch> size, the closure is passed a list of up to <batch> messages that arrived, instead of one message at a
+// time. returns the closure, or () if it is not a closure.
+L f_interface(L *a, int n, LispEnv *lispenv){
+	Interface new_interface;
+	L x = arg(a, n, 3, lispenv);
+	int k;
+
+	if(T(x)!=CLOSURE) return lispenv->nil;
+	for(k=0; k<3; k++)
+		if((T(a[k]) & ~(ATOM^STRING)) != ATOM) return err(5); // names are atoms or strings
+
+	memset(&new_interface, 0, sizeof(Interface));
+	strncpy(new_interface.name, A(lispenv)+ord(a[0]), DH_INTERFACE_NAME_LEN-1);
+	strncpy(new_interface.type, A(lispenv)+ord(a[1]), DH_TYPE_LEN-1);
+	strncpy(new_interface.format, A(lispenv)+ord(a[2]), DH_FORMAT_LEN-1);
+	new_interface.direction = arg(a, n, 4, lispenv) == 1;
+	new_interface.triggering = arg(a, n, 5, lispenv) == 1;
+	new_interface.batch = n > 6 && a[6] >= 1 ? a[6] < DH_BATCH_MAX ? (uint16_t)a[6] : DH_BATCH_MAX : 0;
+	new_interface.daemon = lispenv->daemon;
+
+	if(new_interface.direction){ // the closure of an input interface that is registered again replaces the old one
+		for(k=0; k<(int)lispenv->handler_num && strcmp(lispenv->handlers[k].name, new_interface.name); k++)
+			continue;
+		if(k==(int)lispenv->handler_num && !(k & (k+1)))  // all 2^m-1 handlers are used, grow to 2^(m+1)-1
+			lispenv->handlers = (Handler*)realloc(lispenv->handlers, sizeof(Handler)*(2*k+1));
+		if(k==(int)lispenv->handler_num)
+			lispenv->handler_num++;
+		memcpy(lispenv->handlers[k].name, new_interface.name, DH_INTERFACE_NAME_LEN);
+		lispenv->handlers[k].f = x;
+	}
+	registerDaemonInterface(&new_interface); // copies the interface, the closure receives what arrives once it is linked
+	return x;
 }
 
 
 
-L f_evoke(P t, P e, LispEnv *lispenv){
-	L filename_idx = f_string(&FIRST(*t, lispenv), e, lispenv);
-	L language_idx = f_string(&NEXT(*t, lispenv), e, lispenv);
-
-	char filename[DH_DAEMON_NAME_LEN];
+// (evoke <filename> <language>) starts a daemon that runs script <filename>, returns #t, or () if it cannot be started.
+// its interfaces are linked to those of the running daemons as they are registered, see registerDaemonInterface().
+L f_evoke(L *a, int n, LispEnv *lispenv){
+	char filename[DH_FILENAME_LEN];
 	char language[DH_LANG_LEN];
+	L x = arg(a, n, 0, lispenv), y = arg(a, n, 1, lispenv);
 
-	strncpy(filename, A(lispenv) + ord(filename_idx), DH_DAEMON_NAME_LEN);
-	strncpy(language, A(lispenv) + ord(language_idx), DH_LANG_LEN);
+	if((T(x) & ~(ATOM^STRING)) != ATOM || (T(y) & ~(ATOM^STRING)) != ATOM) return err(5);
+	strncpy(filename, A(lispenv)+ord(x), DH_FILENAME_LEN-1);
+	filename[DH_FILENAME_LEN-1] = 0;
+	strncpy(language, A(lispenv)+ord(y), DH_LANG_LEN-1);
+	language[DH_LANG_LEN-1] = 0;
 
-	return box( ATOM, startDaemon(filename, language)); // return 1 if successful
+	return startDaemon(filename, language) ? lispenv->tru : lispenv->nil;
 }
 
 
-L f_yield(P t, P e, LispEnv *lispenv){
+// (yield [ms]) gives control back to the scheduler, which runs the daemon again when it is ready or after ms milliseconds.
+L f_yield(L *a, int n, LispEnv *lispenv){
 	lispenv->yield=1;
+	lispenv->sleep = n > 0 && a[0] > 0 ? (unsigned int)a[0] : 0;
 	return lispenv->nil;
 }
 
 
 
-// t is a pair (<name>, <data>) where <name> contains the interface name, and <data> contains the actual info.
-// returns the number of bytes outputed.
-L f_output(P t, P e, LispEnv *lispenv){
-
-	L name = f_string(&FIRST(*t, lispenv), e, lispenv);
-
-	// check if the interface exists
-	uint8_t isInterface=false;
-	for(int i=0; i<lispenv->daemon->interface_num; i++){
-		if(strcmp(lispenv->daemon->interfaces[i].name, A(lispenv)+ord(name))){
-			isInterface=true;
-			break;
+// (clock) => the milliseconds of the monotonic clock, with their fraction, to time what the daemon does.
+L f_clock(L *a, int n, LispEnv *lispenv){
+	return monotonicNs()/1e6;
+}
+
+// (output <name> <value>) sends <value> on the output interface <name>: a message with a copy of <value> is queued on
+// each interlink of the interface, see sendInterlink(). returns #t, or () if the daemon has no interface <name> or a
+// full interlink dropped the message.
+L f_output(L *a, int n, LispEnv *lispenv){
+	L x = arg(a, n, 1, lispenv);
+	Daemon *daemon = lispenv->daemon;
+	char name[DH_INTERFACE_NAME_LEN];
+	Encoding **msgs;
+	Interface *interfaces;
+	Interlink **links;
+	int i, k = 0, sent = 1, num;
+
+	if((T(a[0]) & ~(ATOM^STRING)) != ATOM) return err(5);
+	strncpy(name, A(lispenv)+ord(a[0]), DH_INTERFACE_NAME_LEN-1);
+	name[DH_INTERFACE_NAME_LEN-1] = 0;
+	interfaces = daemonInterfaces(daemon, &num);
+	for(i=0; i<num && strncmp(interfaces[i].name, name, DH_INTERFACE_NAME_LEN)!=0; i++)
+		continue;
+	if(i==num) return lispenv->nil; // the interface does not exist
+
+	// make the messages before sending any: a blocked send may run interface closures of this daemon, which move its heap.
+	// x is encoded once, the other interlinks get copies of its bytes. the links are the ones made before it is sent
+	links = daemonInterlinks(daemon, &num);
+	msgs = (Encoding**)malloc(sizeof(Encoding*)*(num+1));
+	for(i=0; i<num; i++)
+		if(links[i]->src==daemon && strncmp(links[i]->name, name, DH_INTERFACE_NAME_LEN)==0){
+			msgs[k] = k ? copy_message(msgs[0]) : message(x, lispenv);
+			k++;
 		}
-	}
-	if(!isInterface) return box(ATOM, 0); // return 0 if the interface does not exist
-
-	Buffer newbuffer; // will be freed by cycleInterface
-	if(T(NEXT(*t, lispenv)) == STRING ){ // the output is a simple string
-		L data = f_string(&NEXT(*t, lispenv), e, lispenv);
-		newbuffer.size = strlen(A(lispenv)+ord(data));
-		strncpy(newbuffer.data, A(lispenv)+ord(data), newbuffer.size);
-		strncpy(lispenv->outputName, A(lispenv)+ord(name), DH_INTERFACE_NAME_LEN);
-		memcpy(&(lispenv->output_buffer), &newbuffer, sizeof(Buffer));
-	}else if(T(NEXT(*t, lispenv))==PAIR) {
-
-		L data = NEXT(*t, lispenv);
-		// get length of buffer needed
-		int count=0;
-		L cell = data;
-		while((cell = next(cell, lispenv))!=lispenv->nil) count++;
-		newbuffer.size = count+1;
-
-
-		count=0;
-		while((data = next(data, lispenv))!=lispenv->nil){
-			newbuffer.data[count]=ord(first(data, lispenv));
-			count++;
+	for(i=0, k=0; i<num; i++)
+		if(links[i]->src==daemon && strncmp(links[i]->name, name, DH_INTERFACE_NAME_LEN)==0)
+			sent &= sendInterlink(links[i], msgs[k++]);
+	free(msgs);
+	return sent ? lispenv->tru : lispenv->nil;
+}
+
+// push (<name> . x) on the association list s, returns the new list.
+L stat(const char *name, L x, L s, LispEnv *lispenv){
+	L k;
+	s = pair(x, s, lispenv); // var() moves only the first variable it registers, x and s are registered as one pair
+	var(1, lispenv, &s);
+	k = atom(name, lispenv);
+	k = pair(k, FIRST(s, lispenv), lispenv);
+	set(&FIRST(s, lispenv), k, lispenv);
+	return return_value(1, s, lispenv);
+}
+
+// (stats) => the statistics of the daemon, an association list of what its environment did: steps, alloc-bytes,
+// minor-gcs, major-gcs, gc-ms and copied-bytes, how the workers ran it: runs, run-ms and run-us, the counts of the
+// histogram of its runs, and its output interlinks: interlinks, a list of (<name> <sent> <received> <dropped>).
+L f_stats(L *a, int n, LispEnv *lispenv){
+	LispStats st = lispenv->stats; // as it was before the list is allocated
+	Daemon *daemon = lispenv->daemon;
+	L s = lispenv->nil, x = lispenv->nil, y = lispenv->nil, z;
+	var(3, lispenv, &s, &x, &y);
+	if(daemon){
+		uint64_t runs = 0;
+		int num;
+		Interlink **links = daemonInterlinks(daemon, &num);
+		for(int j=num; j--; ){
+			Interlink *link = links[j];
+			if(link->src!=daemon) continue;
+			y = pair((L)__atomic_load_n(&link->dropped, __ATOMIC_RELAXED), lispenv->nil, lispenv);
+			y = pair((L)__atomic_load_n(&link->received, __ATOMIC_RELAXED), y, lispenv);
+			y = pair((L)__atomic_load_n(&link->sent, __ATOMIC_RELAXED), y, lispenv);
+			z = atom(link->name, lispenv);
+			y = pair(z, y, lispenv);
+			x = pair(y, x, lispenv);
+		}
+		s = stat("interlinks", x, s, lispenv);
+		x = lispenv->nil;
+		for(int k=DH_HISTOGRAM_BUCKETS; k--; ){
+			runs += daemon->runs.count[k];
+			x = pair((L)daemon->runs.count[k], x, lispenv);
 		}
-		strncpy(lispenv->outputName, A(lispenv)+ord(name), DH_INTERFACE_NAME_LEN);
-		memcpy(&(lispenv->output_buffer), &newbuffer, sizeof(Buffer));
+		s = stat("run-us", x, s, lispenv);
+		s = stat("run-ms", daemon->runs.total_ns/1e6, s, lispenv);
+		s = stat("runs", (L)runs, s, lispenv);
 	}
-
-	return box(ATOM, newbuffer.size);
+	s = stat("copied-bytes", (L)st.copied_bytes, s, lispenv);
+	s = stat("gc-ms", st.gc_ns/1e6, s, lispenv);
+	s = stat("major-gcs", (L)st.majors, s, lispenv);
+	s = stat("minor-gcs", (L)st.minors, s, lispenv);
+	s = stat("alloc-bytes", (L)st.alloc_bytes, s, lispenv);
+	s = stat("steps", (L)st.steps, s, lispenv);
+	return return_value(3, s, lispenv);
 }
 
 #define LISP_INPUT_BUFFER_SIZE 1024
@@ -1263,64 +2164,1645 @@ L f_input(P t, P e, LispEnv *lispenv){
 
 
 
-/* table of Lisp primitives, each has a name s, a function pointer f, and a tail-recursive flag t */
+/* table of Lisp primitives, each has a name s, a special form f or a function fn, and a tail-recursive flag t. a special
+   form takes the list of its unevaluated arguments, a function takes the values of its n arguments in an array a[] */
 struct {
   const char *s;
   L (*f)(P, P, LispEnv*);
+  L (*fn)(L*, int, LispEnv*);
   short t;
 } primitives[] = {
-  {"type",     f_type,    0},                   /* (type x) => <type> value between -1 and 7 */
-  {"eval",     f_eval,    1},                   /* (eval <quoted-expr>) => <value-of-expr> */
-  {"quote",    f_quote,   0},                   /* (quote <expr>) => <expr> -- protect <expr> from evaluation */
-  {"pair",     f_pair,    0},                   /* (pair x y) => (x . y) -- construct a pair */
-  {"first",    f_first,   0},                   /* (first <pair>) => x -- "deconstruct" <pair> (x . y) */
-  {"next",     f_next,    0},                   /* (next <pair>) => y -- "deconstruct" <pair> (x . y) */
-  {"+",        f_add,     0},                   /* (+ n1 n2 ... nk) => n1+n2+...+nk */
-  {"-",        f_sub,     0},                   /* (- n1 n2 ... nk) => n1-n2-...-nk or -n1 if k=1 */
-  {"*",        f_mul,     0},                   /* (* n1 n2 ... nk) => n1*n2*...*nk */
-  {"/",        f_div,     0},                   /* (/ n1 n2 ... nk) => n1/n2/.../nk or 1/n1 if k=1 */
-  {"int",      f_int,     0},                   /* (int <integer.frac>) => <integer> */
-  {"<",        f_lt,      0},                   /* (< n1 n2) => #t if n1<n2 else () */
-  {"eq?",      f_eq,      0},                   /* (eq? x y) => #t if x==y else () */
-  {"not",      f_not,     0},                   /* (not x) => #t if x==() else ()t */
-  {"or",       f_or,      0},                   /* (or x1 x2 ... xk) => #t if any x1 is not () else () */
-  {"and",      f_and,     0},                   /* (and x1 x2 ... xk) => #t if all x1 are not () else () */
-  {"list",     f_list,    0},                   /* (list x1 x2 ... xk) => (x1 x2 ... xk) -- evaluates x1, x2 ... xk */
-  {"begin",    f_begin,   1},                   /* (begin x1 x2 ... xk) => xk -- evaluates x1, x2 to xk */
-  {"while",    f_while,   0},                   /* (while x y1 y2 ... yk) -- while x is not () evaluate y1, y2 ... yk */
-  {"cond",     f_cond,    1},                   /* (cond (x1 y1) (x2 y2) ... (xk yk)) => yi for first xi!=() */
-  {"if",       f_if,      1},                   /* (if x y z) => if x!=() then y else z */
-  {"lambda",   f_lambda,  0},                   /* (lambda <parameters> <expr>) => {closure} */
-  {"macro",    f_macro,   0},                   /* (macro <parameters> <expr>) => [macro] */
-  {"define",   f_define,  0},                   /* (define <symbol> <expr>) -- globally defines <symbol> */
-  {"assoc",    f_assoc,   0},                   /* (assoc <quoted-symbol> <environment>) => <value-of-symbol> */
-  {"env",      f_env,     0},                   /* (env) => <environment> */
-  {"let",      f_let,     1},                   /* (let (v1 x1) (v2 x2) ... (vk xk) y) => y with scope of bindings */
-  {"let*",     f_leta,    1},                   /* (let* (v1 x1) (v2 x2) ... (vk xk) y) => y with scope of bindings */
-  {"letrec",   f_letrec,  1},                   /* (letrec (v1 x1) (v2 x2) ... (vk xk) y) => y with recursive scope */
-  {"letrec*",  f_letreca, 1},                   /* (letrec* (v1 x1) (v2 x2) ... (vk xk) y) => y with recursive scope */
-  {"setq",     f_setq,    0},                   /* (setq <symbol> x) -- changes value of <symbol> in scope to x */
-  {"set-first!",f_setfirst,0},                   /* (set-car! <pair> x) -- changes car of <pair> to x in memory */
-  {"set-next!",f_setnext,  0},                   /* (set-cdr! <pair> y) -- changes cdr of <pair> to y in memory */
-  {"read",     f_read,    0},                   /* (read <filename> ) => reads from file */
-  {"print",    f_print,   0},                   /* (print x1 x2 ... xk) => () -- prints the values x1 x2 ... xk */
-  {"println",  f_println, 0},                   /* (println x1 x2 ... xk) => () -- prints with newline */
-  {"write",    f_write,   0},                   /* (write x1 x2 ... xk) => () -- prints without quoting strings */
-  {"string",   f_string,  0},                   /* (string x1 x2 ... xk) => <string> -- string of x1 x2 ... xk */
-//  {"load",     f_load,    0},                   /* (load <name>) -- loads file <name> (an atom or string name) */
-  {"gosub",	   f_gosub,	  1},			// Enter a subroutine
-//  {"return",   f_return,  0},
-  {"trace",    f_trace,   0},                   /* (trace flag [<expr>]) -- flag 0=off, 1=on, 2=keypress */
-  {"catch",    f_catch,   0},                   /* (catch <expr>) => <value-of-expr> if no exception else (ERR . n) */
-  {"throw",    f_throw,   0},                   /* (throw n) -- raise exception error code n (integer != 0) */
-  {"quit",     f_quit,    0},                   /* (quit) -- bye! */
-  {"yield",	   f_yield,   0},					// return execution to the caller.
-  {"output",   f_output,  0},                   // (output name data) output <data> to interface <name>
-  {"input",	   f_input,   0},
+  {"type",      0,         f_type,      0},  /* (type x) => <type> value between -1 and 7 */
+  {"eval",      0,         f_eval,      1},  /* (eval <quoted-expr>) => <value-of-expr> */
+  {"quote",     f_quote,   0,           0},  /* (quote <expr>) => <expr> -- protect <expr> from evaluation */
+  {"pair",      0,         f_pair,      0},  /* (pair x y) => (x . y) -- construct a pair */
+  {"first",     0,         f_first,     0},  /* (first <pair>) => x -- "deconstruct" <pair> (x . y) */
+  {"next",      0,         f_next,      0},  /* (next <pair>) => y -- "deconstruct" <pair> (x . y) */
+  {"+",         0,         f_add,       0},  /* (+ n1 n2 ... nk) => n1+n2+...+nk */
+  {"-",         0,         f_sub,       0},  /* (- n1 n2 ... nk) => n1-n2-...-nk or -n1 if k=1 */
+  {"*",         0,         f_mul,       0},  /* (* n1 n2 ... nk) => n1*n2*...*nk */
+  {"/",         0,         f_div,       0},  /* (/ n1 n2 ... nk) => n1/n2/.../nk or 1/n1 if k=1 */
+  {"int",       0,         f_int,       0},  /* (int <integer.frac>) => <integer> */
+  {"<",         0,         f_lt,        0},  /* (< n1 n2) => #t if n1<n2 else () */
+  {"eq?",       0,         f_eq,        0},  /* (eq? x y) => #t if x==y else () */
+  {"not",       0,         f_not,       0},  /* (not x) => #t if x==() else ()t */
+  {"or",        f_or,      0,           0},  /* (or x1 x2 ... xk) => #t if any x1 is not () else () */
+  {"and",       f_and,     0,           0},  /* (and x1 x2 ... xk) => #t if all x1 are not () else () */
+  {"list",      0,         f_list,      0},  /* (list x1 x2 ... xk) => (x1 x2 ... xk) -- evaluates x1, x2 ... xk */
+  {"begin",     f_begin,   0,           1},  /* (begin x1 x2 ... xk) => xk -- evaluates x1, x2 to xk */
+  {"while",     f_while,   0,           0},  /* (while x y1 y2 ... yk) -- while x is not () evaluate y1, y2 ... yk */
+  {"cond",      f_cond,    0,           1},  /* (cond (x1 y1) (x2 y2) ... (xk yk)) => yi for first xi!=() */
+  {"if",        f_if,      0,           1},  /* (if x y z) => if x!=() then y else z */
+  {"lambda",    f_lambda,  0,           0},  /* (lambda <parameters> <expr>) => {closure} */
+  {"macro",     f_macro,   0,           0},  /* (macro <parameters> <expr>) => [macro] */
+  {"define",    f_define,  0,           0},  /* (define <symbol> <expr>) -- globally defines <symbol> */
+  {"assoc",     0,         f_assoc,     0},  /* (assoc <quoted-symbol> <environment>) => <value-of-symbol> */
+  {"env",       f_env,     0,           0},  /* (env) => <environment> */
+  {"let",       f_let,     0,           1},  /* (let (v1 x1) (v2 x2) ... (vk xk) y) => y with scope of bindings */
+  {"let*",      f_leta,    0,           1},  /* (let* (v1 x1) (v2 x2) ... (vk xk) y) => y with scope of bindings */
+  {"letrec",    f_letrec,  0,           1},  /* (letrec (v1 x1) (v2 x2) ... (vk xk) y) => y with recursive scope */
+  {"letrec*",   f_letreca, 0,           1},  /* (letrec* (v1 x1) (v2 x2) ... (vk xk) y) => y with recursive scope */
+  {"setq",      f_setq,    0,           0},  /* (setq <symbol> x) -- changes value of <symbol> in scope to x */
+  {"set-first!",0,         f_setfirst,  0},  /* (set-car! <pair> x) -- changes car of <pair> to x in memory */
+  {"set-next!", 0,         f_setnext,   0},  /* (set-cdr! <pair> y) -- changes cdr of <pair> to y in memory */
+  {"read",      0,         f_read,      0},  /* (read <filename> ) => reads from file */
+  {"open",      0,         f_open,      0},  /* (open <filename>) => <slice> of the mapped file, or () */
+  {"slice",     0,         f_slice,     0},  /* (slice <slice> <offset> [<size>]) => <slice> of the bytes, not copied */
+  {"size",      0,         f_size,      0},  /* (size <slice>) => number of bytes of <slice> */
+  {"byte",      0,         f_byte,      0},  /* (byte <slice> <k>) => byte k of <slice> */
+  {"close",     0,         f_close,     0},  /* (close <slice>|<filename>) -- closes <slice>, or the appended file */
+  {"append",    0,         f_append,    0},  /* (append <filename> x1 x2 ... xk) => #t -- appends the string of x1 ... xk */
+  {"flush",     0,         f_flush,     0},  /* (flush [<filename>]) => #t -- writes the bytes appended to files */
+  {"store",     0,         f_store,     0},  /* (store <filename> x) => #t -- replaces the file with the encoding of x */
+  {"fetch",     0,         f_fetch,     0},  /* (fetch <filename>|<slice>) => the value encoded in the file or slice */
+  {"image",     0,         f_image,     0},  /* (image <filename>) => #t -- saves the environment as a heap image */
+  {"read-async",0,         f_read_async,0},  /* (read-async <filename> <closure>) => #t -- reads on an I/O thread */
+  {"write-async",0,        f_write_async,0}, /* (write-async <filename> x [<closure>]) => #t -- writes on an I/O thread */
+  {"dibs",      0,         f_dibs,      0},  /* (dibs <filename> <mode> [<size>]) => <slice> of the shared file, or () */
+  {"poke",      0,         f_poke,      0},  /* (poke <slice> <k> <value>) => #t if the byte or string was written */
+  {"publish",   0,         f_publish,   0},  /* (publish <slice>) => new version of the file of <slice> */
+  {"version",   0,         f_version,   0},  /* (version <slice>) => version of the file of <slice> */
+  {"print",     0,         f_print,     0},  /* (print x1 x2 ... xk) => () -- prints the values x1 x2 ... xk */
+  {"println",   0,         f_println,   0},  /* (println x1 x2 ... xk) => () -- prints with newline */
+  {"write",     0,         f_write,     0},  /* (write x1 x2 ... xk) => () -- prints without quoting strings */
+  {"string",    0,         f_string,    0},  /* (string x1 x2 ... xk) => <string> -- string of x1 x2 ... xk */
+//  {"load",      f_load,    0,           0},  /* (load <name>) -- loads file <name> (an atom or string name) */
+  {"gosub",     f_gosub,   0,           1}, // Enter a subroutine
+//  {"return",    f_return,  0,           0},
+  {"trace",     f_trace,   0,           0},  /* (trace flags [<expr>]) -- steps 0=off, 1=on, 2=keypress, +4 gc, +8 vars, +16 read */
+  {"catch",     f_catch,   0,           0},  /* (catch <expr>) => <value-of-expr> if no exception else (ERR . n) */
+  {"throw",     f_throw,   0,           0},  /* (throw n) -- raise exception error code n (integer != 0) */
+  {"quit",      f_quit,    0,           0},  /* (quit) -- bye! */
+  {"yield",     0,         f_yield,     0}, // (yield [ms]) return execution to the scheduler, for at least ms milliseconds.
+  {"output",    0,         f_output,    0}, // (output name value) send <value> on output interface <name>
+  {"interface", 0,         f_interface, 0}, // (interface name type format closure direction triggering [batch])
+  {"evoke",     0,         f_evoke,     0}, // (evoke <filename> <language>) => #t if the daemon was started
+  {"input",     f_input,   0,           0},
+  {"stats",     0,         f_stats,     0}, // (stats) => association list of the statistics of the daemon
+  {"clock",     0,         f_clock,     0}, // (clock) => milliseconds of the monotonic clock
   {0}};
 
 
 
+/*----------------------------------------------------------------------------*\
+ |      RESOLVE                                                               |
+\*----------------------------------------------------------------------------*/
+
+/* return the value bound to the GLOBAL variable reference f, or nil if it is unbound */
+L bound(L f, LispEnv *lispenv) {
+  L x = lispenv->globals[ord(f)];
+  return T(x) == PAIR ? NEXT(x, lispenv) : lispenv->nil;
+}
+
+/* return the LOCAL reference to variable v in scope s, or the GLOBAL reference to v if it is not local. the scope s
+   mirrors the environment the code runs in, innermost first: an ATOM for each (v . x) pair added by let, let*, letrec
+   and letrec*, and a singleton (v1 ... vk) for each frame of closure variables v1 ... vk */
+L ref(L v, L s, LispEnv *lispenv) {
+  I depth, k;
+  for (depth = 0; T(s) == PAIR; s = NEXT(s, lispenv), ++depth) {
+    L d = FIRST(s, lispenv);
+    if (T(d) != PAIR) {
+      if (equ(v, d))
+        return box(LOCAL, depth << SLOT_BITS);
+      continue;
+    }
+    for (k = 1, d = FIRST(d, lispenv); T(d) == PAIR; d = NEXT(d, lispenv), ++k)
+      if (equ(v, FIRST(d, lispenv)))
+        return box(LOCAL, depth << SLOT_BITS | k);
+    if (equ(v, d))
+      return box(LOCAL, depth << SLOT_BITS | k);
+  }
+  return box(GLOBAL, global(v, lispenv));
+}
+
+L resolve(L, P, LispEnv*);
+
+/* return a copy of list t with its expressions resolved in scope *s, except for the last which is resolved in scope *u */
+L resolve_list(L t, P s, P u, LispEnv *lispenv) {
+  L y = lispenv->nil, p = lispenv->nil, x;
+  var(3, lispenv, &t, &y, &p);
+  for (; T(t) == PAIR; t = NEXT(t, lispenv)) {
+    x = resolve(FIRST(t, lispenv), lisp_not(NEXT(t, lispenv)) ? u : s, lispenv);
+    x = pair(x, lispenv->nil, lispenv);
+    p = set(T(p) == PAIR ? &NEXT(p, lispenv) : &y, x, lispenv);
+  }
+  if (T(t) != NIL) {                            /* dot list, e.g. the arguments of (f . args) */
+    x = resolve(t, u, lispenv);
+    set(T(p) == PAIR ? &NEXT(p, lispenv) : &y, x, lispenv);
+  }
+  return return_value(3, y, lispenv);
+}
+
+/* return a copy of expression x with its variables resolved to LOCAL and GLOBAL references in scope *s, such that step()
+   finds them by address rather than searching the environment; quoted data and macro arguments are left as they are */
+L resolve(L x, P s, LispEnv *lispenv) {
+  L f, d = lispenv->nil, y = lispenv->nil, p = lispenv->nil, t = lispenv->nil, z;
+  L (*form)(P, P, LispEnv*) = NULL;
+  if (T(x) == ATOM)
+    return *(A(lispenv)+ord(x)) ? ref(x, *s, lispenv) : x;    /* empty atoms are nil */
+  if (T(x) != PAIR)
+    return x;
+  f = FIRST(x, lispenv);
+  if (T(f) == ATOM && *(A(lispenv)+ord(f)))
+    f = ref(f, *s, lispenv);
+  if (T(f) == GLOBAL) {
+    z = bound(f, lispenv);                      /* the special forms are the primitives bound to global variables */
+    if (T(z) == MACRO)
+      return x;
+    if (T(z) == PRIMITIVE)
+      form = primitives[ord(z)].f;
+  }
+  if (form != f_quote && form != f_macro && form != f_lambda && form != f_define && form != f_setq &&
+      form != f_let && form != f_leta && form != f_letrec && form != f_letreca)
+    return resolve_list(x, s, s, lispenv);
+  var(5, lispenv, &x, &d, &y, &p, &t);
+  y = p = pair(f, lispenv->nil, lispenv);
+  x = NEXT(x, lispenv);
+  d = *s;
+  if (form == f_quote || form == f_macro)       /* (quote x) and (macro v x) are not evaluated */
+    set(&NEXT(p, lispenv), x, lispenv);
+  else if (form == f_lambda) {                  /* (lambda v x) evaluates x in a frame of variables v */
+    z = pair(first(x, lispenv), lispenv->nil, lispenv);
+    d = pair(z, d, lispenv);
+    z = resolve_list(next(x, lispenv), &d, &d, lispenv);
+    z = pair(FIRST(x, lispenv), z, lispenv);
+    set(&NEXT(p, lispenv), z, lispenv);
+  }
+  else if (form == f_define || form == f_setq) { /* (define v x) and (setq v x) assign the resolved variable v */
+    z = first(x, lispenv);
+    if (T(z) == ATOM && *(A(lispenv)+ord(z)))
+      z = ref(z, *s, lispenv);
+    z = pair(z, lispenv->nil, lispenv);
+    p = set(&NEXT(p, lispenv), z, lispenv);
+    z = resolve_list(NEXT(x, lispenv), s, s, lispenv);
+    set(&NEXT(p, lispenv), z, lispenv);
+  }
+  else {                                        /* (let (v1 x1) ... (vk xk) y) adds a (v . x) pair for each vi */
+    if (form == f_letrec)
+      for (t = x; more(t, lispenv); t = NEXT(t, lispenv))
+        d = pair(first(first(t, lispenv), lispenv), d, lispenv);
+    for (; more(x, lispenv); x = NEXT(x, lispenv)) {
+      if (form == f_letreca)
+        d = pair(first(first(x, lispenv), lispenv), d, lispenv);
+      z = resolve_list(next(first(x, lispenv), lispenv), &d, form == f_let ? s : &d, lispenv);
+      z = pair(FIRST(FIRST(x, lispenv), lispenv), z, lispenv);
+      z = pair(z, lispenv->nil, lispenv);
+      p = set(&NEXT(p, lispenv), z, lispenv);
+      if (form == f_let || form == f_leta)
+        d = pair(FIRST(FIRST(x, lispenv), lispenv), d, lispenv);
+    }
+    if (T(x) == PAIR) {
+      z = resolve(FIRST(x, lispenv), &d, lispenv);
+      z = pair(z, lispenv->nil, lispenv);
+      set(&NEXT(p, lispenv), z, lispenv);
+    }
+  }
+  return return_value(5, y, lispenv);
+}
+
+
+/*----------------------------------------------------------------------------*\
+ |      COMPILE                                                               |
+\*----------------------------------------------------------------------------*/
+
+/* instructions of the virtual machine, a 32 bit word with the opcode in the lower 8 bits and an operand n in the upper 24:
+        CONST    push constant n             NIL      push ()                     LOCAL    push LOCAL variable n
+        GLOBAL   push GLOBAL variable n      SETL     set LOCAL n to the top      SETG     set GLOBAL n to the top
+        DEFL     define LOCAL n              DEFG     define GLOBAL n             POP      pop the top
+        JUMP     jump to n                   JUMPF    pop, jump to n if ()        ANDJ     jump to n if (), else pop
+        ORJ      jump to n unless (), or pop CALL     call with n arguments       TCALL    tail call with n arguments
+        RET      return the top              CLOSURE  push closure of parameters n and the code at the address that follows
+        EVAL     push the value of the (resolved) expression n evaluated by step()
+        PRIM     call function primitive n & 0xff with the n >> 8 values on top of the stack as its arguments
+        BIND     pop n values and bind them in order to the variables of the n constants that follow
+        SAVE     push the environment        RESTORE  restore the environment saved below the top
+        ADD ...  the primitives of the instructions[] table, with n arguments */
+enum { OP_CONST, OP_NIL, OP_LOCAL, OP_GLOBAL, OP_SETL, OP_SETG, OP_DEFL, OP_DEFG, OP_POP, OP_JUMP, OP_JUMPF, OP_ANDJ, OP_ORJ,
+       OP_CALL, OP_TCALL, OP_RET, OP_CLOSURE, OP_EVAL, OP_PRIM, OP_BIND, OP_SAVE, OP_RESTORE,
+       OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_INT, OP_LT, OP_EQ, OP_NOT, OP_TYPE, OP_PAIR, OP_FIRST, OP_NEXT, OP_LIST };
+
+/* the operand of a LOCAL reference v has the depth in the upper and the slot in the lower 12 bits, when both fit */
+#define SHORT(v) (ord(v) >> SLOT_BITS < 0x1000 && (ord(v) & ((1 << SLOT_BITS)-1)) < 0x1000)
+#define ADDR(v) ((ord(v) >> SLOT_BITS) << 12 | (ord(v) & 0xfff))
+#define REF(n) box(LOCAL, (I)((n) >> 12) << SLOT_BITS | ((n) & 0xfff))
+
+/* the primitives compiled to instructions, with their number of arguments, 0 for one or more and -1 for any number */
+struct {
+  L (*f)(L*, int, LispEnv*);
+  int op, n;
+} instructions[] = {
+  {f_add, OP_ADD, 0}, {f_sub, OP_SUB, 0}, {f_mul, OP_MUL, 0}, {f_div, OP_DIV, 0}, {f_int, OP_INT, 1},
+  {f_lt, OP_LT, 2}, {f_eq, OP_EQ, 2}, {f_not, OP_NOT, 1}, {f_type, OP_TYPE, 1},
+  {f_pair, OP_PAIR, 2}, {f_first, OP_FIRST, 1}, {f_next, OP_NEXT, 1}, {f_list, OP_LIST, -1},
+  {0}};
+
+/* append instruction word w to the code, returns its address */
+I emit(I w, LispEnv *lispenv) {
+  if (lispenv->code_num >= 1 << 24)             /* a code address must fit in an operand */
+    err(7);
+  if (lispenv->code_num == lispenv->code_cap) {
+    lispenv->code_cap *= 2;
+    lispenv->code = (uint32_t*)realloc(lispenv->code, sizeof(uint32_t)*lispenv->code_cap);
+  }
+  lispenv->code[lispenv->code_num] = w;
+  return lispenv->code_num++;
+}
+
+/* make the jump instruction at address j jump to the next instruction */
+void patch(I j, LispEnv *lispenv) {
+  lispenv->code[j] = (lispenv->code[j] & 0xff) | lispenv->code_num << 8;
+}
+
+/* add x to the constants of the code, returns its index */
+I constant(L x, LispEnv *lispenv) {
+  if (lispenv->const_num >= 1 << 24)
+    err(7);
+  if (lispenv->const_num == lispenv->const_cap) {
+    lispenv->const_cap *= 2;
+    lispenv->consts = (L*)realloc(lispenv->consts, sizeof(L)*lispenv->const_cap);
+  }
+  lispenv->consts[lispenv->const_num] = x;
+  return lispenv->const_num++;
+}
+
+/* return the number of items of list t, or -1 if t is a dot list */
+int length(L t, LispEnv *lispenv) {
+  int n = 0;
+  for (; T(t) == PAIR; t = NEXT(t, lispenv))
+    ++n;
+  return T(t) == NIL ? n : -1;
+}
+
+void gen(L, int, LispEnv*);
+
+/* compile the expressions of list t in sequence, the value of the last is the value of the sequence as with begin */
+void gen_begin(L t, int tail, LispEnv *lispenv) {
+  if (T(t) != PAIR) {
+    emit(OP_NIL, lispenv);
+    if (tail)
+      emit(OP_RET, lispenv);
+    return;
+  }
+  for (; T(NEXT(t, lispenv)) == PAIR; t = NEXT(t, lispenv)) {
+    gen(FIRST(t, lispenv), 0, lispenv);
+    emit(OP_POP, lispenv);
+  }
+  gen(FIRST(t, lispenv), tail, lispenv);
+}
+
+/* compile the clauses t of a cond */
+void gen_cond(L t, int tail, LispEnv *lispenv) {
+  I j, k;
+  if (T(t) != PAIR) {
+    gen_begin(t, tail, lispenv);
+    return;
+  }
+  gen(FIRST(FIRST(t, lispenv), lispenv), 0, lispenv);
+  j = emit(OP_JUMPF, lispenv);
+  gen_begin(NEXT(FIRST(t, lispenv), lispenv), tail, lispenv);
+  if (!tail)
+    k = emit(OP_JUMP, lispenv);
+  patch(j, lispenv);
+  gen_cond(NEXT(t, lispenv), tail, lispenv);
+  if (!tail)
+    patch(k, lispenv);
+}
+
+/* compile the expressions t of an and (op is ANDJ) or an or (op is ORJ), which stops at the first () or non-() value */
+void gen_logic(L t, int op, LispEnv *lispenv) {
+  I j;
+  gen(FIRST(t, lispenv), 0, lispenv);
+  if (T(NEXT(t, lispenv)) == PAIR) {
+    j = emit(op, lispenv);
+    gen_logic(NEXT(t, lispenv), op, lispenv);
+    patch(j, lispenv);
+  }
+}
+
+/* compile the let, let*, letrec or letrec* form with bindings and body t, returns zero if its bindings are not compiled */
+int gen_let(L t, L (*form)(P, P, LispEnv*), int tail, LispEnv *lispenv) {
+  L s;
+  I k, n = 0;
+  for (s = t; more(s, lispenv); s = NEXT(s, lispenv), ++n)   /* check that the bindings are (v x1 ... xk) lists */
+    if (T(FIRST(s, lispenv)) != PAIR || T(FIRST(FIRST(s, lispenv), lispenv)) != ATOM || length(FIRST(s, lispenv), lispenv) < 1 ||
+        (form == f_let && length(FIRST(s, lispenv), lispenv) > 2))   /* let evaluates x1 ... xk-1 in the new scope */
+      return 0;
+  if (n >= 0x1000)
+    return 0;
+  if (!tail)
+    emit(OP_SAVE, lispenv);
+  if (form == f_let) {                          /* (let (v1 x1) ... (vk xk) y) evaluates x1 ... xk before binding v1 ... vk */
+    for (s = t; more(s, lispenv); s = NEXT(s, lispenv))
+      gen_begin(NEXT(FIRST(s, lispenv), lispenv), 0, lispenv);
+    emit(OP_BIND | n << 8, lispenv);
+    for (s = t; more(s, lispenv); s = NEXT(s, lispenv))
+      emit(constant(FIRST(FIRST(s, lispenv), lispenv), lispenv), lispenv);
+  }
+  else if (form == f_letrec) {                  /* (letrec (v1 x1) ... (vk xk) y) binds v1 ... vk to () first */
+    for (k = 0; k < n; ++k)
+      emit(OP_NIL, lispenv);
+    emit(OP_BIND | n << 8, lispenv);
+    for (s = t; more(s, lispenv); s = NEXT(s, lispenv))
+      emit(constant(FIRST(FIRST(s, lispenv), lispenv), lispenv), lispenv);
+    for (k = 0, s = t; more(s, lispenv); s = NEXT(s, lispenv), ++k) {
+      gen_begin(NEXT(FIRST(s, lispenv), lispenv), 0, lispenv);   /* like f_letrec, the ith value is set at depth i */
+      emit(OP_SETL | (k << 12) << 8, lispenv);
+      emit(OP_POP, lispenv);
+    }
+  }
+  else
+    for (s = t; more(s, lispenv); s = NEXT(s, lispenv)) {
+      if (form == f_letreca) {
+        emit(OP_NIL, lispenv);
+        emit(OP_BIND | 1 << 8, lispenv);
+        emit(constant(FIRST(FIRST(s, lispenv), lispenv), lispenv), lispenv);
+      }
+      gen_begin(NEXT(FIRST(s, lispenv), lispenv), 0, lispenv);
+      if (form == f_letreca) {
+        emit(OP_SETL, lispenv);
+        emit(OP_POP, lispenv);
+      }
+      else {
+        emit(OP_BIND | 1 << 8, lispenv);
+        emit(constant(FIRST(FIRST(s, lispenv), lispenv), lispenv), lispenv);
+      }
+    }
+  gen_begin(s, tail, lispenv);
+  if (!tail)
+    emit(OP_RESTORE, lispenv);
+  return 1;
+}
+
+/* compile the form x, returns zero if x is not compiled, but evaluated by step() */
+int gen_form(L x, int tail, LispEnv *lispenv) {
+  L f = FIRST(x, lispenv), t = NEXT(x, lispenv), v, z;
+  L (*form)(P, P, LispEnv*) = NULL;
+  L (*fn)(L*, int, LispEnv*) = NULL;
+  int n = length(t, lispenv), k;
+  I i, j, p = 0;
+  if (T(f) == ATOM || n < 0)                    /* macro applications and dot list arguments are left to step() */
+    return 0;
+  if (T(f) == GLOBAL) {                         /* like resolve(), the special forms are the primitives bound at compile time */
+    z = bound(f, lispenv);
+    if (T(z) == MACRO)
+      return 0;
+    if (T(z) == PRIMITIVE) {
+      p = ord(z);
+      form = primitives[p].f;
+      fn = primitives[p].fn;
+    }
+  }
+  if (!form && !fn) {                                  /* (f x1 ... xk) calls function f with the values of x1 ... xk */
+    gen(f, 0, lispenv);
+    for (; T(t) == PAIR; t = NEXT(t, lispenv))
+      gen(FIRST(t, lispenv), 0, lispenv);
+    emit((tail ? OP_TCALL : OP_CALL) | n << 8, lispenv);
+    return 1;
+  }
+  for (k = 0; instructions[k].f; ++k)
+    if (instructions[k].f == fn && (instructions[k].n == n || (!instructions[k].n && n) || instructions[k].n < 0))
+      break;
+  if (instructions[k].f) {                      /* (+ x1 ... xk) is an instruction applied to the values of x1 ... xk */
+    for (; T(t) == PAIR; t = NEXT(t, lispenv))
+      gen(FIRST(t, lispenv), 0, lispenv);
+    emit(instructions[k].op | n << 8, lispenv);
+  }
+  else if (fn && n < 0x10000) {                 /* (f x1 ... xk) calls function primitive f with the values of x1 ... xk */
+    for (; T(t) == PAIR; t = NEXT(t, lispenv))
+      gen(FIRST(t, lispenv), 0, lispenv);
+    emit(OP_PRIM | (n << 8 | p) << 8, lispenv);
+  }
+  else if (form == f_quote && n)
+    emit(OP_CONST | constant(FIRST(t, lispenv), lispenv) << 8, lispenv);
+  else if (form == f_lambda && n >= 2) {        /* (lambda v x) compiles x to the code of the closure, which is jumped over */
+    j = emit(OP_JUMP, lispenv);
+    gen(FIRST(NEXT(t, lispenv), lispenv), 1, lispenv);
+    patch(j, lispenv);
+    emit(OP_CLOSURE | constant(FIRST(t, lispenv), lispenv) << 8, lispenv);
+    emit(j+1, lispenv);
+  }
+  else if (form == f_begin) {
+    gen_begin(t, tail, lispenv);
+    return 1;
+  }
+  else if (form == f_if && n >= 2) {
+    gen(FIRST(t, lispenv), 0, lispenv);
+    j = emit(OP_JUMPF, lispenv);
+    gen(FIRST(NEXT(t, lispenv), lispenv), tail, lispenv);
+    if (!tail)
+      i = emit(OP_JUMP, lispenv);
+    patch(j, lispenv);
+    gen_begin(NEXT(NEXT(t, lispenv), lispenv), tail, lispenv);
+    if (!tail)
+      patch(i, lispenv);
+    return 1;
+  }
+  else if (form == f_cond) {
+    for (z = t; T(z) == PAIR; z = NEXT(z, lispenv))
+      if (length(FIRST(z, lispenv), lispenv) < 1)
+        return 0;
+    gen_cond(t, tail, lispenv);
+    return 1;
+  }
+  else if (form == f_while && n) {              /* (while x y1 ... yk) keeps the value of the last y on the stack */
+    emit(OP_NIL, lispenv);
+    i = lispenv->code_num;
+    gen(FIRST(t, lispenv), 0, lispenv);
+    j = emit(OP_JUMPF, lispenv);
+    if (T(NEXT(t, lispenv)) == PAIR) {
+      emit(OP_POP, lispenv);
+      gen_begin(NEXT(t, lispenv), 0, lispenv);
+    }
+    emit(OP_JUMP | i << 8, lispenv);
+    patch(j, lispenv);
+  }
+  else if ((form == f_and || form == f_or) && n)
+    gen_logic(t, form == f_and ? OP_ANDJ : OP_ORJ, lispenv);
+  else if (form == f_and || form == f_or)
+    emit(form == f_and ? OP_CONST | constant(lispenv->tru, lispenv) << 8 : OP_NIL, lispenv);
+  else if ((form == f_define || form == f_setq) && n >= 2 &&
+           (v = FIRST(t, lispenv), (T(v) == LOCAL && SHORT(v)) || T(v) == GLOBAL)) {
+    gen(FIRST(NEXT(t, lispenv), lispenv), 0, lispenv);
+    if (T(v) == LOCAL)
+      emit((form == f_define ? OP_DEFL : OP_SETL) | ADDR(v) << 8, lispenv);
+    else
+      emit((form == f_define ? OP_DEFG : OP_SETG) | ord(v) << 8, lispenv);
+  }
+  else if ((form == f_let || form == f_leta || form == f_letrec || form == f_letreca) && n)
+    return gen_let(t, form, tail, lispenv);
+  else
+    return 0;
+  if (tail)
+    emit(OP_RET, lispenv);
+  return 1;
+}
+
+/* compile expression x to code that pushes the value of x, or returns it when x is in tail position */
+void gen(L x, int tail, LispEnv *lispenv) {
+  switch (T(x)) {
+    case PAIR:
+      if (gen_form(x, tail, lispenv))
+        return;
+      emit(OP_EVAL | constant(x, lispenv) << 8, lispenv);
+      break;
+    case LOCAL:
+      emit(SHORT(x) ? OP_LOCAL | ADDR(x) << 8 : OP_EVAL | constant(x, lispenv) << 8, lispenv);
+      break;
+    case GLOBAL:
+      emit(OP_GLOBAL | ord(x) << 8, lispenv);
+      break;
+    case ATOM:
+      emit(OP_EVAL | constant(x, lispenv) << 8, lispenv);
+      break;
+    case NIL:
+      emit(OP_NIL, lispenv);
+      break;
+    default:
+      emit(OP_CONST | constant(x, lispenv) << 8, lispenv);
+  }
+  if (tail)
+    emit(OP_RET, lispenv);
+}
+
+/* compile the resolved expression x, returns the address of its code. compiling does not allocate cells or atoms, so x
+   does not move until the code runs */
+I compile(L x, LispEnv *lispenv) {
+  I i = lispenv->code_num;
+  gen(x, 1, lispenv);
+  return i;
+}
+
+/*----------------------------------------------------------------------------*\
+ |      VIRTUAL MACHINE                                                       |
+\*----------------------------------------------------------------------------*/
+
+/* the top of the stack of the virtual machine */
+#define TOP(lispenv) lispenv->vstack[lispenv->vsp-1]
+
+/* push x on the stack of the virtual machine */
+void push(L x, LispEnv *lispenv) {
+  if (lispenv->vsp == lispenv->vstack_cap) {
+    if (lispenv->vstack_cap >= STACK_MAX)
+      err(6);
+    lispenv->vstack_cap *= 2;
+    lispenv->vstack = (L*)realloc(lispenv->vstack, sizeof(L)*lispenv->vstack_cap);
+  }
+  lispenv->vstack[lispenv->vsp++] = x;
+}
+
+/* run the code at address i in environment *e, returns the value it returns. a call pushes the return address and the
+   environment of the caller, a tail call reuses them, so the stack of the virtual machine does not grow with tail calls */
+L run(I i, P e, LispEnv *lispenv) {
+  L env = *e, f = lispenv->nil, v = lispenv->nil, d = lispenv->nil, x;
+  I w, n, j, k, base;
+  var(4, lispenv, &env, &f, &v, &d);
+  push(-1.0, lispenv);                          /* return address -1 returns from run() */
+  push(env, lispenv);
+  while (1) {
+    lispenv->stats.steps++;
+    w = lispenv->code[i++];
+    n = w >> 8;
+    switch (w & 0xff) {
+      case OP_CONST:   push(lispenv->consts[n], lispenv);                                    break;
+      case OP_NIL:     push(lispenv->nil, lispenv);                                          break;
+      case OP_LOCAL:   push(*local(REF(n), env, lispenv), lispenv);                          break;
+      case OP_GLOBAL:  push(value(box(GLOBAL, n), lispenv), lispenv);                        break;
+      case OP_SETL:    set(local(REF(n), env, lispenv), TOP(lispenv), lispenv);              break;
+      case OP_POP:     --lispenv->vsp;                                                       break;
+      case OP_JUMP:    i = n;                                                                break;
+      case OP_JUMPF:   if (lisp_not(lispenv->vstack[--lispenv->vsp])) i = n;                 break;
+      case OP_ANDJ:    if (lisp_not(TOP(lispenv))) i = n; else --lispenv->vsp;               break;
+      case OP_ORJ:     if (!lisp_not(TOP(lispenv))) i = n; else --lispenv->vsp;              break;
+      case OP_SAVE:    push(env, lispenv);                                                   break;
+      case OP_SETG:
+        x = lispenv->globals[n];
+        if (T(x) != PAIR)
+          ERR(3, "unbound %s ", A(lispenv)+ord(x));
+        set(&NEXT(x, lispenv), TOP(lispenv), lispenv);
+        break;
+      case OP_DEFL:
+        set(local(REF(n), env, lispenv), TOP(lispenv), lispenv);
+        TOP(lispenv) = name(REF(n), env, lispenv);
+        break;
+      case OP_DEFG:
+        bind(n, TOP(lispenv), lispenv);
+        TOP(lispenv) = name(box(GLOBAL, n), lispenv->nil, lispenv);
+        break;
+      case OP_CLOSURE:
+        x = closure(lispenv->consts[n], box(CODE, lispenv->code[i++]), &env, lispenv);
+        push(x, lispenv);
+        break;
+      case OP_EVAL:
+        x = eval(lispenv->consts[n], &env, lispenv);
+        push(x, lispenv);
+        break;
+      case OP_PRIM:
+        k = n & 0xff;
+        n >>= 8;
+        x = primitives[k].fn(lispenv->vstack+lispenv->vsp-n, n, lispenv);
+        if (primitives[k].t)
+          x = eval(x, &env, lispenv);
+        lispenv->vsp -= n;
+        push(x, lispenv);
+        break;
+      case OP_BIND:
+        for (k = 0; k < n; ++k)
+          env = env_pair(lispenv->consts[lispenv->code[i+k]], lispenv->vstack[lispenv->vsp-n+k], &env, lispenv);
+        i += n;
+        lispenv->vsp -= n;
+        break;
+      case OP_RESTORE:
+        env = lispenv->vstack[lispenv->vsp-2];
+        lispenv->vstack[lispenv->vsp-2] = TOP(lispenv);
+        --lispenv->vsp;
+        break;
+      case OP_ADD:
+      case OP_SUB:
+      case OP_MUL:
+      case OP_DIV:
+        x = lispenv->vstack[lispenv->vsp-n];
+        if (n == 1)
+          x = (w & 0xff) == OP_SUB ? -x : (w & 0xff) == OP_DIV ? 1.0/x : x;
+        for (k = n-1; k; --k)
+          switch (w & 0xff) {
+            case OP_ADD: x += lispenv->vstack[lispenv->vsp-k]; break;
+            case OP_SUB: x -= lispenv->vstack[lispenv->vsp-k]; break;
+            case OP_MUL: x *= lispenv->vstack[lispenv->vsp-k]; break;
+            default:     x /= lispenv->vstack[lispenv->vsp-k]; break;
+          }
+        lispenv->vsp -= n-1;
+        TOP(lispenv) = num(x);
+        break;
+      case OP_INT:     TOP(lispenv) = lisp_int(TOP(lispenv));                                break;
+      case OP_NOT:     TOP(lispenv) = lisp_not(TOP(lispenv)) ? lispenv->tru : lispenv->nil;  break;
+      case OP_TYPE:    TOP(lispenv) = lisp_type(TOP(lispenv));                               break;
+      case OP_FIRST:   TOP(lispenv) = first(TOP(lispenv), lispenv);                          break;
+      case OP_NEXT:    TOP(lispenv) = next(TOP(lispenv), lispenv);                           break;
+      case OP_LT:
+        x = lispenv->vstack[--lispenv->vsp];
+        TOP(lispenv) = lisp_lt(TOP(lispenv), x, lispenv);
+        break;
+      case OP_EQ:
+        x = lispenv->vstack[--lispenv->vsp];
+        TOP(lispenv) = lisp_eq(TOP(lispenv), x, lispenv);
+        break;
+      case OP_PAIR:
+        x = pair(lispenv->vstack[lispenv->vsp-2], TOP(lispenv), lispenv);
+        --lispenv->vsp;
+        TOP(lispenv) = x;
+        break;
+      case OP_LIST:
+        for (x = lispenv->nil, k = 1; k <= n; ++k)
+          x = pair(lispenv->vstack[lispenv->vsp-k], x, lispenv);
+        lispenv->vsp -= n;
+        push(x, lispenv);
+        break;
+      case OP_CALL:
+      case OP_TCALL:
+        base = lispenv->vsp-n-1;                /* the function is below its n arguments on the stack */
+        f = lispenv->vstack[base];
+        if (T(f) == CLOSURE) {
+          v = FIRST(FIRST(f, lispenv), lispenv);
+          x = frame(&v, lispenv);
+          lispenv->vstack[base] = x;            /* the frame of the arguments replaces the function on the stack */
+          for (k = 1; T(v) == PAIR && k <= n; v = NEXT(v, lispenv), ++k)
+            set(&SLOT(lispenv->vstack[base], k, lispenv), lispenv->vstack[base+k], lispenv);
+          if (T(v) == PAIR)
+            err(5);
+          if (T(v) != NIL) {                    /* a dotted variable gets the list of the remaining arguments */
+            for (d = lispenv->nil, j = n+1; --j >= k; )
+              d = pair(lispenv->vstack[base+j], d, lispenv);
+            set(&SLOT(lispenv->vstack[base], k, lispenv), d, lispenv);
+          }
+          d = NEXT(f, lispenv);
+          if (T(d) == NIL)
+            d = lispenv->env;
+          d = pair(lispenv->vstack[base], d, lispenv);
+          lispenv->vsp = base;
+          x = NEXT(FIRST(f, lispenv), lispenv);
+          if (T(x) == CODE) {                   /* call compiled code, a tail call returns to the caller's caller */
+            if ((w & 0xff) == OP_CALL) {
+              push(i, lispenv);
+              push(env, lispenv);
+            }
+            env = d;
+            i = ord(x);
+            break;
+          }
+          x = eval(x, &d, lispenv);             /* the body of a closure made by lambda is evaluated by step() */
+        }
+        else if (T(f) == PRIMITIVE && primitives[ord(f)].fn) { /* a function primitive takes its arguments on the stack */
+          x = primitives[ord(f)].fn(lispenv->vstack+base+1, n, lispenv);
+          if (primitives[ord(f)].t)
+            x = eval(x, &env, lispenv);
+          lispenv->vsp = base;
+        }
+        else if (T(f) == PRIMITIVE) {           /* a special form takes its arguments quoted, unless they evaluate to themselves */
+          for (k = 0; primitives[k].f != f_quote; ++k)
+            continue;
+          for (v = lispenv->nil, j = n+1; --j; ) {
+            x = lispenv->vstack[base+j];
+            if (T(x) == ATOM || T(x) == PAIR || T(x) == GLOBAL || T(x) == LOCAL) {
+              x = pair(x, lispenv->nil, lispenv);
+              x = pair(box(PRIMITIVE, k), x, lispenv);
+            }
+            v = pair(x, v, lispenv);
+          }
+          d = env;
+          f = lispenv->vstack[base];
+          x = primitives[ord(f)].f(&v, &d, lispenv);
+          if (primitives[ord(f)].t)
+            x = eval(x, &d, lispenv);
+          lispenv->vsp = base;
+        }
+        else
+          x = err(4);
+        push(x, lispenv);
+        if ((w & 0xff) == OP_CALL)
+          break;
+        /* a tail call of a primitive or of a closure made by lambda returns its value */
+      case OP_RET:
+        x = lispenv->vstack[--lispenv->vsp];
+        env = lispenv->vstack[--lispenv->vsp];
+        if (lispenv->vstack[--lispenv->vsp] < 0)
+          return return_value(4, x, lispenv);
+        i = lispenv->vstack[lispenv->vsp];
+        push(x, lispenv);
+        break;
+    }
+  }
+}
+
+/* evaluate x in environment e by compiling it for the virtual machine, returns the value of x. when tracing, x is
+   evaluated by step() instead, to display its evaluation steps */
+L exec(L x, P e, LispEnv *lispenv) {
+  x = resolve(x, &lispenv->nil, lispenv);
+  if (TRACING(1, TRACE_STEPS, lispenv))
+    return eval(x, e, lispenv);
+  return run(compile(x, lispenv), e, lispenv);
+}
+
+/*----------------------------------------------------------------------------*\
+ |      ENCODING                                                              |
+\*----------------------------------------------------------------------------*/
+
+/* values are encoded in bytes to send them to daemons and to store them. an encoding is ENCODING_MAGIC and ENCODING_VERSION
+   followed by a stream of values, each a code byte followed by what the code says:
+        ENC_NIL        ()
+        ENC_NUMBER     the 8 bytes of a number as they are
+        ENC_INTEGER    a number that is an integer of less than 2^53 in magnitude, as a zigzag varint
+        ENC_STRING     a STRING: the varint length of its bytes, then its bytes
+        ENC_ATOM       an ATOM new to the stream, as a STRING is, which gets the next symbol id of the stream
+        ENC_SYMBOL     the varint symbol id of an ATOM that is not new
+        ENC_PRIMITIVE  a primitive, its name as a STRING is
+        ENC_LIST       a list of n pairs: the varint n, the pairs get the next n pair ids of the value, then the n items
+                       and the tail of the list
+        ENC_REF        the varint pair id of a pair of the value that is encoded before, shared and cyclic lists stay so
+   a varint has groups of 7 bits from the lowest, each with the high bit set when more follow. the values of a stream share
+   its atoms, a value its pairs. closures, macros, frames and slices belong to their environment, they are encoded as () */
+#define ENCODING_MAGIC 0xd1
+#define ENCODING_VERSION 1
+enum { ENC_NIL, ENC_NUMBER, ENC_INTEGER, ENC_STRING, ENC_ATOM, ENC_SYMBOL, ENC_PRIMITIVE, ENC_LIST, ENC_REF };
+
+/* a mark encode() leaves on the heap: the cell index of a pair and the car it replaced with a FORW of the pair id, or the
+   heap offset of an atom and the size it replaced with the negative symbol id+1 */
+typedef struct Mark{
+  I i;
+  L x;
+}Mark;
+
+/* a stream of values encoded in the len bytes b. while a value is encoded its pairs and the atoms of the stream are marked,
+   the marks are kept to mark the atoms again for the next value. a major collection moves the atoms, after it the stream
+   gets their names again, with symbol ids from atom_base */
+typedef struct Encoder{
+  char *b;
+  size_t len, cap;
+  Mark *pairs, *atoms;
+  unsigned int pair_num, pair_cap, atom_num, atom_cap, atom_base;
+  uint64_t majors;
+}Encoder;
+
+/* the encoder of the messages of the thread, see message() */
+thread_local Encoder scratch_encoder;
+
+/* return the end of the bytes of encoder w, which has room for n more */
+char *room(Encoder *w, size_t n) {
+  if (w->len+n > w->cap) {
+    w->cap = 2*w->cap > w->len+n ? 2*w->cap : w->len+n < 256 ? 256 : w->len+n;
+    w->b = (char*)realloc(w->b, w->cap);
+  }
+  return w->b+w->len;
+}
+
+/* append the n bytes s to encoder w */
+void put(Encoder *w, const void *s, size_t n) {
+  memcpy(room(w, n), s, n);
+  w->len += n;
+}
+
+/* append code c and the varint n to encoder w */
+void put_code(Encoder *w, char c, I n) {
+  char *v = room(w, 11);
+  int k = 0;
+  v[k++] = c;
+  for (; n >= 0x80; n >>= 7)
+    v[k++] = (char)(n | 0x80);
+  v[k++] = (char)n;
+  w->len += k;
+}
+
+/* append code c and the n bytes s, as a STRING is encoded, to encoder w */
+void put_name(Encoder *w, char c, const char *s, I n) {
+  put_code(w, c, n);
+  put(w, s, n);
+}
+
+/* return a new mark of the *num marks *m, which has room for *cap */
+Mark *new_mark(Mark **m, unsigned int *num, unsigned int *cap) {
+  if (*num == *cap) {
+    *cap = *cap ? 2**cap : 64;
+    *m = (Mark*)realloc(*m, sizeof(Mark)**cap);
+  }
+  return &(*m)[(*num)++];
+}
+
+/* append the encoding of x to encoder w, the items of a list are encoded in a loop and only lists in lists recurse */
+void encode_value(L x, Encoder *w, LispEnv *lispenv) {
+  unsigned int n, k;
+  int64_t i;
+  Mark *m;
+  S *size;
+  L t;
+  switch (T(x)) {
+    case NIL:
+      *room(w, 1) = ENC_NIL;
+      w->len++;
+      break;
+    case PRIMITIVE:
+      put_name(w, ENC_PRIMITIVE, primitives[ord(x)].s, strlen(primitives[ord(x)].s));
+      break;
+    case ATOM:
+      size = (S*)(A(lispenv)+ord(x)-W);
+      if (*size < 0) {                          /* an atom the stream knows */
+        put_code(w, ENC_SYMBOL, -*size-1);
+        break;
+      }
+      put_name(w, ENC_ATOM, A(lispenv)+ord(x), strlen(A(lispenv)+ord(x)));
+      m = new_mark(&w->atoms, &w->atom_num, &w->atom_cap);
+      m->i = ord(x);
+      m->x = *size;
+      *size = -(S)(w->atom_base+w->atom_num);
+      break;
+    case STRING:
+      put_name(w, ENC_STRING, A(lispenv)+ord(x), strlen(A(lispenv)+ord(x)));
+      break;
+    case PAIR:
+      if (T(FIRST(x, lispenv)) == FORW) {       /* a pair of the value that is encoded before */
+        put_code(w, ENC_REF, ord(FIRST(x, lispenv)));
+        break;
+      }
+      for (k = w->pair_num, t = x; T(t) == PAIR && T(FIRST(t, lispenv)) != FORW; t = NEXT(t, lispenv)) {
+        m = new_mark(&w->pairs, &w->pair_num, &w->pair_cap);
+        m->i = ord(t);
+        m->x = FIRST(t, lispenv);
+        FIRST(t, lispenv) = box(FORW, w->pair_num-1);
+      }
+      put_code(w, ENC_LIST, w->pair_num-k);
+      for (n = w->pair_num; k < n; ++k)         /* the marks may move while the items are encoded */
+        encode_value(w->pairs[k].x, w, lispenv);
+      encode_value(t, w, lispenv);
+      break;
+    case CLOSURE: case MACRO: case FRAME: case SLICE: case GLOBAL: case LOCAL: case CODE: case FORW: case VARP:
+      *room(w, 1) = ENC_NIL;
+      w->len++;
+      break;
+    default:
+      i = (int64_t)x;
+      if (x >= -9007199254740992.0 && x <= 9007199254740992.0 && (L)i == x && *(I*)&x != 1ULL << 63) {  /* not -0 */
+        put_code(w, ENC_INTEGER, (I)i << 1 ^ (I)(i >> 63));
+        break;
+      }
+      *room(w, 1) = ENC_NUMBER;
+      w->len++;
+      put(w, &x, sizeof(L));
+  }
+}
+
+/* start a new stream in encoder w, which keeps the room it has. a zeroed Encoder can start one */
+void encoding(Encoder *w) {
+  char v[2] = {(char)ENCODING_MAGIC, ENCODING_VERSION};
+  w->len = 0;
+  w->pair_num = w->atom_num = w->atom_base = 0;
+  put(w, v, 2);
+}
+
+/* append the encoding of value x of lispenv to the stream of encoder w. the heap is marked while it is encoded and is as
+   it was after */
+void encode(L x, Encoder *w, LispEnv *lispenv) {
+  unsigned int k;
+  if (w->atom_num && w->majors != lispenv->stats.majors) {  /* the atoms moved, the stream gets their names again */
+    w->atom_base += w->atom_num;
+    w->atom_num = 0;
+  }
+  w->majors = lispenv->stats.majors;
+  for (k = 0; k < w->atom_num; ++k)
+    *(S*)(A(lispenv)+w->atoms[k].i-W) = -(S)(w->atom_base+k+1);
+  encode_value(x, w, lispenv);
+  for (k = 0; k < w->pair_num; ++k)
+    lispenv->cell[w->pairs[k].i+1] = w->pairs[k].x;
+  for (k = 0; k < w->atom_num; ++k)
+    *(S*)(A(lispenv)+w->atoms[k].i-W) = (S)w->atoms[k].x;
+  w->pair_num = 0;
+}
+
+/* release the bytes and the marks of encoder w */
+void end_encoding(Encoder *w) {
+  free(w->b);
+  free(w->pairs);
+  free(w->atoms);
+}
+
+/* an atom of a stream that is decoded: the offset and length of its name in the bytes and its heap offset, 0 when unknown */
+typedef struct Symbol{
+  size_t at;
+  unsigned int len;
+  I i;
+}Symbol;
+
+/* a stream of values decoded from the len bytes b, k is the offset of the next value. the pairs of the value that is
+   decoded are kept by pair id, the cells that wait for their values on a stack of holes */
+typedef struct Decoder{
+  const char *b;
+  size_t len, k;
+  Symbol *symbols;
+  unsigned int symbol_num, symbol_cap;
+  uint64_t majors;
+  L *pairs;
+  I *holes;
+  I pair_cap, hole_cap;
+}Decoder;
+
+#define HOLE_VALUE ((I)-1)                      /* the hole of the value that is decoded, which is not a cell */
+
+/* the decoder of the messages of the thread, see unpack() */
+thread_local Decoder scratch_decoder;
+
+/* read the varint at offset *k of the len bytes b into *n and advance *k, returns 0 if it does not end within them */
+int get_varint(const char *b, size_t len, size_t *k, I *n) {
+  int s;
+  unsigned char c;
+  for (*n = 0, s = 0; *k < len && s < 64; s += 7) {
+    c = b[(*k)++];
+    *n |= (I)(c & 0x7f) << s;
+    if (!(c & 0x80))
+      return 1;
+  }
+  return 0;
+}
+
+/* the index of the primitive named by the n bytes s, or the number of primitives if there is none */
+I primitive(const char *s, I n) {
+  I k;
+  for (k = 0; primitives[k].s && (strnlen(primitives[k].s, n+1) != n || memcmp(primitives[k].s, s, n)); ++k)
+    continue;
+  return k;
+}
+
+/* start decoding the stream of values in the len bytes b with decoder r, which keeps the room it has, returns 0 if they
+   do not start with the magic and the version of an encoding. a zeroed Decoder can start one */
+int decoding(Decoder *r, const char *b, size_t len) {
+  r->b = b;
+  r->len = len;
+  r->k = 2;
+  r->symbol_num = 0;
+  return len >= 2 && (unsigned char)b[0] == ENCODING_MAGIC && b[1] == ENCODING_VERSION;
+}
+
+/* check the value at offset k of decoder r without decoding it, returns the offset after it or 0 if the bytes are not a
+   value. *pairs and *bytes are set to the pairs and to at most the heap bytes of atoms and strings that decoding it makes,
+   *values to the number of values it holds */
+size_t check(Decoder *r, I *pairs, I *bytes, I *values) {
+  const char *b = r->b;
+  size_t k = r->k, len = r->len;
+  I need = 1, ids = 0, symbols = r->symbol_num, n = 0, x;
+  unsigned char c;
+  *pairs = *bytes = *values = 0;
+  for (; need; --need, ++*values) {             /* each value is needed, a list needs its items and its tail */
+    if (k >= len)
+      return 0;
+    c = b[k++];
+    if (c != ENC_NIL && c != ENC_NUMBER && (c > ENC_REF || !get_varint(b, len, &k, &n)))
+      return 0;
+    switch (c) {
+      case ENC_NUMBER:                          /* a number, not a NaN-boxed value */
+        if (len-k < sizeof(L))
+          return 0;
+        memcpy(&x, b+k, sizeof(L));
+        if ((x >> 48 & 0x7ff8) == 0x7ff8 && (x >> 48 & 7))
+          return 0;
+        k += sizeof(L);
+        break;
+      case ENC_ATOM:
+        ++symbols;
+      case ENC_STRING:
+      case ENC_PRIMITIVE:
+        if (n > len-k || n >= 1 << 30 || (c == ENC_PRIMITIVE && !primitives[primitive(b+k, n)].s))
+          return 0;
+        k += n;
+        *bytes += c == ENC_PRIMITIVE ? 0 : W+n+1;
+        break;
+      case ENC_SYMBOL:
+        if (n >= symbols)
+          return 0;
+        if (n < r->symbol_num)                  /* an atom of a value before may have to be made again */
+          *bytes += W+r->symbols[n].len+1;
+        break;
+      case ENC_REF:
+        if (n >= ids)
+          return 0;
+        break;
+      case ENC_LIST:
+        if (n == 0 || n > len-k)
+          return 0;
+        ids += n;
+        need += n+1;
+        *pairs += n;
+        break;
+    }
+  }
+  return k;
+}
+
+/* make room for n pairs and m bytes of atoms and strings that are made without a garbage collection in between, returns
+   nonzero if the pairs fit in the nursery, else they are made in the old generation */
+int reserve(I n, I m, LispEnv *lispenv) {
+  if (2*n+2 <= lispenv->Y && lispenv->ysp < lispenv->young+2*n+2)
+    collect(1, lispenv);
+  if (lispenv->hp+m+((2*n+2)<<3) > lispenv->sp<<3)
+    full(1, 2*n+(m+7)/8, lispenv);
+  return 2*n+2 <= lispenv->Y && lispenv->ysp >= lispenv->young+2*n+2;
+}
+
+/* make the ATOM or STRING t of the n bytes s on the heap, which has room for it. the atom of a name that is interned is
+   not made again */
+L heap_string(I t, const char *s, I n, LispEnv *lispenv) {
+  char *p = A(lispenv)+lispenv->hp;
+  I i;
+  *(S*)p = n+1;
+  memcpy(p+W, s, n);
+  p[W+n] = 0;
+  if (t == ATOM && (i = atom_slot(p+W, lispenv)->i))
+    return box(ATOM, i);
+  lispenv->hp += W+n+1;
+  lispenv->stats.alloc_bytes += W+n+1;
+  if (t == ATOM)
+    intern(lispenv->hp-n-1, lispenv);
+  return box(t, lispenv->hp-n-1);
+}
+
+/* decode the next value of decoder r on the heap of lispenv and return it, throws error 8 if the bytes are not a value.
+   room for the value is made first, its pairs, atoms and strings are then made in place */
+L decode(Decoder *r, LispEnv *lispenv) {
+  const char *b = r->b;
+  size_t k = r->k, end;
+  I pairs, bytes, values, ids = 0, sp = 0, n = 0, h, i, j;
+  int young;
+  Symbol *s;
+  L x, v = lispenv->nil;
+  unsigned char c;
+  if (!(end = check(r, &pairs, &bytes, &values)))
+    return err(8);
+  young = reserve(pairs, bytes, lispenv);
+  if (r->majors != lispenv->stats.majors) {      /* the atoms moved */
+    for (j = 0; j < r->symbol_num; ++j)
+      r->symbols[j].i = 0;
+    r->majors = lispenv->stats.majors;
+  }
+  if (pairs > r->pair_cap) {
+    r->pair_cap = pairs;
+    r->pairs = (L*)realloc(r->pairs, sizeof(L)*pairs);
+  }
+  if (values > r->hole_cap) {
+    r->hole_cap = values;
+    r->holes = (I*)realloc(r->holes, sizeof(I)*values);
+  }
+  r->holes[sp++] = HOLE_VALUE;
+  while (sp) {                                  /* fill the holes in prefix order */
+    h = r->holes[--sp];
+    c = b[k++];
+    if (c != ENC_NIL && c != ENC_NUMBER)
+      get_varint(b, end, &k, &n);
+    switch (c) {
+      case ENC_NIL:
+        x = lispenv->nil;
+        break;
+      case ENC_NUMBER:
+        memcpy(&x, b+k, sizeof(L));
+        k += sizeof(L);
+        break;
+      case ENC_INTEGER:
+        x = (L)((int64_t)(n >> 1) ^ -(int64_t)(n & 1));
+        break;
+      case ENC_STRING:
+        x = heap_string(STRING, b+k, n, lispenv);
+        k += n;
+        break;
+      case ENC_ATOM:
+        if (r->symbol_num == r->symbol_cap) {
+          r->symbol_cap = r->symbol_cap ? 2*r->symbol_cap : 16;
+          r->symbols = (Symbol*)realloc(r->symbols, sizeof(Symbol)*r->symbol_cap);
+        }
+        x = heap_string(ATOM, b+k, n, lispenv);
+        s = &r->symbols[r->symbol_num++];
+        s->at = k;
+        s->len = n;
+        s->i = ord(x);
+        k += n;
+        break;
+      case ENC_SYMBOL:
+        s = &r->symbols[n];
+        if (!s->i)
+          s->i = ord(heap_string(ATOM, b+s->at, s->len, lispenv));
+        x = box(ATOM, s->i);
+        break;
+      case ENC_PRIMITIVE:
+        x = box(PRIMITIVE, primitive(b+k, n));
+        k += n;
+        break;
+      case ENC_REF:
+        x = r->pairs[n];
+        break;
+      default:                                  /* ENC_LIST: make its n pairs, then fill their items and the tail */
+        for (i = 0; i < n; ++i) {
+          j = young ? lispenv->ysp -= 2 : lispenv->sp -= 2;
+          lispenv->cell[j] = lispenv->cell[j+1] = lispenv->nil;
+          if (i)
+            lispenv->cell[ord(r->pairs[ids+i-1])] = box(PAIR, j);
+          r->pairs[ids+i] = box(PAIR, j);
+        }
+        r->holes[sp++] = ord(r->pairs[ids+n-1]);
+        for (i = n; i--; )
+          r->holes[sp++] = ord(r->pairs[ids+i])+1;
+        x = r->pairs[ids];
+        ids += n;
+        lispenv->stats.alloc_bytes += 2*sizeof(L)*n;
+    }
+    if (h == HOLE_VALUE)
+      v = x;
+    else
+      lispenv->cell[h] = x;
+  }
+  r->k = end;
+  return v;
+}
+
+/* release the room of decoder r */
+void end_decoding(Decoder *r) {
+  free(r->symbols);
+  free(r->pairs);
+  free(r->holes);
+}
+
+/* return nonzero if the len bytes b are the encoding of one value */
+int encoded(const char *b, size_t len) {
+  Decoder r = {0};
+  I pairs, bytes, values;
+  return decoding(&r, b, len) && check(&r, &pairs, &bytes, &values) == len;
+}
+
+/* return the value encoded in the len bytes b on the heap of lispenv, throws error 8 if they are not the encoding of one
+   value */
+L unpack(const char *b, size_t len, LispEnv *lispenv) {
+  L x;
+  if (!decoding(&scratch_decoder, b, len))
+    return err(8);
+  x = decode(&scratch_decoder, lispenv);
+  return scratch_decoder.k == len ? x : err(8);
+}
+
+/* a value encoded in the len bytes b, as a message is sent between daemons */
+typedef struct Encoding{
+  char *b;
+  size_t len;
+}Encoding;
+
+/* return a new message with value x of lispenv encoded, see encode() */
+Encoding *message(L x, LispEnv *lispenv) {
+  Encoder *w = &scratch_encoder;
+  Encoding *msg = (Encoding*)malloc(sizeof(Encoding));
+  encoding(w);
+  encode(x, w, lispenv);
+  msg->b = (char*)malloc(w->len);
+  msg->len = w->len;
+  memcpy(msg->b, w->b, w->len);
+  return msg;
+}
+
+/* return a new message with the bytes of msg */
+Encoding *copy_message(Encoding *msg) {
+  Encoding *copy = (Encoding*)malloc(sizeof(Encoding));
+  copy->b = (char*)malloc(msg->len);
+  copy->len = msg->len;
+  memcpy(copy->b, msg->b, msg->len);
+  return copy;
+}
+
+void free_message(Encoding *msg) {
+  free(msg->b);
+  free(msg);
+}
+
+/* return the bytes of message msg to send it to another dollhouse, msg is freed and the bytes are the caller's. *len is
+   set to their number */
+char *pack_message(Encoding *msg, size_t *len) {
+  char *b = msg->b;
+  *len = msg->len;
+  free(msg);
+  return b;
+}
+
+/* return a message of the len bytes b that arrived from another dollhouse, or NULL if they are not one encoded value */
+Encoding *unpack_message(const char *b, size_t len) {
+  Encoding *msg;
+  if (!encoded(b, len))
+    return NULL;
+  msg = (Encoding*)malloc(sizeof(Encoding));
+  msg->b = (char*)malloc(len);
+  msg->len = len;
+  memcpy(msg->b, b, len);
+  return msg;
+}
+
+/*----------------------------------------------------------------------------*\
+ |      IMAGES                                                                |
+\*----------------------------------------------------------------------------*/
+
+/* a heap image is a snapshot of an environment, its atoms, cells, global variables and compiled code, so that daemons start
+   with what a script defined without running it again. the values of an environment are relative to its heap, so the parts
+   are saved as they are after a full collection and copied back to the heap of a new environment as they are: an Image
+   header, the hp bytes of the atoms padded to a cell, the N-sp cells at the top of the heap, the atom index, the globals,
+   the code and the constants. an image has no roots but its globals, constants and global environment, and it has no
+   slices and no file operations that wait */
+#define IMAGE_MAGIC 0x474d4844                  /* "DHMG" */
+#define IMAGE_VERSION 1
+
+typedef struct Image{
+  uint32_t magic, version;
+  uint64_t primitives;                          /* primitives_key() of the primitives, a PRIMITIVE is their index */
+  uint32_t cell_size;                           /* sizeof(L) */
+  unsigned int N, atom_cap, atom_num, global_num, code_num, const_num;
+  I hp, sp;
+  L tru, env;
+  uint64_t atoms_at, cells_at, index_at, globals_at, code_at, consts_at, size;  /* the offsets of the parts, the size */
+}Image;
+
+/* a heap image that was read once and is shared by the daemons that start from it, keyed by its path, modification time
+   and size. it is a copy, an image that is saved again while daemons start from it does not change under them */
+typedef struct ImageFile{
+	char path[DH_FILENAME_LEN];
+	struct timespec mtime;
+	off_t size;
+	char *b;
+	struct ImageFile *next;
+}ImageFile;
+
+/* the heap images that were read */
+ImageFile *images = NULL;
+
+/* return a hash of the names of the primitives, images of a dollhouse with other primitives do not load */
+uint64_t primitives_key() {
+  uint64_t h = 0xcbf29ce484222325;
+  int i;
+  const char *s;
+  for (i = 0; primitives[i].s; ++i)
+    for (s = primitives[i].s; ; ++s) {
+      h = (h ^ (unsigned char)*s) * 0x100000001b3;
+      if (!*s)
+        break;
+    }
+  return h;
+}
+
+/* lay out the parts of image h after its header */
+void image_layout(Image *h) {
+  h->atoms_at = sizeof(Image);
+  h->cells_at = h->atoms_at+((h->hp+sizeof(L)-1) & ~(I)(sizeof(L)-1));
+  h->index_at = h->cells_at+sizeof(L)*(h->N-h->sp);
+  h->globals_at = h->index_at+sizeof(AtomSlot)*h->atom_cap;
+  h->code_at = h->globals_at+sizeof(L)*h->global_num;
+  h->consts_at = h->code_at+sizeof(uint32_t)*h->code_num;
+  h->size = h->consts_at+sizeof(L)*h->const_num;
+}
+
+/* save the environment of the daemon that runs as heap image <filename>, after a full collection, returns 0, or -1 if the
+   image cannot be written. the cells that the running code still holds are saved with the others */
+int SaveLispImage(const char *filename, LispEnv *lispenv) {
+  Image h;
+  Buffer buf;
+  int r;
+  full(lispenv->nil, 0, lispenv);               /* the live cells are compacted to the top of cell[], the nursery is empty */
+  memset(&h, 0, sizeof(Image));
+  h.magic = IMAGE_MAGIC;
+  h.version = IMAGE_VERSION;
+  h.primitives = primitives_key();
+  h.cell_size = sizeof(L);
+  h.N = lispenv->N;
+  h.atom_cap = lispenv->atom_cap;
+  h.atom_num = lispenv->atom_num;
+  h.global_num = lispenv->global_num;
+  h.code_num = lispenv->code_num;
+  h.const_num = lispenv->const_num;
+  h.hp = lispenv->hp;
+  h.sp = lispenv->sp;
+  h.tru = lispenv->tru;
+  h.env = lispenv->env;
+  image_layout(&h);
+  buf.size = h.size;
+  if (!(buf.data = (char*)calloc(1, buf.size)))
+    return -1;
+  memcpy(buf.data, &h, sizeof(Image));
+  memcpy(buf.data+h.atoms_at, lispenv->cell, h.hp);
+  memcpy(buf.data+h.cells_at, lispenv->cell+h.sp, sizeof(L)*(h.N-h.sp));
+  memcpy(buf.data+h.index_at, lispenv->atoms, sizeof(AtomSlot)*h.atom_cap);
+  memcpy(buf.data+h.globals_at, lispenv->globals, sizeof(L)*h.global_num);
+  memcpy(buf.data+h.code_at, lispenv->code, sizeof(uint32_t)*h.code_num);
+  memcpy(buf.data+h.consts_at, lispenv->consts, sizeof(L)*h.const_num);
+  r = DH_write(filename, buf);
+  free(buf.data);
+  return r;
+}
+
+/* return 1 if the n bytes b are a heap image that this dollhouse can load, with its header in *h */
+int image_valid(const char *b, size_t n, Image *h) {
+  Image k;
+  if (n < sizeof(Image))
+    return 0;
+  memcpy(h, b, sizeof(Image));
+  memcpy(&k, b, sizeof(Image));                 /* the offsets of a valid image are laid out as image_layout() does */
+  image_layout(&k);
+  return h->magic == IMAGE_MAGIC && h->version == IMAGE_VERSION && h->primitives == primitives_key() &&
+         h->cell_size == sizeof(L) && h->N >= 64 && h->sp <= h->N && h->hp <= sizeof(L)*h->sp && h->atom_cap &&
+         !(h->atom_cap & (h->atom_cap-1)) && h->atom_num <= h->atom_cap && !memcmp(&k, h, sizeof(Image)) && h->size == n;
+}
+
+/* return the heap image at path, read unless an image with the same path, modification time and size was read before, or
+   return NULL if it cannot be read or is not a valid image */
+ImageFile *image_file(const char *path) {
+  struct stat st;
+  ImageFile *f, **p;
+  Buffer b;
+  Image h;
+  if (stat(path, &st))
+    return NULL;
+  for (p = &images; *p && strncmp((*p)->path, path, DH_FILENAME_LEN); p = &(*p)->next)
+    continue;
+  f = *p;
+  if (f && f->size == st.st_size && f->mtime.tv_sec == st.st_mtim.tv_sec && f->mtime.tv_nsec == st.st_mtim.tv_nsec)
+    return f;
+  if (f) {                                      /* the image at path has changed */
+    *p = f->next;
+    free(f->b);
+    free(f);
+  }
+  b = DH_read(path);
+  if (!b.data)
+    return NULL;
+  if (!image_valid(b.data, b.size, &h)) {
+    DH_release(b);
+    return NULL;
+  }
+  f = (ImageFile*)calloc(1, sizeof(ImageFile));
+  strncpy(f->path, path, DH_FILENAME_LEN-1);
+  f->path[DH_FILENAME_LEN-1] = 0;
+  f->mtime = st.st_mtim;
+  f->size = b.size;
+  f->b = (char*)malloc(b.size);
+  memcpy(f->b, b.data, b.size);
+  DH_release(b);
+  f->next = images;
+  images = f;
+  return f;
+}
+
+/* return a new environment of daemon with the heap image <filename>, or NULL if it cannot be loaded. the roots tru and env
+   are registered by the caller, as they are for a new environment */
+LispEnv *LoadLispImage(const char *filename, Daemon *daemon) {
+  ImageFile *f = image_file(filename);
+  Image h;
+  LispEnv *lispenv;
+  if (!f)
+    return NULL;
+  memcpy(&h, f->b, sizeof(Image));
+  lispenv = NewLispEnvironment(h.N, daemon);
+  memcpy(lispenv->cell, f->b+h.atoms_at, h.hp);
+  memcpy(lispenv->cell+h.sp, f->b+h.cells_at, sizeof(L)*(h.N-h.sp));
+  lispenv->hp = h.hp;
+  lispenv->sp = h.sp;
+  if (h.atom_cap > lispenv->atom_cap) {
+    lispenv->atom_cap = h.atom_cap;
+    lispenv->atoms = (AtomSlot*)realloc(lispenv->atoms, sizeof(AtomSlot)*h.atom_cap);
+  }
+  memcpy(lispenv->atoms, f->b+h.index_at, sizeof(AtomSlot)*h.atom_cap);
+  lispenv->atom_num = h.atom_num;
+  while (lispenv->global_cap < h.global_num)
+    lispenv->global_cap *= 2;
+  while (lispenv->code_cap < h.code_num)
+    lispenv->code_cap *= 2;
+  while (lispenv->const_cap < h.const_num)
+    lispenv->const_cap *= 2;
+  lispenv->globals = (L*)realloc(lispenv->globals, sizeof(L)*lispenv->global_cap);
+  lispenv->code = (uint32_t*)realloc(lispenv->code, sizeof(uint32_t)*lispenv->code_cap);
+  lispenv->consts = (L*)realloc(lispenv->consts, sizeof(L)*lispenv->const_cap);
+  memcpy(lispenv->globals, f->b+h.globals_at, sizeof(L)*h.global_num);
+  memcpy(lispenv->code, f->b+h.code_at, sizeof(uint32_t)*h.code_num);
+  memcpy(lispenv->consts, f->b+h.consts_at, sizeof(L)*h.const_num);
+  lispenv->global_num = h.global_num;
+  lispenv->code_num = h.code_num;
+  lispenv->const_num = h.const_num;
+  lispenv->nil = box(NIL, 0);
+  lispenv->tru = h.tru;
+  lispenv->env = h.env;
+  return lispenv;
+}
+
+/*----------------------------------------------------------------------------*\
+ |      PROGRAMS                                                              |
+\*----------------------------------------------------------------------------*/
+
+/* a script parsed once and shared by all daemons that run it, keyed by its path, size and modification time and by the
+   size and a hash of its contents. the list of its top-level forms is flattened in prefix order to cells that do not depend on a heap: a
+   number, (), an ATOM or STRING with the offset of its name in names[], or a PAIR with the number n of items of a list,
+   followed by the n items and the tail of the list */
+typedef struct Script{
+	char path[DH_FILENAME_LEN];
+	struct timespec mtime;
+	size_t size;
+	I hash;
+	L *cells;
+	unsigned int cell_num, cell_cap;
+	char *names;
+	unsigned int name_len, name_cap;
+	struct Script *next;
+}Script;
+
+/* the parsed scripts */
+Script *scripts = NULL;
+
+/* append cell x to script s, returns its index */
+unsigned int cell(Script *s, L x) {
+  if (s->cell_num == s->cell_cap) {
+    s->cell_cap = s->cell_cap ? 2*s->cell_cap : 256;
+    s->cells = (L*)realloc(s->cells, sizeof(L)*s->cell_cap);
+  }
+  s->cells[s->cell_num] = x;
+  return s->cell_num++;
+}
+
+/* append the flattened expression x to script s */
+void flatten(L x, Script *s, LispEnv *lispenv) {
+  unsigned int n, k;
+  if ((T(x) & ~(ATOM^STRING)) == ATOM) {        /* an ATOM or STRING cell has the offset of its name */
+    n = strlen(A(lispenv)+ord(x))+1;
+    if (s->name_len+n > s->name_cap) {
+      s->name_cap = 2*(s->name_len+n);
+      s->names = (char*)realloc(s->names, s->name_cap);
+    }
+    memcpy(s->names+s->name_len, A(lispenv)+ord(x), n);
+    cell(s, box(T(x), s->name_len));
+    s->name_len += n;
+  }
+  else if (T(x) == PAIR) {                      /* a PAIR cell has the number of items of the list */
+    k = cell(s, x);
+    for (n = 0; T(x) == PAIR; x = NEXT(x, lispenv), ++n)
+      flatten(FIRST(x, lispenv), s, lispenv);
+    s->cells[k] = box(PAIR, n);
+    flatten(x, s, lispenv);
+  }
+  else                                          /* closures, macros and frames belong to their environment, they flatten as () */
+    cell(s, x == x || T(x) == PRIMITIVE || T(x) == NIL ? x : lispenv->nil);
+}
+
+/* return the expression flattened at cell *k of script s on the heap, advances *k past the expression */
+L unflatten(Script *s, unsigned int *k, LispEnv *lispenv) {
+  L x = s->cells[(*k)++], t = lispenv->nil, p = lispenv->nil;
+  I n;
+  if (T(x) == ATOM)
+    return atom(s->names+ord(x), lispenv);
+  if (T(x) == STRING)
+    return string(s->names+ord(x), lispenv);
+  if (T(x) != PAIR)
+    return x;
+  var(2, lispenv, &t, &p);
+  for (n = ord(x); n--; ) {
+    x = pair(unflatten(s, k, lispenv), lispenv->nil, lispenv);
+    p = set(T(p) == PAIR ? &NEXT(p, lispenv) : &t, x, lispenv);
+  }
+  x = unflatten(s, k, lispenv);
+  set(T(p) == PAIR ? &NEXT(p, lispenv) : &t, x, lispenv);
+  return return_value(2, t, lispenv);
+}
+
+/* flatten the top-level forms that the reader of lispenv reads into script s */
+void parse_forms(Script *s, LispEnv *lispenv) {
+  unsigned int n = 0, header;
+  L x;
+  s->cell_num = s->name_len = 0;
+  header = cell(s, lispenv->nil);               /* the list of forms, its number of items is known at the end */
+  for (skip(lispenv); lispenv->see; skip(lispenv), ++n) {
+    x = readlisp(lispenv);
+    flatten(x, s, lispenv);
+  }
+  s->cells[header] = n ? box(PAIR, n) : lispenv->nil;
+  if (n)
+    cell(s, lispenv->nil);
+}
+
+/* parse the top-level forms of the text in buffer b into script s, using the reader of lispenv, returns zero if the text
+   has a syntax error. the reader throws, the caller of a script may have no handler of its own */
+int parse_script(Script *s, Buffer b, LispEnv *lispenv) {
+  uint8_t i = lispenv->prog_stack_idx;
+  Buffer saved = lispenv->program_stack[i];
+  unsigned int k = lispenv->prog_idx_stack[i];
+  struct State saved_state = state;
+  int vars = lispenv->var_num, ok = 1;
+  lispenv->program_stack[i] = b;
+  lispenv->prog_idx_stack[i] = 0;
+  lispenv->see = '\n';
+  if (!setjmp(state.jb))
+    parse_forms(s, lispenv);
+  else {
+    unwind(lispenv->var_num-vars, lispenv);     /* the root variables of the lists the reader was in */
+    ok = 0;
+  }
+  state = saved_state;
+  lispenv->program_stack[i] = saved;
+  lispenv->prog_idx_stack[i] = k;
+  lispenv->see = '\n';
+  return ok;
+}
+
+/* return the parsed script at path, parsed with the reader of lispenv unless a script with the same path, size and
+   modification time or with the same size and hash of its contents was parsed before, or return NULL if it cannot be read
+   or parsed */
+Script *script(const char *path, LispEnv *lispenv) {
+  struct stat st;
+  Script *s, **p;
+  Buffer b;
+  I h;
+  if (stat(path, &st))
+    return NULL;
+  for (s = scripts; s; s = s->next)
+    if (s->size == (size_t)st.st_size && s->mtime.tv_sec == st.st_mtim.tv_sec && s->mtime.tv_nsec == st.st_mtim.tv_nsec &&
+        !strncmp(s->path, path, DH_FILENAME_LEN))
+      return s;
+  b = DH_read(path);                            /* the text is followed by a 0 */
+  if (!b.data)
+    return NULL;
+  h = hash(b.data);
+  for (s = scripts; s && (s->hash != h || s->size != b.size); s = s->next)
+    continue;
+  if (!s) {
+    for (s = scripts; s && strncmp(s->path, path, DH_FILENAME_LEN); s = s->next)
+      continue;
+    if (!s) {                                   /* a new script, or else the script at path has changed */
+      s = (Script*)calloc(1, sizeof(Script));
+      s->next = scripts;
+      scripts = s;
+    }
+    s->hash = 0;                                /* not a valid script until it is parsed */
+    if (!parse_script(s, b, lispenv)) {         /* a script with a syntax error is forgotten, it is parsed again when read */
+      for (p = &scripts; *p != s; p = &(*p)->next)
+        continue;
+      *p = s->next;
+      free(s->cells);
+      free(s->names);
+      free(s);
+      DH_release(b);
+      return NULL;
+    }
+    s->hash = h;
+    s->size = b.size;
+  }
+  if (!strncmp(s->path, path, DH_FILENAME_LEN) || !s->path[0])
+    s->mtime = st.st_mtim;
+  if (!s->path[0])
+    strncpy(s->path, path, DH_FILENAME_LEN-1);  /* calloc'd, the path stays terminated */
+  DH_release(b);
+  return s;
+}
+
+/* load the program of lispenv from the script at path, returns zero if it cannot be read or parsed */
+int load(const char *path, LispEnv *lispenv) {
+  Script *s = script(path, lispenv);
+  unsigned int k = 0;
+  if (!s)
+    return 0;
+  lispenv->program = unflatten(s, &k, lispenv);
+  lispenv->cursor = lispenv->program;
+  return 1;
+}
+
+/* evaluate the top-level form of the program at the cursor and advance the cursor, returns zero at the end of the program */
+int run_form(LispEnv *lispenv) {
+  L x;
+  if (T(lispenv->cursor) != PAIR)
+    return 0;
+  x = FIRST(lispenv->cursor, lispenv);
+  lispenv->cursor = NEXT(lispenv->cursor, lispenv);
+  exec(x, &lispenv->env, lispenv);
+  return 1;
+}
+
+/* call closure f with value y: evaluate (f (quote y)) in to, as the virtual machine applies a special form. returns the
+   value of the call */
+L call(L f, L y, LispEnv *to) {
+  unsigned int k;
+  L x = pair(f, y, to);                         /* var() moves only the first of the variables it registers, f and y */
+  var(1, to, &x);                               /*   are registered as one pair */
+  for (k = 0; primitives[k].f != f_quote; ++k)
+    continue;
+  y = pair(NEXT(x, to), to->nil, to);
+  y = pair(box(PRIMITIVE, k), y, to);
+  y = pair(y, to->nil, to);
+  y = pair(FIRST(x, to), y, to);
+  return return_value(1, eval(y, &to->env, to), to);
+}
+
+/* deliver the n messages msgs to the closure of interface <name> of environment to, in one call. the closure is called
+   with the value of msgs[0] made in the heap of to or, when list is nonzero, with the list of the values of all n. returns
+   the value of the call, or () when to has no input interface <name> */
+L deliver(const char *name, Encoding **msgs, int n, int list, LispEnv *to) {
+  L f = to->nil, y = to->nil, x = to->nil;
+  unsigned int k;
+  for (k = 0; k < to->handler_num && strcmp(to->handlers[k].name, name); ++k)
+    continue;
+  if (k == to->handler_num)
+    return to->nil;
+  f = to->handlers[k].f;
+  var(3, to, &f, &y, &x);
+  if (!list)
+    y = unpack(msgs[0]->b, msgs[0]->len, to);
+  else
+    while (n--) {                               /* make the list from its end */
+      x = unpack(msgs[n]->b, msgs[n]->len, to);
+      y = pair(x, y, to);
+    }
+  return return_value(3, call(f, y, to), to);
+}
+
+/* call the closure that waits for file operation req with its result: the contents of the file that was read, #t if the
+   file was written, or () if the operation failed. returns the value of the call */
+L complete(IORequest *req, LispEnv *to) {
+  L f = to->waits[req->slot], y = to->nil;
+  var(2, to, &f, &y);
+  to->waits[req->slot] = to->nil;
+  if (req->result == 0)
+    y = req->op != IO_READ ? to->tru : req->buf.size > 0 ? dup_n(ATOM, req->buf.data, req->buf.size, to) : to->nil;
+  return return_value(2, T(f) == CLOSURE ? call(f, y, to) : to->nil, to);
+}
+
+
+
 
 
 
@@ -1329,11 +3811,23 @@ struct {
 /* evaluate x in environment e, returns value of x, tail-call optimized */
 L step(L x, P e, LispEnv *lispenv) {
   L f = lispenv->nil, v = lispenv->nil, d = lispenv->nil, z = lispenv->nil;
+  switch (T(x)) {                               /* variables and constants do not need the roots registered below */
+    case ATOM:   return assoc(x, *e, lispenv);
+    case LOCAL:  return *local(x, *e, lispenv);
+    case GLOBAL: return value(x, lispenv);
+    case PAIR:   break;
+    default:     return x;
+  }
   var(5, lispenv, &x, &f, &v, &d, &z);
   while (1) {
+    lispenv->stats.steps++;
 	//printf("prog_index: %i\n", lispenv->prog_idx);
     if (T(x) == ATOM)
       return return_value(5, assoc(x, *e, lispenv), lispenv);
+    if (T(x) == LOCAL)
+      return return_value(5, *local(x, *e, lispenv), lispenv);
+    if (T(x) == GLOBAL)
+      return return_value(5, value(x, lispenv), lispenv);
     if (T(x) != PAIR)
       return return_value(5, x, lispenv);
 
@@ -1345,23 +3839,27 @@ L step(L x, P e, LispEnv *lispenv) {
     //debugHeapPrintType(ord(x),1, lispenv);
 
     if (T(f) == PRIMITIVE) {
-      x = primitives[ord(f)].f(&x, e, lispenv);
+      x = primitives[ord(f)].f ? primitives[ord(f)].f(&x, e, lispenv) : apply(primitives[ord(f)].fn, &x, e, lispenv);
       if (!primitives[ord(f)].t)
         return return_value(5, x, lispenv);
     }
     else if (T(f) == CLOSURE) {
+      I k = 1;
+      L y;
       v = first(first(f, lispenv), lispenv);
       d = next(f, lispenv);
       if (T(d) == NIL)
         d = lispenv->env;
-      for (; T(v) == PAIR && T(x) == PAIR; v = next(v, lispenv), x = next(x, lispenv)) {
-        L y = eval(first(x, lispenv), e, lispenv);
-        d = env_pair(first(v, lispenv), y, &d, lispenv);
+      y = frame(&v, lispenv);                            /* the arguments are bound in a frame in front of the closure env */
+      d = pair(y, d, lispenv);
+      for (; T(v) == PAIR && T(x) == PAIR; v = next(v, lispenv), x = next(x, lispenv), ++k) {
+        y = eval(first(x, lispenv), e, lispenv);
+        set(&SLOT(FIRST(d, lispenv), k, lispenv), y, lispenv);
       }
       if (T(v) == PAIR) {
         x = eval(x, e, lispenv);
-        for (; T(v) == PAIR && T(x) == PAIR; v = next(v, lispenv), x = next(x, lispenv))
-          d = env_pair(first(v, lispenv), first(x, lispenv), &d, lispenv);
+        for (; T(v) == PAIR && T(x) == PAIR; v = next(v, lispenv), x = next(x, lispenv), ++k)
+          set(&SLOT(FIRST(d, lispenv), k, lispenv), FIRST(x, lispenv), lispenv);
         if (T(v) == PAIR)
           return return_value(5, err(5), lispenv);
       }
@@ -1370,8 +3868,10 @@ L step(L x, P e, LispEnv *lispenv) {
       else if (T(x) != NIL)
         x = eval(x, e, lispenv);
       if (T(v) != NIL)
-        d = env_pair(v, x, &d, lispenv);
+        set(&SLOT(FIRST(d, lispenv), k, lispenv), x, lispenv);
       x = next(first(f, lispenv), lispenv);
+      if (T(x) == CODE)                         /* the body of a closure made by compiled code is compiled code */
+        return return_value(5, run(ord(x), &d, lispenv), lispenv);
       e = &d;
     }
     else if (T(f) == MACRO) {
@@ -1393,23 +3893,23 @@ L step(L x, P e, LispEnv *lispenv) {
 /* trace the evaluation of x in environment e, returns its value */
 L eval(L x, P e, LispEnv *lispenv) {
   L y;
-  if (!lispenv->tr)
+  if (!TRACING(1, TRACE_STEPS, lispenv))
     return step(x, e, lispenv);
   var(1, lispenv, &x);                                   /* register var x to display later again */
   y = step(x, e, lispenv);
-
-  //if(lispenv->tr>1) printf("X: %i str: %s\n",ord(x), A(lispenv)+ord(x));
-  //if(lispenv->tr>1) printf("Y: %i str: %s\n",ord(y), A(lispenv)+ord(y));
-  printf("\e[32m%4d: \e[33m", state.n); print(x, lispenv);       /* <vars>: unevaluated expression */
-  printf("\e[36m => \e[33m");           print(y, lispenv);       /* => value of the expression */
-  //debugHeapPrint(ord(y)-20,40, lispenv);
-
-  printf("\e[m\t");
-  if (lispenv->tr > 1)                                   /* wait for ENTER key or other CTRL */
+  FILE *saved = out;
+  flockfile(stderr);                            /* a step and its key are not mixed with the steps of other workers */
+  out = stderr;                                 /* the trace goes to stderr with the other traces, print() writes to out */
+  TRACE(1, TRACE_STEPS, lispenv, "\e[32m%4d: \e[33m", lispenv->var_num); print(x, lispenv);  /* <vars>: unevaluated expression */
+  TRACE(1, TRACE_STEPS, lispenv, "\e[36m => \e[33m");           print(y, lispenv);  /* => value of the expression */
+  TRACE(1, TRACE_STEPS, lispenv, "\e[m\t");
+  if ((lispenv->tr & TRACE_STEPS) > 1)                  /* wait for ENTER key or other CTRL */
     while (getchar() >= ' ')
       continue;
   else
-    putchar('\n');
+    TRACE(1, TRACE_STEPS, lispenv, "\n");
+  out = saved;
+  funlockfile(stderr);
   return return_value(1, y, lispenv);
 }
 
@@ -1436,6 +3936,26 @@ void printlist(L t, LispEnv *lispenv) {
 
 
 
+/* output the variables and values of FRAME f */
+void printframe(L f, LispEnv *lispenv) {
+  L s = SLOT(f, 0, lispenv);
+  I k = 1;
+  fprintf(out, "#[");
+  for (; T(s) == PAIR; s = NEXT(s, lispenv), ++k) {
+    if (k > 1)
+      putc(' ', out);
+    fprintf(out, "(%s . ", A(lispenv)+ord(FIRST(s, lispenv)));
+    print(SLOT(f, k, lispenv), lispenv);
+    putc(')', out);
+  }
+  if (T(s) != NIL) {
+    fprintf(out, k > 1 ? " (%s . " : "(%s . ", A(lispenv)+ord(s));
+    print(SLOT(f, k, lispenv), lispenv);
+    putc(')', out);
+  }
+  putc(']', out);
+}
+
 /* output Lisp expression x */
 void print(L x, LispEnv *lispenv) {
   switch (T(x)) {
@@ -1445,7 +3965,12 @@ void print(L x, LispEnv *lispenv) {
     case STRING:  fprintf(out, "\"%s\"", A(lispenv)+ord(x));     	break;
     case PAIR: 	  printlist(x, lispenv);                         	break;
     case CLOSURE: fprintf(out, "{%lu}", ord(x));       	break;
+    case SLICE:   fprintf(out, "<slice %lu>", ord(x) & ((1 << SLICE_BITS)-1));  	break;
     case MACRO:   fprintf(out, "[%lu]", ord(x));       	break;
+    case FRAME:   printframe(x, lispenv);                  	break;
+    case GLOBAL:  print(name(x, lispenv->nil, lispenv), lispenv);	break;
+    case LOCAL:   fprintf(out, "@%lu.%lu", ord(x) >> SLOT_BITS, ord(x) & ((1 << SLOT_BITS)-1));	break;
+    case CODE:    fprintf(out, "<code %lu>", ord(x));   	break;
     default:   	  fprintf(out, FLOAT, x);               	break;
   }
 }
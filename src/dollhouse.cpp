@@ -26,9 +26,17 @@
 
 #include "dollhouse.hpp"
 #include "dollhousefile.hpp"
+#include "dollhousenet.hpp"
 #include <string.h>
 #include <stdlib.h>
 //#include <stdio.h>
+#include <time.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <signal.h>
+#include <dirent.h>
 
 #include "DH_lisp.hpp"
 
@@ -57,29 +65,104 @@
 
 #define HEAP_REALLOC_SIZE 10
 
-LISP::LispEnv *lispDaemons;
-uint8_t* lispDaemonUsage;
-uint32_t lispDaemonNum=0;
-
-Daemon* activeDaemonList;
-uint8_t* activeDaemonListUsage;
-uint32_t activeDaemonListLen=0;
-
-DaemonInfo* daemonInfoList;
-uint8_t* daemonInfoListUsage;
-uint32_t daemonInfoListLen=0;
-
-
+// the daemons, their lisp environments and their registry entries, which never move while the slabs grow.
+Slab lispEnvSlab = {sizeof(LISP::LispEnv)};
+Slab daemonSlab = {sizeof(Daemon)};
+Slab daemonInfoSlab = {sizeof(DaemonInfo)};
+
+// the index of the interfaces of the registry entries, a hash table of registryBuckets chains.
+RegistryEntry **registryIndex;
+uint32_t registryBuckets=0, registryEntries=0;
+
+// guards the slabs, the registry index and the script cache of the interpreter, which startDaemon can change on any worker.
+pthread_mutex_t daemonLock = PTHREAD_MUTEX_INITIALIZER;
+
+// serializes appending interlinks to the daemons, which is done on any worker and on the main thread. a daemon reads its
+// interlinks without it, see daemonInterlinks().
+pthread_mutex_t linkLock = PTHREAD_MUTEX_INITIALIZER;
+
+// the interlinks to and from daemons in other dollhouses, which the main thread serves. remoteLock guards the list.
+Interlink **remoteLinks;
+uint32_t remoteLinkNum=0;
+pthread_mutex_t remoteLock = PTHREAD_MUTEX_INITIALIZER;
+
+// the input interfaces that daemons of other dollhouses offered, see receiveOffer(). daemonLock guards them.
+typedef struct RemoteOffer{
+	Handle peer;
+	char remoteID[DH_ID_LEN];
+	char name[DH_INTERFACE_NAME_LEN], type[DH_TYPE_LEN], format[DH_FORMAT_LEN];
+}RemoteOffer;
+RemoteOffer *remoteOffers;
+uint32_t remoteOfferNum=0;
+uint32_t daemonCount=0; // the daemons this dollhouse started, see startDaemon()
+
+// the daemons are run by workerNum worker threads. each worker has a deque of ready daemons that it runs from the front,
+// an idle worker steals from the back of the deque of another. readyCount counts the daemons in all deques.
+typedef struct ReadyDeque{
+	pthread_mutex_t lock;
+	Daemon **ring;
+	uint32_t head, len, cap;
+}ReadyDeque;
+
+ReadyDeque *readyDeques;
+int workerNum=0;
+sem_t readyCount;
+uint32_t nextDeque=0;			// the deque of the next daemon that is woken by the main thread, round robin
+thread_local int workerIdx=-1;	// the index of the worker thread, -1 on the main thread
+
+// the daemons whose locks a thread holds, innermost first. a daemon's messages are received on any thread that holds its
+// lock, see receiveWaiting().
+typedef struct Holding{
+	Daemon *daemon;
+	struct Holding *next;
+}Holding;
+thread_local Holding *holding=nullptr;
+
+// a sender that waits for room on a full interlink sleeps on roomMoved until roomSeq changes, see sendInterlink().
+pthread_mutex_t roomLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t roomMoved = PTHREAD_COND_INITIALIZER;
+uint64_t roomSeq=0;
+
+// the main thread wakes the sleeping daemons, it blocks in epoll_wait until the next one is due or it is notified.
+int schedulerEpoll=-1, schedulerEvent=-1;
+
+// how long the main thread took to wake the daemons and flush the files in each cycle(), and whether SIGUSR1 asked to dump
+// the statistics.
+Histogram cycles;
+volatile sig_atomic_t statsRequested=0;
+
+void *worker(void*);
+void signalRoom();
+void requestStats(int);
+int receiveRemote(Peer*, Reassembly*);
+void offerInterfaces(Peer*);
 
 void bootstrap(){
-	lispDaemons = (LISP::LispEnv*)malloc(sizeof(LISP::LispEnv));
-	lispDaemonUsage =(uint8_t*) malloc(sizeof(uint8_t));
-
-	activeDaemonList = (Daemon*) malloc(sizeof(Daemon));
-	activeDaemonListUsage= (uint8_t*) malloc(sizeof(uint8_t));
-
-	daemonInfoList = (DaemonInfo*) malloc(sizeof(DaemonInfo));
-	daemonInfoListUsage = (uint8_t*) malloc(sizeof(uint8_t));
+	// the eventfd wakes the scheduler from epoll_wait when a daemon is woken outside of it.
+	schedulerEpoll = epoll_create1(0);
+	schedulerEvent = eventfd(0, EFD_NONBLOCK);
+	struct epoll_event ev = {0};
+	ev.events = EPOLLIN;
+	ev.data.u64 = 0; // the events of peers carry their handle, which is never 0
+	epoll_ctl(schedulerEpoll, EPOLL_CTL_ADD, schedulerEvent, &ev);
+	peerReceive = receiveRemote;
+	peerConnected = offerInterfaces;
+
+	// one worker per core unless DH_WORKERS says otherwise.
+	const char *workers = getenv("DH_WORKERS");
+	workerNum = workers ? atoi(workers) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if(workerNum < 1) workerNum = 1;
+	if(workerNum > DH_WORKERS_MAX) workerNum = DH_WORKERS_MAX;
+	readyDeques = (ReadyDeque*)calloc(sizeof(ReadyDeque), workerNum);
+	sem_init(&readyCount, 0, 0);
+	for(int i=0; i<workerNum; i++){
+		pthread_t thread;
+		pthread_mutex_init(&readyDeques[i].lock, nullptr);
+		pthread_create(&thread, nullptr, worker, (void*)(intptr_t)i);
+		pthread_detach(thread);
+	}
+	atexit(DH_sync_files); // write what the file handles buffered
+	signal(SIGUSR1, requestStats);
 }
 
 
@@ -91,102 +174,130 @@ void bootstrap(){
 
 
 
+// find the registry entry of the daemon that runs script <filename>, NULL if there is none.
+DaemonInfo *findDaemonInfo(const char *filename){
+	size_t len = strlen(filename);
+	for(uint32_t i=0; i<daemonInfoSlab.len; i++){
+		DaemonInfo *info = (DaemonInfo*)slabAt(&daemonInfoSlab, i);
+		if(!info) continue;
+		size_t n = strnlen(info->scriptname, DH_DAEMON_NAME_LEN);
+		if(n>0 && n<=len && strncmp(filename+len-n, info->scriptname, n)==0)
+			return info;
+	}
+	return nullptr;
+}
+
 int startDaemon(const char* filename, const char* language){
 
+	if(strcmp("lisp", language)!=0) return 0;
 
+	pthread_mutex_lock(&daemonLock); // daemons can start daemons on any worker
 	Daemon *newDaemon = (Daemon*)allocateDaemonHeap();
+	pthread_mutex_init(&newDaemon->lock, nullptr);
 
 
 	strncpy(newDaemon->language, language, DH_LANG_LEN);
 	strncpy(newDaemon->name, filename, DH_DAEMON_NAME_LEN);
+	// no daemon of another dollhouse on this machine has its daemonID: the pid in the high 24 bits, a count in the low 24
+	uint64_t id = (uint64_t)(getpid() & 0xffffff)<<24 | (++daemonCount & 0xffffff);
+	memcpy(newDaemon->daemonID, &id, DH_ID_LEN);
 
 
-	if(strcmp("lisp", language)==0){
+	{
 
 
 
-		// create lispenv
+		// create lispenv, its heap grows and shrinks within the limits of the daemon's registry entry. it is new,
+		// or from the heap image of its registry entry, which has the environment that another daemon's script made
+		DaemonInfo *info = findDaemonInfo(filename);
+		newDaemon->info = info;
 		LISP::LispEnv *lispenv = (LISP::LispEnv*) allocateLispEnvHeap();
-		memcpy(lispenv, LISP::NewLispEnvironment(1<<12, newDaemon), sizeof(LISP::LispEnv));
+		LISP::LispEnv *image = info && info->image[0] ? LISP::LoadLispImage(info->image, newDaemon) : nullptr;
+		LISP::LispEnv *made = image ? image : LISP::NewLispEnvironment(info ? info->heap_min : DH_HEAP_MIN, newDaemon);
+		memcpy(lispenv, made, sizeof(LISP::LispEnv)); // the environment stays in its slab, the struct it was made in is freed
+		free(made);
+		if(image && info->heap_min < lispenv->N_min) lispenv->N_min = info->heap_min;
+		lispenv->N_max = info ? info->heap_max : DH_HEAP_MAX;
+		if(lispenv->N_max < lispenv->N) lispenv->N_max = lispenv->N;
 		newDaemon->environment = lispenv;
 
-		// set up lispenv
+		// set up lispenv, an image has its #t, primitives and global environment already
 		int i;
 		lispenv->vars = lispenv->nil = LISP::box(LISP::NIL, 0);
-		lispenv->tru = LISP::atom("#t", lispenv);
+		if(!image) lispenv->tru = LISP::atom("#t", lispenv);
 		var(1, lispenv, &lispenv->tru);                                 						// make tru a root var
-		lispenv->env = LISP::env_pair(lispenv->tru, lispenv->tru, &lispenv->nil, lispenv);            // create environment with symbolic constant #t
+		if(!image) lispenv->env = lispenv->nil;
 		var(1, lispenv, &lispenv->env);                                 						// make env a root var
-		for (i = 0; LISP::primitives[i].s; ++i)                   									// expand environment with primitives
-		  lispenv->env = LISP::env_pair(LISP::atom(LISP::primitives[i].s, lispenv), LISP::box(LISP::PRIMITIVE, i), &lispenv->env, lispenv);
+		if(!image){
+			LISP::bind(LISP::global(lispenv->tru, lispenv), lispenv->tru, lispenv);            	// create environment with symbolic constant #t
+			for (i = 0; LISP::primitives[i].s; ++i)                   								// expand environment with primitives
+			  LISP::bind(LISP::global(LISP::atom(LISP::primitives[i].s, lispenv), lispenv), LISP::box(LISP::PRIMITIVE, i), lispenv);
+		}
 
 
-		// load script into new lisenvLISP::
-		lispenv->program_stack[0] = DH_read(filename); // DELETE BUFFER ON LISP DAEMON EXIT
+		// load script into new lisenv, daemons running the same script share its parse. a script that cannot be read or parsed
+		// starts no daemon, nothing knows the daemon yet
+		if(!LISP::load(filename, lispenv)){
+			LISP::EraseLispEnvironment(lispenv);
+			freeLispEnvHeap(lispenv);
+			pthread_mutex_destroy(&newDaemon->lock);
+			freeDaemonHeap(newDaemon);
+			pthread_mutex_unlock(&daemonLock);
+			return 0;
+		}
 
+		pthread_mutex_unlock(&daemonLock);
+		wakeDaemon(newDaemon); // the daemon is ready to run its script
 		return 1;
 	}
 
-
-	return 0;
-
 	//free(scriptFilename);
 }
 
 
+// the allocators of the daemons and their lisp environments, registry entries are never freed. the caller holds
+// daemonLock.
 void *allocateDaemonHeap(){
-	for(uint32_t i=0; i< activeDaemonListLen; i++){
-		if(activeDaemonListUsage[i]==0){
-
-			activeDaemonListUsage[i]=1;
-
-			return ((uint8_t*)activeDaemonList) + i;
-		}
-	}
-	activeDaemonListLen+=HEAP_REALLOC_SIZE;
-	activeDaemonListUsage = (uint8_t*)realloc(activeDaemonListUsage, sizeof(uint8_t)*activeDaemonListLen);
-	activeDaemonList = (Daemon*)realloc(activeDaemonList, sizeof(Daemon)*activeDaemonListLen);
-
-	memset(&activeDaemonListUsage[(activeDaemonListLen)-HEAP_REALLOC_SIZE], 0, sizeof(uint8_t)*HEAP_REALLOC_SIZE);
-	return allocateDaemonHeap();
+	Daemon *daemon = (Daemon*)slabAlloc(&daemonSlab);
+	daemon->handle = slabHandle(daemon);
+	return daemon;
 }
 
 void *allocateLispEnvHeap(){
-	for(uint32_t i=0; i< lispDaemonNum; i++){
-		if(lispDaemonUsage[i]==0){
-
-			lispDaemonUsage[i]=1;
-
-			return ((uint8_t*)lispDaemons) + i;
-		}
-	}
-	lispDaemonNum+=HEAP_REALLOC_SIZE;
-	lispDaemonUsage = (uint8_t*)realloc(lispDaemonUsage, sizeof(uint8_t)*lispDaemonNum);
-	lispDaemons = (LISP::LispEnv*)realloc(lispDaemons, sizeof(LISP::LispEnv)*lispDaemonNum);
-
-	memset(&lispDaemonUsage[(lispDaemonNum)-HEAP_REALLOC_SIZE], 0, sizeof(uint8_t)*HEAP_REALLOC_SIZE);
-
-	//printf(" alloc Usage: ");for(int k=0; k<*listLen; k++) printf(" %i ",listUsage[k]); printf("\n");
+	return slabAlloc(&lispEnvSlab);
+}
 
-	return allocateLispEnvHeap();
+void *allocateDaemonInfoHeap(){
+	return slabAlloc(&daemonInfoSlab);
+}
 
+void freeDaemonHeap(void *daemon){
+	slabFree(&daemonSlab, daemon);
 }
 
-void *allocateDaemonInfoHeap(){
-	for(uint32_t i=0; i< daemonInfoListLen; i++){
-		if(daemonInfoListUsage[i]==0){
+void freeLispEnvHeap(void *env){
+	slabFree(&lispEnvSlab, env);
+}
 
-			daemonInfoListUsage[i]=1;
+// the daemon of handle, nullptr if it is gone. the caller holds daemonLock while it uses the daemon.
+Daemon *findDaemon(Handle handle){
+	return (Daemon*)slabGet(&daemonSlab, handle);
+}
 
-			return ((uint8_t*)daemonInfoList) + i;
-		}
+// the daemon of this dollhouse with daemonID id, nullptr if there is none. the caller holds daemonLock.
+Daemon *findDaemonByID(const char *id){
+	for(uint32_t i=0; i<daemonSlab.len; i++){
+		Daemon *daemon = (Daemon*)slabAt(&daemonSlab, i);
+		if(daemon && memcmp(daemon->daemonID, id, DH_ID_LEN)==0) return daemon;
 	}
-	daemonInfoListLen+=HEAP_REALLOC_SIZE;
-	daemonInfoListUsage = (uint8_t*)realloc(daemonInfoListUsage, sizeof(uint8_t)*daemonInfoListLen);
-	daemonInfoList = (DaemonInfo*)realloc(daemonInfoList, sizeof(DaemonInfo)*daemonInfoListLen);
+	return nullptr;
+}
 
-	memset(&daemonInfoListUsage[(daemonInfoListLen)-HEAP_REALLOC_SIZE], 0, sizeof(uint8_t)*HEAP_REALLOC_SIZE);
-	return allocateDaemonInfoHeap();
+// a daemonID as a number, to print it.
+unsigned long long daemonNumber(const char *id){
+	uint64_t n = 0;
+	memcpy(&n, id, DH_ID_LEN);
+	return n;
 }
 
 
@@ -196,6 +307,14 @@ void createDaemonRegistryEntry(const char *filename){
 
 	Buffer metadata = DH_read(filename); // this file contains the metadata about the script
 
+	// a registry entry needs its name, script and language
+	if(!metadata.data || !strstr(metadata.data, "name") || !strstr(metadata.data, "filename:") ||
+	   !strstr(metadata.data, "language:")){
+		DH_release(metadata);
+		return;
+	}
+
+	pthread_mutex_lock(&daemonLock);
 	DaemonInfo *newinfo = (DaemonInfo*)allocateDaemonInfoHeap();
 
 	// split metadata file along new lines,
@@ -210,7 +329,7 @@ void createDaemonRegistryEntry(const char *filename){
 
 
 	// construct each interface.
-	char* textcopy = (char*)calloc(sizeof(char), metadata.size);
+	char* textcopy = (char*)calloc(sizeof(char), metadata.size+1);
 	lineIndex=textcopy;
 	memcpy(textcopy, metadata.data, metadata.size);
 	uint16_t count=0;
@@ -230,6 +349,7 @@ void createDaemonRegistryEntry(const char *filename){
 		newinfo->interfaces[count].direction = *lineIndex=='1'; // 0 is out, 1 is in
 		lineIndex = strchr(lineIndex,'\0')+1;
 		newinfo->interfaces[count].triggering = *lineIndex=='1'; // 0 does not trigger, 1 does.
+		count++;
 	}
 
 	lineIndex = strstr(metadata.data, "name");
@@ -244,75 +364,245 @@ void createDaemonRegistryEntry(const char *filename){
 	len = strcspn(strchr(lineIndex,':')+1,"\n");
 	memcpy(newinfo->language, strchr(lineIndex,':')+1, len>DH_LANG_LEN? DH_LANG_LEN : len);
 
+	// heap:<min>,<max> is optional, the number of cells the daemon's heap starts with and may grow to.
+	newinfo->heap_min = DH_HEAP_MIN;
+	newinfo->heap_max = DH_HEAP_MAX;
+	lineIndex = strstr(metadata.data, "heap:");
+	if(lineIndex != nullptr){
+		sscanf(lineIndex, "heap:%u,%u", &newinfo->heap_min, &newinfo->heap_max);
+		if(newinfo->heap_min < 64) newinfo->heap_min = 64;
+		if(newinfo->heap_max < newinfo->heap_min) newinfo->heap_max = newinfo->heap_min;
+	}
+
+	// interlink:<capacity>,<yield|drop|block> is optional, how many messages the interlinks from the daemon hold and what
+	// the daemon does when it outputs to a full one.
+	newinfo->link_capacity = DH_INTERLINK_CAPACITY;
+	newinfo->link_full = INTERLINK_YIELD;
+	lineIndex = strstr(metadata.data, "interlink:");
+	if(lineIndex != nullptr){
+		char full[8] = "";
+		sscanf(lineIndex, "interlink:%u,%7[a-z]", &newinfo->link_capacity, full);
+		if(newinfo->link_capacity < 1) newinfo->link_capacity = 1;
+		if(strcmp(full, "drop")==0) newinfo->link_full = INTERLINK_DROP;
+		else if(strcmp(full, "block")==0) newinfo->link_full = INTERLINK_BLOCK;
+	}
+
+	// image:<filename> is optional, the heap image the daemon starts from, see LISP::SaveLispImage(). its script runs in the
+	// environment that the image saved, the daemon starts without a heap image if it cannot be loaded.
+	newinfo->image[0] = '\0';
+	lineIndex = strstr(metadata.data, "image:");
+	if(lineIndex != nullptr){
+		len = strcspn(lineIndex+6, "\n");
+		if(len >= DH_FILENAME_LEN) len = DH_FILENAME_LEN-1;
+		memcpy(newinfo->image, lineIndex+6, len);
+		newinfo->image[len] = '\0';
+	}
+
+	indexDaemonInfo(newinfo);
+
+	pthread_mutex_unlock(&daemonLock);
 
 	free(textcopy);
-	eraseBuffer(metadata);
+	DH_release(metadata);
 
 
 }
 
-//keep an eye on this. A script that has two of the same interfaces, with different directions could call itself.
-DaemonInfo findCorrespondingInterface(Interface *interface){
-
-	// get a list of all possible daemons which can satisfy this interface.
-	uint32_t optionsNum=0;
-	DaemonInfo *optionList=(DaemonInfo*)malloc(sizeof(DaemonInfo*));
-	for(unsigned int i=0; i<daemonInfoListLen; i++){
-		if(daemonInfoListUsage[i]){ // if if this is a valid entry
-			for(int j=0; j<daemonInfoList[i].interface_num; j++){ // look at all the interfaces for the daemon
-				Interface *otherInterface = &(daemonInfoList[i].interfaces[j]);
-				if( otherInterface->direction != interface->direction &&
-					strncmp(otherInterface->name, interface->name, DH_INTERFACE_NAME_LEN)==0 &&
-					strncmp(otherInterface->type, interface->type, DH_TYPE_LEN)==0 &&
-					strncmp(otherInterface->format, interface->format, DH_FORMAT_LEN)==0
-				){
-					DaemonInfo* newslot = (DaemonInfo*)allocList(sizeof(DaemonInfo*), optionList, &optionsNum);
-					*newslot= daemonInfoList[i]; // add pointer to daemon info to possible options
-				}
+// FNV-1a hash of the name, type, format and direction of an interface, the key of the registry index.
+uint64_t interfaceKey(const char *name, const char *type, const char *format, uint8_t direction){
+	const char *fields[3] = {name, type, format};
+	const int lens[3] = {DH_INTERFACE_NAME_LEN, DH_TYPE_LEN, DH_FORMAT_LEN};
+	uint64_t h = 14695981039346656037ULL;
+	for(int f=0; f<3; f++){
+		for(int k=0; k<lens[f] && fields[f][k]; k++) h = (h ^ (uint8_t)fields[f][k]) * 1099511628211ULL;
+		h *= 1099511628211ULL; // a 0 between the fields
+	}
+	return (h ^ direction) * 1099511628211ULL;
+}
+
+// add the interfaces of a registry entry to the registry index, which grows to as many buckets as entries. the caller
+// holds daemonLock.
+void indexDaemonInfo(DaemonInfo *info){
+	if(registryEntries+info->interface_num > registryBuckets){
+		uint32_t buckets = registryBuckets ? registryBuckets : DH_REGISTRY_BUCKETS;
+		while(buckets < registryEntries+info->interface_num) buckets*=2;
+		RegistryEntry **index = (RegistryEntry**)calloc(sizeof(RegistryEntry*), buckets);
+		for(uint32_t i=0; i<registryBuckets; i++){ // rehash
+			for(RegistryEntry *entry=registryIndex[i], *next; entry; entry=next){
+				next = entry->next;
+				entry->next = index[entry->key & (buckets-1)];
+				index[entry->key & (buckets-1)] = entry;
 			}
 		}
+		free(registryIndex);
+		registryIndex = index;
+		registryBuckets = buckets;
 	}
+	for(int j=0; j<info->interface_num; j++){
+		Interface *interface = &info->interfaces[j];
+		RegistryEntry *entry = (RegistryEntry*)malloc(sizeof(RegistryEntry));
+		entry->key = interfaceKey(interface->name, interface->type, interface->format, interface->direction);
+		entry->info = info;
+		entry->interface = interface;
+		entry->next = registryIndex[entry->key & (registryBuckets-1)];
+		registryIndex[entry->key & (registryBuckets-1)] = entry;
+		registryEntries++;
+	}
+}
 
-	//TODO: pick out the best one.
-	DaemonInfo bestOption = optionList[0];
-	free(optionList);
+// the default rank of a registry entry: the most trusted daemon is picked.
+int rankByTrust(Interface *interface, DaemonInfo *info, Interface *offer){
+	return info->trust;
+}
 
-	return bestOption;
+InterfaceRank rankInterface = rankByTrust; // ranks the registry entries that findCorrespondingInterface() finds
 
+// the registry entry of the daemon that interface can be linked to: the highest ranked that has an interface with the
+// same name, type and format in the other direction. returns nullptr if there is none. the caller holds daemonLock.
+//keep an eye on this. A script that has two of the same interfaces, with different directions could call itself.
+DaemonInfo *findCorrespondingInterface(Interface *interface){
+	uint64_t key = interfaceKey(interface->name, interface->type, interface->format, !interface->direction);
+	DaemonInfo *best = nullptr;
+	int bestRank = 0;
+
+	for(RegistryEntry *entry = registryBuckets ? registryIndex[key & (registryBuckets-1)] : nullptr; entry; entry=entry->next){
+		Interface *offer = entry->interface;
+		if(entry->key!=key || // the key collides
+		   strncmp(offer->name, interface->name, DH_INTERFACE_NAME_LEN)!=0 ||
+		   strncmp(offer->type, interface->type, DH_TYPE_LEN)!=0 ||
+		   strncmp(offer->format, interface->format, DH_FORMAT_LEN)!=0) continue;
+		int rank = rankInterface(interface, entry->info, offer);
+		if(!best || rank > bestRank){
+			best = entry->info;
+			bestRank = rank;
+		}
+	}
+	return best;
 }
 
+// link interface of daemon to the daemons of the registry entry that findCorrespondingInterface() picks, which have
+// registered the interface in the other direction. the output side is the src of a link. the caller holds daemonLock.
+void linkCorresponding(Daemon *daemon, Interface *interface){
+	DaemonInfo *best = findCorrespondingInterface(interface);
+	if(!best) return;
+	for(uint32_t i=0; i<daemonSlab.len; i++){
+		Daemon *other = (Daemon*)slabAt(&daemonSlab, i);
+		if(!other || other==daemon || other->info!=best) continue;
+		int num;
+		Interface *interfaces = daemonInterfaces(other, &num);
+		for(int k=0; k<num; k++){
+			if(interfaces[k].direction==interface->direction ||
+			   strncmp(interfaces[k].name, interface->name, DH_INTERFACE_NAME_LEN)!=0 ||
+			   strncmp(interfaces[k].type, interface->type, DH_TYPE_LEN)!=0 ||
+			   strncmp(interfaces[k].format, interface->format, DH_FORMAT_LEN)!=0) continue;
+			if(interface->direction==DATA_OUT) linkDaemons(daemon, other, interface->name);
+			else linkDaemons(other, daemon, interface->name);
+			break;
+		}
+	}
+}
 
-// moves data through interlink if needed.
-void cycleInterlink(Interlink interlink){
-	if(strcmp(interlink.src->language, "lisp")==0 ){
-		LISP::LispEnv *srcEnv=(LISP::LispEnv*)(interlink.src->environment);
-		if(srcEnv->outputName[0]==0  || srcEnv->output_buffer.size==0)  return; // src output buffer is empty.
-		if(strcmp(interlink.dest->language, "lisp")==0){
-			LISP::LispEnv * destEnv=(LISP::LispEnv*)(interlink.dest->environment);
-			if(strcmp(srcEnv->outputName, interlink.name)==0){
-				if(strcmp(interlink.type, "char")==0 && strcmp(interlink.format, "string")==0){
-
-					char *buffer = (char*) calloc(sizeof(char), strlen(interlink.name) + srcEnv->output_buffer.size+strlen("(%s \"%s\")"));
-					sprintf(buffer, "(%s \"%s\")", interlink.name, srcEnv->output_buffer.data);
-					LISP::betterreadlisp(buffer, destEnv);
-					free(buffer);
-					free(srcEnv->output_buffer.data);
-					srcEnv->output_buffer.size=0;
-					srcEnv->outputName[0]=0;
 
-				}
+// offer the input interface of daemon to the other dollhouse of peer, in a message without a destID or a payload that
+// has the name, type and format of the interface. see receiveOffer().
+void offerInterface(Handle peer, Daemon *daemon, Interface *interface){
+	Message head;
+	memset(&head, 0, DH_MESSAGE_HEADER);
+	memcpy(head.srcID, daemon->daemonID, DH_ID_LEN);
+	strncpy(head.name, interface->name, DH_INTERFACE_NAME_LEN);
+	strncpy(head.type, interface->type, DH_TYPE_LEN);
+	strncpy(head.format, interface->format, DH_FORMAT_LEN);
+	peerSend(peer, &head, nullptr, 0);
+}
 
-			}
+// on the main thread, the peerConnected of the dollhouse: offer the input interfaces of the daemons to the other
+// dollhouse of peer.
+void offerInterfaces(Peer *peer){
+	pthread_mutex_lock(&daemonLock);
+	for(uint32_t i=0; i<daemonSlab.len; i++){
+		Daemon *daemon = (Daemon*)slabAt(&daemonSlab, i);
+		if(!daemon) continue;
+		int num;
+		Interface *interfaces = daemonInterfaces(daemon, &num);
+		for(int k=0; k<num; k++)
+			if(interfaces[k].direction==DATA_IN) offerInterface(peer->handle, daemon, &interfaces[k]);
+	}
+	pthread_mutex_unlock(&daemonLock);
+}
 
+// link the output interface of daemon to the daemon of another dollhouse that made offer, unless it is linked already or
+// its peer closed. the caller holds daemonLock.
+void linkOffer(Daemon *daemon, Interface *interface, RemoteOffer *offer){
+	if(strncmp(interface->name, offer->name, DH_INTERFACE_NAME_LEN)!=0 ||
+	   strncmp(interface->type, offer->type, DH_TYPE_LEN)!=0 ||
+	   strncmp(interface->format, offer->format, DH_FORMAT_LEN)!=0 || !peerOpen(offer->peer)) return;
+	pthread_mutex_lock(&remoteLock);
+	for(uint32_t j=0; j<remoteLinkNum; j++){
+		Interlink *l = remoteLinks[j];
+		if(l->src==daemon && l->peer==offer->peer && memcmp(l->remoteID, offer->remoteID, DH_ID_LEN)==0 &&
+		   strncmp(l->name, interface->name, DH_INTERFACE_NAME_LEN)==0){
+			pthread_mutex_unlock(&remoteLock);
+			return;
 		}
 	}
+	pthread_mutex_unlock(&remoteLock);
+	linkRemote(daemon, offer->peer, offer->remoteID, interface->name, DATA_OUT);
 }
 
+// on the main thread: keep the input interface that the daemon srcID of the other dollhouse of peer offered in head, and
+// link the output interfaces of the daemons of this dollhouse with its name, type and format to it.
+void receiveOffer(Handle peer, const Message *head){
+	RemoteOffer *offer = nullptr;
+	pthread_mutex_lock(&daemonLock);
+	for(uint32_t j=0; j<remoteOfferNum && !offer; j++){
+		RemoteOffer *o = &remoteOffers[j];
+		if(o->peer==peer && memcmp(o->remoteID, head->srcID, DH_ID_LEN)==0 &&
+		   strncmp(o->name, head->name, DH_INTERFACE_NAME_LEN)==0 && strncmp(o->type, head->type, DH_TYPE_LEN)==0 &&
+		   strncmp(o->format, head->format, DH_FORMAT_LEN)==0) offer = o;
+	}
+	if(!offer){
+		remoteOffers = (RemoteOffer*)realloc(remoteOffers, sizeof(RemoteOffer)*(remoteOfferNum+1));
+		offer = &remoteOffers[remoteOfferNum++];
+		offer->peer = peer;
+		memcpy(offer->remoteID, head->srcID, DH_ID_LEN);
+		memcpy(offer->name, head->name, DH_INTERFACE_NAME_LEN);
+		memcpy(offer->type, head->type, DH_TYPE_LEN);
+		memcpy(offer->format, head->format, DH_FORMAT_LEN);
+	}
+	for(uint32_t i=0; i<daemonSlab.len; i++){
+		Daemon *daemon = (Daemon*)slabAt(&daemonSlab, i);
+		if(!daemon) continue;
+		int num;
+		Interface *interfaces = daemonInterfaces(daemon, &num);
+		for(int k=0; k<num; k++)
+			if(interfaces[k].direction==DATA_OUT) linkOffer(daemon, &interfaces[k], offer);
+	}
+	pthread_mutex_unlock(&daemonLock);
+}
 
-
+// add a copy of interface to the interfaces of its daemon, on the worker that runs the daemon, and link it to the
+// daemons that run that registered the corresponding interface, see linkCorresponding(). an input interface is offered
+// to the other dollhouses, an output interface is linked to the input interfaces they offered.
 void registerDaemonInterface(Interface *interface){
-	interface->daemon->interface_num++;
-	interface->daemon->interfaces = (Interface*)realloc(interface->daemon->interfaces, sizeof(Interface)*interface->daemon->interface_num);
+	Daemon *daemon = interface->daemon;
+	pthread_mutex_lock(&daemonLock);
+	appendShared((void**)&daemon->interfaces, &daemon->interface_num, &daemon->interface_cap, interface, sizeof(Interface));
+	linkCorresponding(daemon, interface);
+	if(interface->direction==DATA_IN){
+		pthread_mutex_lock(&peerLock);
+		uint32_t n = 0;
+		Handle *peers = (Handle*)malloc(sizeof(Handle)*(peerSlab.len+1));
+		for(uint32_t i=0; i<peerSlab.len; i++){
+			Peer *peer = (Peer*)slabAt(&peerSlab, i);
+			if(peer && !peer->listening) peers[n++] = peer->handle;
+		}
+		pthread_mutex_unlock(&peerLock);
+		while(n--) offerInterface(peers[n], daemon, interface);
+		free(peers);
+	}else{
+		for(uint32_t j=0; j<remoteOfferNum; j++) linkOffer(daemon, interface, &remoteOffers[j]);
+	}
+	pthread_mutex_unlock(&daemonLock);
 }
 
 void killDaemon(Daemon){
@@ -322,38 +612,691 @@ void killDaemon(Daemon){
 }
 
 
-void cycle(){
+// put a ready daemon in a deque, the deque of the worker that woke it, and let a worker take it.
+void readyDaemon(Daemon *daemon){
+	ReadyDeque *deque = &readyDeques[workerIdx>=0 ? workerIdx : __atomic_fetch_add(&nextDeque, 1, __ATOMIC_RELAXED)%workerNum];
+	pthread_mutex_lock(&deque->lock);
+	if(deque->len==deque->cap){ // double the ring, unwrapping it so that it starts at 0 again
+		uint32_t cap = deque->cap ? 2*deque->cap : HEAP_REALLOC_SIZE;
+		Daemon **ring = (Daemon**)malloc(sizeof(Daemon*)*cap);
+		for(uint32_t k=0; k<deque->len; k++) ring[k] = deque->ring[(deque->head+k)%deque->cap];
+		free(deque->ring);
+		deque->ring = ring;
+		deque->head = 0;
+		deque->cap = cap;
+	}
+	deque->ring[(deque->head+deque->len++)%deque->cap] = daemon;
+	pthread_mutex_unlock(&deque->lock);
+	sem_post(&readyCount);
+}
+
+// take a daemon from the front of a deque, or steal it from the back, NULL if the deque is empty.
+Daemon *takeDaemon(ReadyDeque *deque, int steal){
+	Daemon *daemon = nullptr;
+	pthread_mutex_lock(&deque->lock);
+	if(deque->len>0){
+		if(steal){
+			daemon = deque->ring[(deque->head+deque->len-1)%deque->cap];
+		} else {
+			daemon = deque->ring[deque->head];
+			deque->head = (deque->head+1)%deque->cap;
+		}
+		deque->len--;
+	}
+	pthread_mutex_unlock(&deque->lock);
+	return daemon;
+}
+
+// make a daemon ready, unless it already is. a daemon that is woken while it runs runs again when it is done. a daemon
+// that is woken to run runs its next form and stops sleeping, one that is only woken to receive does neither.
+void wake(Daemon *daemon, int run){
+	if(run) __atomic_store_n(&daemon->run, 1, __ATOMIC_RELEASE);
+	uint8_t state = __atomic_load_n(&daemon->state, __ATOMIC_ACQUIRE);
+	while(1){
+		if(state==DAEMON_IDLE){
+			if(__atomic_compare_exchange_n(&daemon->state, &state, DAEMON_READY, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+				if(run) __atomic_store_n(&daemon->wake_at, 0, __ATOMIC_RELAXED);
+				readyDaemon(daemon);
+				return;
+			}
+		} else if(state==DAEMON_RUNNING){
+			if(__atomic_compare_exchange_n(&daemon->state, &state, DAEMON_WOKEN, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+				return;
+		} else return;
+	}
+}
+
+void wakeDaemon(Daemon *daemon){
+	wake(daemon, 1);
+}
+
+// let a worker receive the messages that arrived for daemon, see wake().
+void wakeReceiver(Daemon *daemon){
+	wake(daemon, 0);
+}
+
+// wake the scheduler when it is blocked, e.g. after a daemon was woken from a signal handler or another thread.
+void notifyScheduler(){
+	uint64_t one=1;
+	if(write(schedulerEvent, &one, sizeof(one)) < 0) return; // the counter is already nonzero, the scheduler will wake
+}
+
+// if the interface <name> of daemon is triggering, data arriving on it makes the daemon ready.
+int isTriggering(Daemon *daemon, const char *name){
+	int num;
+	Interface *interfaces = daemonInterfaces(daemon, &num);
+	for(int i=0; i<num; i++){
+		if(interfaces[i].direction==DATA_IN && interfaces[i].triggering &&
+		   strncmp(interfaces[i].name, name, DH_INTERFACE_NAME_LEN)==0)
+			return 1;
+	}
+	return 0;
+}
+
+// make an interlink from the output interface <name> of src to the input interface <name> of dest, or return the one
+// that links them already. its capacity and what src does when it is full are in the registry entry of src. a link to or
+// from another dollhouse has no src or dest, see linkRemote().
+Interlink *linkDaemons(Daemon *src, Daemon *dest, const char *name){
+	Interlink *link;
+	uint32_t capacity = src && src->info ? src->info->link_capacity : DH_INTERLINK_CAPACITY;
+
+	pthread_mutex_lock(&linkLock); // the daemons read their interlinks while they run, they are not locked
+	for(int j=0; src && dest && j<src->interlink_num; j++){
+		link = src->interlinks[j];
+		if(link->src==src && link->dest==dest && strncmp(link->name, name, DH_INTERFACE_NAME_LEN)==0){
+			pthread_mutex_unlock(&linkLock);
+			return link;
+		}
+	}
+	if((src && src->interlink_num==UINT16_MAX) || (dest && dest->interlink_num==UINT16_MAX) ||
+	   posix_memalign((void**)&link, 64, sizeof(Interlink))){
+		pthread_mutex_unlock(&linkLock);
+		return nullptr;
+	}
+	memset(link, 0, sizeof(Interlink));
+	strncpy(link->name, name, DH_INTERFACE_NAME_LEN-1);
+	link->src = src;
+	link->dest = dest;
+	for(link->capacity=1; link->capacity < capacity; link->capacity*=2) continue;
+	link->ring = (void**)malloc(sizeof(void*)*link->capacity);
+	link->full = src && src->info ? src->info->link_full : INTERLINK_YIELD;
+
+	if(src) appendShared((void**)&src->interlinks, &src->interlink_num, &src->interlink_cap, &link, sizeof(Interlink*));
+	if(dest && dest!=src)
+		appendShared((void**)&dest->interlinks, &dest->interlink_num, &dest->interlink_cap, &link, sizeof(Interlink*));
+	pthread_mutex_unlock(&linkLock);
+	return link;
+}
+
+// make an interlink between the interface <name> of daemon and the daemon with daemonID remoteID in the dollhouse at the
+// other end of the peer with handle peer: from daemon to it if direction is DATA_OUT, from it to daemon if DATA_IN. the
+// daemon sends and receives on it as on a link to a daemon of this dollhouse. the link to a remote daemon is made when it
+// offers its input interface, see receiveOffer(), the link from one when its first message arrives, see receiveRemote().
+Interlink *linkRemote(Daemon *daemon, Handle peer, const char *remoteID, const char *name, int direction){
+	Interlink *link = linkDaemons(direction==DATA_OUT ? daemon : nullptr, direction==DATA_IN ? daemon : nullptr, name);
+	if(!link) return nullptr;
+	link->peer = peer;
+	memcpy(link->remoteID, remoteID, DH_ID_LEN);
+	pthread_mutex_lock(&remoteLock);
+	remoteLinks = (Interlink**)realloc(remoteLinks, sizeof(Interlink*)*(remoteLinkNum+1));
+	remoteLinks[remoteLinkNum++] = link;
+	pthread_mutex_unlock(&remoteLock);
+	if(direction==DATA_OUT) notifyScheduler(); // messages may be waiting already
+	return link;
+}
+
+// push msg at the tail of the ring of an interlink, returns 0 if it is full. only the src of the interlink pushes.
+int pushInterlink(Interlink *link, void *msg){
+	uint32_t tail = link->tail;
+	if(tail - __atomic_load_n(&link->head, __ATOMIC_ACQUIRE) == link->capacity) return 0;
+	link->ring[tail & (link->capacity-1)] = msg;
+	__atomic_store_n(&link->tail, tail+1, __ATOMIC_RELEASE);
+	if(link->dest){
+		__atomic_add_fetch(&link->dest->inbox, 1, __ATOMIC_SEQ_CST);
+		if(__atomic_load_n(&link->dest->blocked, __ATOMIC_SEQ_CST)) signalRoom(); // whoever holds dest receives it
+	}
+	__atomic_add_fetch(&link->sent, 1, __ATOMIC_RELAXED);
+	return 1;
+}
+
+// pop the message at the head of the ring of an interlink, returns nullptr if it is empty. only the dest of the interlink pops.
+void *popInterlink(Interlink *link){
+	uint32_t head = link->head;
+	if(head == __atomic_load_n(&link->tail, __ATOMIC_ACQUIRE)) return nullptr;
+	void *msg = link->ring[head & (link->capacity-1)];
+	__atomic_store_n(&link->head, head+1, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&link->received, 1, __ATOMIC_RELAXED);
+	return msg;
+}
+
+// the batch size of the input interface <name> of daemon, 0 if it takes one message at a time.
+uint16_t interfaceBatch(Daemon *daemon, const char *name){
+	int num;
+	Interface *interfaces = daemonInterfaces(daemon, &num);
+	for(int i=0; i<num; i++){
+		if(interfaces[i].direction==DATA_IN && strncmp(interfaces[i].name, name, DH_INTERFACE_NAME_LEN)==0)
+			return interfaces[i].batch;
+	}
+	return 0;
+}
+
+// pass the n messages msgs to the closure of interface <name> of daemon in one call, as a list if list is nonzero. an
+// error in the closure drops the messages.
+void receiveMessages(Daemon *daemon, const char *name, LISP::Encoding **msgs, int n, int list){
+	LISP::LispEnv *env = (LISP::LispEnv*)daemon->environment;
+	int roots = env->var_num;
+	unsigned int vsp = env->vsp;
+	int i = setjmp(LISP::state.jb);
+	if(i==0) LISP::deliver(name, msgs, n, list, env);
+	else {
+		LISP::unwind(env->var_num-roots, env);
+		env->vsp = vsp;
+		fprintf(stderr, "%s: %s: ERR %d: %s\n", daemon->name, name, i, LISP::errors[i > 0 && i <= ERRORS ? i : 0]);
+	}
+	while(n--) LISP::free_message(msgs[n]);
+}
+
+// after the dest of link popped messages from it: wake its src if it holds back a message, and tell the sender that
+// waits for room, see sendInterlink() and receiveRemote().
+void madeRoom(Interlink *link){
+	__atomic_thread_fence(__ATOMIC_SEQ_CST); // the pops are seen by whoever set held or waiting before this sees it
+	if(__atomic_load_n(&link->held, __ATOMIC_RELAXED)) wakeDaemon(link->src);
+	if(__atomic_load_n(&link->waiting, __ATOMIC_RELAXED)){
+		if(link->src) signalRoom();
+		else notifyScheduler();
+	}
+}
 
-	for(int i=0; i<activeDaemonListLen; i++){ 	// run through all daemons once.
-		if(activeDaemonListUsage[i]){			// if the daemon is active
-			runDaemon(activeDaemonList[i]);
-			for(int j=0; j<activeDaemonList[i].interlink_num; j++){ // handle IPC
-				cycleInterlink(activeDaemonList[i].interlinks[j]);
+// pass the messages on the interlinks to daemon to the closures of its interfaces. an interface with a batch size gets the
+// messages of all of its interlinks in lists of up to that many. the caller holds the daemon's lock.
+void receiveInterlinks(Daemon *daemon){
+	struct LISP::State saved = LISP::state; // a blocked output receives in the middle of a form
+	LISP::Encoding *msgs[DH_BATCH_MAX];
+	__atomic_store_n(&daemon->inbox, 0, __ATOMIC_SEQ_CST);
+	int num;
+	Interlink **links = daemonInterlinks(daemon, &num); // a closure may make links, they are received the next time
+	for(int j=0; j<num; j++){
+		Interlink *link = links[j];
+		if(link->dest!=daemon) continue;
+		int batch = interfaceBatch(daemon, link->name), n;
+		do{
+			n = 0;
+			for(int k=j; k<num && n<(batch ? batch : 1); k++){ // this and the later interlinks to <name>
+				Interlink *other = links[k];
+				if(other->dest!=daemon || strncmp(other->name, link->name, DH_INTERFACE_NAME_LEN)!=0) continue;
+				int popped = n;
+				while(n<(batch ? batch : 1) && (msgs[n] = (LISP::Encoding*)popInterlink(other))) n++;
+				if(n>popped) madeRoom(other);
 			}
+			if(n) receiveMessages(daemon, link->name, msgs, n, batch>0);
+		}while(n);
+	}
+	LISP::state = saved;
+}
+
+// receive the waiting messages of daemon, unless it is locked. whoever holds the lock checks again after unlocking it,
+// so a message that is pushed while the lock is held is not left waiting.
+void receiveWaiting(Daemon *daemon){
+	while(1){
+		if(!__atomic_load_n(&daemon->inbox, __ATOMIC_SEQ_CST) || pthread_mutex_trylock(&daemon->lock)!=0) return;
+		Holding held = {daemon, holding};
+		holding = &held;
+		receiveInterlinks(daemon);
+		holding = held.next;
+		pthread_mutex_unlock(&daemon->lock);
+	}
+}
+
+// whether this thread holds the lock of daemon.
+int holdsDaemon(Daemon *daemon){
+	for(Holding *h=holding; h; h=h->next)
+		if(h->daemon==daemon) return 1;
+	return 0;
+}
+
+// wake the senders that wait for room, see sendInterlink().
+void signalRoom(){
+	pthread_mutex_lock(&roomLock);
+	roomSeq++;
+	pthread_cond_broadcast(&roomMoved);
+	pthread_mutex_unlock(&roomLock);
+}
+
+// on the I/O thread that did file operation req: push it on the operations of its daemon that are done, and wake the
+// daemon to receive it. the operation of a daemon that is gone is dropped.
+void completeIO(IORequest *req){
+	pthread_mutex_lock(&daemonLock);
+	Daemon *daemon = findDaemon(req->owner);
+	if(daemon){
+		req->next = __atomic_load_n(&daemon->io_done, __ATOMIC_RELAXED);
+		while(!__atomic_compare_exchange_n(&daemon->io_done, &req->next, req, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			continue;
+		wakeDaemon(daemon);
+	}
+	pthread_mutex_unlock(&daemonLock);
+	if(!daemon) DH_finish(req);
+}
+
+// submit file operation req of daemon to the I/O threads, while the daemon runs. the daemon does not run again until it
+// received the result, see receiveIO().
+void submitIO(Daemon *daemon, IORequest *req){
+	req->owner = daemon->handle;
+	req->done = completeIO;
+	daemon->io_pending++;
+	DH_submit(req);
+}
+
+// pass the results of the file operations of daemon that are done to the closures that wait for them, in the order they
+// were done. an error in a closure drops its result. the caller holds the daemon's lock.
+void receiveIO(Daemon *daemon){
+	IORequest *req = __atomic_exchange_n(&daemon->io_done, (IORequest*)nullptr, __ATOMIC_ACQUIRE), *done = nullptr;
+	if(!req) return;
+	while(req){ // the last done is on top
+		IORequest *next = req->next;
+		req->next = done;
+		done = req;
+		req = next;
+	}
+	struct LISP::State saved = LISP::state;
+	LISP::LispEnv *env = (LISP::LispEnv*)daemon->environment;
+	while((req = done)){
+		done = req->next;
+		int roots = env->var_num;
+		unsigned int vsp = env->vsp;
+		int i = setjmp(LISP::state.jb);
+		if(i==0) LISP::complete(req, env);
+		else {
+			LISP::unwind(env->var_num-roots, env);
+			env->vsp = vsp;
+			fprintf(stderr, "%s: %s: ERR %d: %s\n", daemon->name, req->filename, i, LISP::errors[i > 0 && i <= ERRORS ? i : 0]);
 		}
+		daemon->io_pending--;
+		DH_finish(req);
 	}
+	LISP::state = saved;
+}
 
+// send msg on an interlink, on the worker of its src while it holds the src's lock. when the ring is full, the src yields
+// and the message is held back until the dest makes room (INTERLINK_YIELD), the message is dropped (INTERLINK_DROP), or
+// the src waits for the dest to make room (INTERLINK_BLOCK). returns 0 if the message was dropped.
+int sendInterlink(Interlink *link, void *msg){
+	if(!link->held && pushInterlink(link, msg)) return 1;
+	if(link->full==INTERLINK_DROP){
+		LISP::free_message((LISP::Encoding*)msg);
+		__atomic_add_fetch(&link->dropped, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+	if(link->full==INTERLINK_YIELD && !link->held){ // a second message for a full interlink in the same form blocks
+		__atomic_store_n(&link->held, msg, __ATOMIC_RELAXED);
+		((LISP::LispEnv*)link->src->environment)->yield = 1;
+		return 1;
+	}
+	// the messages pushed to the daemons whose locks this thread holds are received here, they may be the dests of full
+	// interlinks to this one. the dest tells the sender when it makes room, see madeRoom()
+	__atomic_add_fetch(&link->waiting, 1, __ATOMIC_SEQ_CST);
+	for(Holding *h=holding; h; h=h->next) __atomic_add_fetch(&h->daemon->blocked, 1, __ATOMIC_SEQ_CST);
+	while(1){ // the held message goes first, the messages arrive in the order they are sent
+		pthread_mutex_lock(&roomLock);
+		uint64_t seq = roomSeq;
+		pthread_mutex_unlock(&roomLock);
+		if(link->held && pushInterlink(link, link->held)) __atomic_store_n(&link->held, (void*)nullptr, __ATOMIC_RELAXED);
+		if(!link->held && pushInterlink(link, msg)) break;
+		for(Holding *h=holding; h; h=h->next)
+			if(__atomic_load_n(&h->daemon->inbox, __ATOMIC_SEQ_CST)) receiveInterlinks(h->daemon);
+		if(!link->dest) notifyScheduler();                                // the main thread sends to the other dollhouse
+		else if(!holdsDaemon(link->dest)) receiveWaiting(link->dest);      // when the dest is not running, make room in its place
+		pthread_mutex_lock(&roomLock);
+		while(seq==roomSeq) pthread_cond_wait(&roomMoved, &roomLock);
+		pthread_mutex_unlock(&roomLock);
+	}
+	for(Holding *h=holding; h; h=h->next) __atomic_sub_fetch(&h->daemon->blocked, 1, __ATOMIC_SEQ_CST);
+	__atomic_sub_fetch(&link->waiting, 1, __ATOMIC_SEQ_CST);
+	return 1;
+}
 
+// push the messages held back by daemon, returns 0 if one is still held. the dest of its interlink wakes the daemon when
+// it makes room, see madeRoom().
+int sendHeld(Daemon *daemon){
+	int sent = 1, num;
+	Interlink **links = daemonInterlinks(daemon, &num);
+	for(int j=0; j<num; j++){
+		Interlink *link = links[j];
+		if(link->src!=daemon || !link->held) continue;
+		__atomic_thread_fence(__ATOMIC_SEQ_CST); // the dest sees held, or this sees the room it made
+		if(pushInterlink(link, link->held)) __atomic_store_n(&link->held, (void*)nullptr, __ATOMIC_RELAXED);
+		else sent = 0;
+	}
+	return sent;
 }
 
+// after daemon ran, and while it holds its lock, pass its new messages to the daemons it is linked to. a dest that is not
+// running receives them on this worker, a dest that is running receives them when it is done. a triggering interface
+// makes its daemon ready.
+void flushInterlinks(Daemon *daemon){
+	int num;
+	Interlink **links = daemonInterlinks(daemon, &num);
+	for(int j=0; j<num; j++){
+		Interlink *link = links[j];
+		if(link->src!=daemon) continue;
+		uint32_t tail = __atomic_load_n(&link->tail, __ATOMIC_RELAXED);
+		if(tail==link->flushed && !link->held) continue;
+		if(!link->dest){ // the main thread sends them to the other dollhouse
+			if(tail!=link->flushed) notifyScheduler();
+			link->flushed = tail;
+			continue;
+		}
+		receiveWaiting(link->dest);
+		if(tail!=link->flushed && isTriggering(link->dest, link->name)) wakeDaemon(link->dest);
+		link->flushed = tail;
+	}
+}
 
+// on the main thread: pop the messages of the interlinks to daemons in other dollhouses and queue them to their peers,
+// while the peers have room. a link whose peer has no room keeps its messages, its src waits as for a full link. the
+// messages of a link whose peer closed are dropped.
+void sendRemote(){
+	pthread_mutex_lock(&remoteLock);
+	for(uint32_t j=0; j<remoteLinkNum; j++){
+		Interlink *link = remoteLinks[j];
+		if(!link->src) continue;
+		LISP::Encoding *msg;
+		int popped = 0;
+		while(peerQueued(link->peer) < DH_PEER_QUEUE && (msg = (LISP::Encoding*)popInterlink(link))){
+			popped = 1;
+			Message head;
+			size_t len;
+			char *payload = LISP::pack_message(msg, &len);
+			memset(&head, 0, DH_MESSAGE_HEADER);
+			memcpy(head.srcID, link->src->daemonID, DH_ID_LEN);
+			memcpy(head.destID, link->remoteID, DH_ID_LEN);
+			strncpy(head.name, link->name, DH_INTERFACE_NAME_LEN);
+			if(peerSend(link->peer, &head, payload, len) < 0) __atomic_add_fetch(&link->dropped, 1, __ATOMIC_RELAXED);
+		}
+		if(popped) madeRoom(link);
+	}
+	pthread_mutex_unlock(&remoteLock);
+}
+
+// the link from the daemon remoteID of the other dollhouse of peer to the input interface <name> of the daemon destID
+// of this one, made if it is new. nullptr if this dollhouse has no such daemon or interface. on the main thread, which
+// reads the interfaces of the daemon while it may run, see daemonInterfaces().
+Interlink *remoteLink(Handle peer, const char *remoteID, const char *destID, const char *name){
+	pthread_mutex_lock(&remoteLock);
+	for(uint32_t j=0; j<remoteLinkNum; j++){
+		Interlink *l = remoteLinks[j];
+		if(l->dest && l->peer==peer && memcmp(l->remoteID, remoteID, DH_ID_LEN)==0 &&
+		   memcmp(l->dest->daemonID, destID, DH_ID_LEN)==0 && strncmp(l->name, name, DH_INTERFACE_NAME_LEN)==0){
+			pthread_mutex_unlock(&remoteLock);
+			return l;
+		}
+	}
+	pthread_mutex_unlock(&remoteLock);
+
+	pthread_mutex_lock(&daemonLock);
+	Daemon *dest = findDaemonByID(destID); // daemons are not freed
+	pthread_mutex_unlock(&daemonLock);
+	if(!dest) return nullptr;
+	int num;
+	Interface *interfaces = daemonInterfaces(dest, &num);
+	for(int i=0; i<num; i++)
+		if(interfaces[i].direction==DATA_IN && strncmp(interfaces[i].name, name, DH_INTERFACE_NAME_LEN)==0)
+			return linkRemote(dest, peer, remoteID, name, DATA_IN);
+	return nullptr;
+}
+
+// on the main thread, the peerReceive of the dollhouse: push message m that arrived from peer on the link from the daemon
+// that sent it to the daemon it is for, and wake the daemon. a worker receives it, the main thread does not run closures.
+// returns 0 when the link is full, the peer stalls until the daemon makes room. a message for no daemon or interface of
+// this dollhouse is dropped, a message for no daemon at all offers an interface, see receiveOffer().
+int receiveRemote(Peer *peer, Reassembly *m){
+	static const char noID[DH_ID_LEN] = {0};
+	if(memcmp(m->head.destID, noID, DH_ID_LEN)==0){
+		receiveOffer(peer->handle, &m->head);
+		freeReassembly(&peer->reassembler, m);
+		return 1;
+	}
+	char name[DH_INTERFACE_NAME_LEN+1] = {0};
+	memcpy(name, m->head.name, DH_INTERFACE_NAME_LEN);
+	Interlink *link = remoteLink(peer->handle, m->head.srcID, m->head.destID, name);
+	LISP::Encoding *msg = link ? LISP::unpack_message(m->data, m->len) : nullptr;
+	if(msg && !pushInterlink(link, msg)){
+		__atomic_store_n(&link->waiting, 1, __ATOMIC_RELAXED); // the daemon notifies the main thread when it makes room
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);               // unless it made room before it could see waiting
+		if(!pushInterlink(link, msg)){
+			LISP::free_message(msg);
+			return 0;
+		}
+	}
+	freeReassembly(&peer->reassembler, m);
+	if(!msg) return 1;
+	if(link->waiting) __atomic_store_n(&link->waiting, 0, __ATOMIC_RELAXED);
+	if(isTriggering(link->dest, link->name)) wakeDaemon(link->dest);
+	else wakeReceiver(link->dest);
+	return 1;
+}
+
+// wake the sleeping daemons that are due, returns the time the next one wakes at, 0 if none is sleeping.
+uint64_t wakeSleepers(uint64_t now){
+	uint64_t next=0;
+	pthread_mutex_lock(&daemonLock);
+	for(uint32_t i=0; i<daemonSlab.len; i++){
+		Daemon *daemon = (Daemon*)slabAt(&daemonSlab, i);
+		if(!daemon) continue;
+		uint64_t wake_at = __atomic_load_n(&daemon->wake_at, __ATOMIC_RELAXED);
+		if(wake_at==0) continue;
+		if(wake_at <= now) wakeDaemon(daemon);
+		else if(next==0 || wake_at < next) next = wake_at;
+	}
+	pthread_mutex_unlock(&daemonLock);
+	return next;
+}
+
+// write the buckets of histogram h that counted durations to fp, as <<us>:<count>, the last as >=<us>:<count>.
+void printHistogram(FILE *fp, Histogram *h){
+	for(int k=0; k<DH_HISTOGRAM_BUCKETS; k++){
+		if(!h->count[k]) continue;
+		if(k<DH_HISTOGRAM_BUCKETS-1) fprintf(fp, " <%llu:%llu", 1ull<<k, (unsigned long long)h->count[k]);
+		else fprintf(fp, " >=%llu:%llu", 1ull<<(k-1), (unsigned long long)h->count[k]);
+	}
+	fprintf(fp, "\n");
+}
+
+// write the statistics of the daemons, their output interlinks and the main loop to file <filename>. the counters of a
+// daemon that is running are read as they are, the numbers are a snapshot. the interlinks that a running daemon makes
+// meanwhile are not in it, see daemonInterlinks().
+void dumpStats(const char *filename){
+	FILE *fp = fopen(filename, "w");
+	if(!fp) return;
+	fprintf(fp, "cycles us:");
+	printHistogram(fp, &cycles);
+	pthread_mutex_lock(&daemonLock);
+	for(uint32_t i=0; i<daemonSlab.len; i++){
+		Daemon *daemon = (Daemon*)slabAt(&daemonSlab, i);
+		if(!daemon) continue;
+		uint64_t runs = 0;
+		for(int k=0; k<DH_HISTOGRAM_BUCKETS; k++) runs += daemon->runs.count[k];
+		fprintf(fp, "daemon %s %llx id %llx runs %llu run_ms %.3f", daemon->name, (unsigned long long)daemon->handle,
+		        daemonNumber(daemon->daemonID), (unsigned long long)runs, daemon->runs.total_ns/1e6);
+		if(__atomic_load_n(&daemon->state, __ATOMIC_ACQUIRE)==DAEMON_RUNNING) // a daemon that hogs a worker
+			fprintf(fp, " running_ms %.3f", (monotonicNs()-daemon->started)/1e6);
+		if(strncmp(daemon->language, "lisp", DH_LANG_LEN)==0){
+			LISP::LispStats *st = &((LISP::LispEnv*)daemon->environment)->stats;
+			fprintf(fp, " steps %llu alloc_bytes %llu minor_gcs %llu major_gcs %llu gc_ms %.3f copied_bytes %llu",
+			        (unsigned long long)st->steps, (unsigned long long)st->alloc_bytes, (unsigned long long)st->minors,
+			        (unsigned long long)st->majors, st->gc_ns/1e6, (unsigned long long)st->copied_bytes);
+		}
+		fprintf(fp, "\n  run us:");
+		printHistogram(fp, &daemon->runs);
+		int num;
+		Interlink **links = daemonInterlinks(daemon, &num);
+		for(int j=0; j<num; j++){
+			Interlink *link = links[j];
+			if(link->src!=daemon) continue;
+			if(link->dest)
+				fprintf(fp, "  interlink %s -> %s", link->name, link->dest->name);
+			else
+				fprintf(fp, "  interlink %s -> %llx of peer %llx", link->name, daemonNumber(link->remoteID),
+				        (unsigned long long)link->peer);
+			fprintf(fp, " sent %llu received %llu dropped %u\n",
+			        (unsigned long long)__atomic_load_n(&link->sent, __ATOMIC_RELAXED),
+			        (unsigned long long)__atomic_load_n(&link->received, __ATOMIC_RELAXED),
+			        __atomic_load_n(&link->dropped, __ATOMIC_RELAXED));
+		}
+	}
+	pthread_mutex_unlock(&daemonLock);
+	pthread_mutex_lock(&peerLock);
+	for(uint32_t i=0; i<peerSlab.len; i++){
+		Peer *peer = (Peer*)slabAt(&peerSlab, i);
+		if(!peer || peer->listening) continue;
+		fprintf(fp, "peer %llx frames_sent %llu frames_received %llu messages_sent %llu messages_received %llu queued %u "
+		        "refused %llu expired %llu\n", (unsigned long long)peer->handle, (unsigned long long)peer->frames_sent,
+		        (unsigned long long)peer->frames_received, (unsigned long long)peer->messages_sent,
+		        (unsigned long long)peer->messages_received, peer->out_frames,
+		        (unsigned long long)peer->reassembler.refused, (unsigned long long)peer->reassembler.expired);
+	}
+	pthread_mutex_unlock(&peerLock);
+	fclose(fp);
+}
+
+// on SIGUSR1: ask the main loop to dump the statistics, see dumpStats().
+void requestStats(int){
+	uint64_t one = 1;
+	statsRequested = 1;
+	if(write(schedulerEvent, &one, sizeof(one)) < 0) return; // wakes the main loop
+}
+
+// the main loop: wake the sleeping daemons that are due, write the buffers of the file handles that are due and send the
+// frames queued to peers, then block until the next is due, the scheduler is notified or a peer has frames. the workers
+// run the daemons.
+void cycle(){
+	uint64_t start = monotonicNs(), now = start/1000000, next = wakeSleepers(now), flush = DH_flush_files(now);
+	sendRemote();
+	uint64_t expires = servePeers(now);
+	if(flush && (next==0 || flush < next)) next = flush;
+	if(expires && (next==0 || expires < next)) next = expires;
+	histogramAdd(&cycles, monotonicNs()-start);
+
+	struct epoll_event events[32];
+	int n = epoll_wait(schedulerEpoll, events, 32, next ? (int)(next-now) : -1);
+	now = monotonicMs();
+	for(int k=0; k<n; k++){
+		if(events[k].data.u64==0){
+			uint64_t count;
+			if(read(schedulerEvent, &count, sizeof(count)) < 0) continue;
+		}else peerEvent(events[k].data.u64, events[k].events, now); // frames from another dollhouse
+	}
+	if(statsRequested){
+		statsRequested = 0;
+		dumpStats(DH_STATS_FILE);
+	}
+}
 
-void runDaemon(Daemon daemon){
+// a worker thread: take a ready daemon from its own deque, or steal one, and run it. a daemon that has more work is
+// ready again at once, a daemon that sleeps is woken by the main thread. a daemon that was only woken to receive
+// receives and does not run, see wake().
+void *worker(void *idx){
+	workerIdx = (int)(intptr_t)idx;
+	while(1){
+		while(sem_wait(&readyCount)!=0) continue; // there is a ready daemon in one of the deques
+		Daemon *daemon = nullptr;
+		for(int k=0; !daemon; k++){
+			int i = (workerIdx+k)%workerNum;
+			daemon = takeDaemon(&readyDeques[i], i!=workerIdx);
+		}
 
-	if(strncmp(daemon.language, "lisp", 16)==0){
-		LISP::LispEnv *env = (LISP::LispEnv*) daemon.environment;
-		LISP::eval(LISP::readlisp(env), &env->env, env);
+		__atomic_store_n(&daemon->state, DAEMON_RUNNING, __ATOMIC_RELEASE);
+		int run = __atomic_exchange_n(&daemon->run, 0, __ATOMIC_ACQ_REL);
+		pthread_mutex_lock(&daemon->lock);
+		Holding held = {daemon, nullptr};
+		holding = &held;
+		receiveInterlinks(daemon);
+		receiveIO(daemon);
+		// a daemon that holds back a message or waits for a file operation is idle, it is woken when its dest made room or
+		// when the operation is done
+		uint64_t start = daemon->started = monotonicNs();
+		int more = !run || daemon->io_pending ? 0 : sendHeld(daemon) ? runDaemon(daemon) : 0;
+		more &= !daemon->io_pending;
+		histogramAdd(&daemon->runs, monotonicNs()-start);
+		flushInterlinks(daemon);
+		holding = nullptr;
+		pthread_mutex_unlock(&daemon->lock);
+		receiveWaiting(daemon); // the messages that arrived while it ran
+
+		uint64_t wake_at = __atomic_load_n(&daemon->wake_at, __ATOMIC_RELAXED);
+		uint8_t state = DAEMON_RUNNING;
+		if(wake_at) notifyScheduler(); // the main thread waits for the earliest timer
+		if(more && !wake_at) __atomic_store_n(&daemon->run, 1, __ATOMIC_RELEASE);
+		if((more && !wake_at) ||
+		   !__atomic_compare_exchange_n(&daemon->state, &state, DAEMON_IDLE, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+			if(__atomic_load_n(&daemon->run, __ATOMIC_ACQUIRE)) // run again, it has work or it was woken to run
+				__atomic_store_n(&daemon->wake_at, 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&daemon->state, DAEMON_READY, __ATOMIC_RELEASE);
+			readyDaemon(daemon);
+		}
 	}
+	return nullptr;
+}
+
+
+// run the next top-level form of a daemon, returns nonzero if it has more work. a daemon that yielded to sleep is
+// woken by its timer instead. an error ends the form, the daemon continues with the next one.
+int runDaemon(Daemon *daemon){
+
+	if(strncmp(daemon->language, "lisp", 16)==0){
+		LISP::LispEnv *env = (LISP::LispEnv*) daemon->environment;
+		int roots = env->var_num;
+		unsigned int vsp = env->vsp;
+		int i = setjmp(LISP::state.jb);
+		if(i){
+			LISP::unwind(env->var_num-roots, env);
+			env->vsp = vsp;
+			fprintf(stderr, "%s: ERR %d: %s\n", daemon->name, i, LISP::errors[i > 0 && i <= ERRORS ? i : 0]);
+			return 1;
+		}
+		if(!LISP::run_form(env)) // run the next top-level form of the script
+			return 0;
+		if(env->yield){
+			env->yield=0;
+			if(env->sleep) __atomic_store_n(&daemon->wake_at, monotonicMs()+env->sleep, __ATOMIC_RELAXED);
+		}
+		return 1;
+	}
+	return 0;
 }
 
 
 int main(){
 	bootstrap();
-	startDaemon("dollhouse_sandbox/main.lisp", "lisp");
+	// DH_LISTEN and the comma separated DH_PEERS are addresses, see peerAddress().
+	const char *listen = getenv("DH_LISTEN"), *peers = getenv("DH_PEERS");
+	if(listen && !listenPeers(schedulerEpoll, listen)) printf("cannot listen on %s\n", listen);
+	if(peers){
+		char *list = strdup(peers), *save;
+		for(char *address = strtok_r(list, ",", &save); address; address = strtok_r(nullptr, ",", &save))
+			if(!connectPeer(schedulerEpoll, address)) printf("cannot connect to %s\n", address);
+		free(list);
+	}
+	// register the .daemon files of the sandbox first, the heap limits of main.daemon apply to the daemon that runs
+	// main.lisp, and the interfaces of the daemons that it starts are linked by their registry entries. DH_MAIN is the
+	// script that runs first, instead of main.lisp.
+	DIR *sandbox = opendir("dollhouse_sandbox");
+	if(sandbox){
+		char path[DH_FILENAME_LEN];
+		struct dirent *entry;
+		while((entry = readdir(sandbox))){
+			size_t len = strlen(entry->d_name);
+			if(len<=7 || strcmp(entry->d_name+len-7, ".daemon")!=0) continue;
+			if(snprintf(path, sizeof(path), "dollhouse_sandbox/%s", entry->d_name) < (int)sizeof(path))
+				createDaemonRegistryEntry(path);
+		}
+		closedir(sandbox);
+	}
 
-	createDaemonRegistryEntry("dollhouse_sandbox/main.daemon");
+	const char *script = getenv("DH_MAIN");
+	if(!startDaemon(script ? script : "dollhouse_sandbox/main.lisp", "lisp"))
+		printf("cannot start %s\n", script ? script : "dollhouse_sandbox/main.lisp");
 
-	for(int k=0; k<activeDaemonListLen; k++) printf(" %i ",activeDaemonListUsage[k]); printf("\n");
+	for(uint32_t k=0; k<daemonSlab.len; k++) printf(" %i ",slabAt(&daemonSlab, k)!=nullptr); printf("\n");
 
 	while(1){
 		cycle();
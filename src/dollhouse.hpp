@@ -10,6 +10,8 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <pthread.h>
+#include <time.h>
 
 
 #define DH_FILENAME_LEN 64
@@ -19,6 +21,17 @@ typedef struct Buffer{
 	char *data;
 } Buffer;
 
+// nanoseconds of the monotonic clock, to time what daemons and the scheduler do.
+uint64_t monotonicNs(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+// milliseconds of the monotonic clock, for the timers of sleeping daemons and of file buffers.
+uint64_t monotonicMs(){
+	return monotonicNs()/1000000;
+}
 
 
 #include "dollhousefile.hpp"
@@ -32,6 +45,31 @@ typedef struct Buffer{
 #define DH_TYPE_LEN 16
 #define DH_FORMAT_LEN 16
 #define DH_ID_LEN 6
+#define DH_HEAP_MIN (1<<12) // default number of cells a daemon's heap starts with and shrinks to
+#define DH_HEAP_MAX (1<<20) // default number of cells a daemon's heap may grow to
+#define DH_WORKERS_MAX 64 // maximum number of worker threads that run daemons, DH_WORKERS in the environment sets the number
+#define DH_INTERLINK_CAPACITY 64 // default number of messages an interlink holds, rounded up to a power of two
+#define DH_BATCH_MAX 256 // the most messages an interface closure is passed in one call
+#define DH_SLAB_CHUNK 64 // number of objects a slab allocates at once
+#define DH_REGISTRY_BUCKETS 64 // initial number of buckets of the index of registered interfaces, a power of two
+#define DH_HISTOGRAM_BUCKETS 24 // buckets of a histogram of durations, the last counts those of 2^22 us (4 s) or more
+#define DH_STATS_FILE "dollhouse_sandbox/dollhouse.stats" // where SIGUSR1 dumps the statistics, see dumpStats()
+
+typedef uint64_t Handle; // an object of a slab: its index in the low 32 bits, the generation of its slot in the high 32 bits
+
+// a histogram of durations: bucket 0 counts those of less than 1 us, bucket k>0 those of 2^(k-1) us up to 2^k us.
+typedef struct Histogram{
+	uint64_t count[DH_HISTOGRAM_BUCKETS];
+	uint64_t total_ns;
+}Histogram;
+
+// count a duration of ns nanoseconds in histogram h.
+void histogramAdd(Histogram *h, uint64_t ns){
+	uint64_t us = ns/1000;
+	int k = us ? 64-__builtin_clzll(us) : 0;
+	h->count[k < DH_HISTOGRAM_BUCKETS ? k : DH_HISTOGRAM_BUCKETS-1]++;
+	h->total_ns += ns;
+}
 
 struct Message;
 struct Daemon;
@@ -40,40 +78,74 @@ struct Interlink;
 struct DaemonInfo;
 
 
-void runDaemon(struct Daemon);
+int runDaemon(struct Daemon*);
+void wakeDaemon(struct Daemon*);
+void wakeReceiver(struct Daemon*);
+void notifyScheduler();
 void registerDaemonInterface(struct Interface*);
+struct Interlink *linkDaemons(struct Daemon*, struct Daemon*, const char*);
+struct Interlink *linkRemote(struct Daemon*, Handle, const char*, const char*, int);
+void submitIO(struct Daemon*, IORequest*);
+int sendInterlink(struct Interlink*, void*);
+void indexDaemonInfo(struct DaemonInfo*);
+struct DaemonInfo *findCorrespondingInterface(struct Interface*);
 void *allocateDaemonHeap();
 void *allocateDaemonInfoHeap();
 void *allocateLispEnvHeap();
+void freeDaemonHeap(void*);
+void freeLispEnvHeap(void*);
+struct Daemon *findDaemon(Handle);
+struct Daemon *findDaemonByID(const char*);
 int startDaemon(const char*, const char*);
 
+#define DH_MESSAGE_DATA (256 - (3 * DH_ID_LEN + 2 * sizeof(uint16_t) + DH_TYPE_LEN + DH_FORMAT_LEN + DH_INTERFACE_NAME_LEN))
+
 typedef struct Message{ // fits within 256 bytes
 	char srcID[DH_ID_LEN], destID[DH_ID_LEN], msgID[DH_ID_LEN]; 	// unique IDs identifying daemons and messages. (2^48 possible values.)
-	uint16_t idx;						   	// If more than 180 bytes are required, we send multiple messages.
-	uint16_t total;						   	// If more than 180 bytes are required, we send multiple messages. Maxes out at 11 megabytes
+	uint16_t idx;						   	// If more than 186 bytes are required, we send multiple messages.
+	uint16_t total;						   	// If more than 186 bytes are required, we send multiple messages. Maxes out at 11 megabytes
 	char type[DH_TYPE_LEN], format[DH_FORMAT_LEN], name[DH_INTERFACE_NAME_LEN]; 	// type: basic data type of each value.
 											// format: data structure (if applicable)
 											// Name: the name of the data being sent.
-	char data[256 - (3 * DH_ID_LEN + DH_TYPE_LEN + DH_FORMAT_LEN + DH_INTERFACE_NAME_LEN)];							// actual data being sent.
+	char data[DH_MESSAGE_DATA];				// actual data being sent. a message is sent without the bytes after its data
 }Message;
 
+#define DH_MESSAGE_HEADER (sizeof(Message) - DH_MESSAGE_DATA) // the bytes of a message before its data
+
 
 enum DATA_DIRECTION{DATA_OUT, DATA_IN};
+enum DAEMON_STATES{DAEMON_IDLE, DAEMON_READY, DAEMON_RUNNING, DAEMON_WOKEN}; // WOKEN: woken while running, it runs again
+enum INTERLINK_FULL{INTERLINK_YIELD, INTERLINK_DROP, INTERLINK_BLOCK}; // what a daemon does when it outputs to a full interlink
 typedef struct Interface{
 	char name[DH_INTERFACE_NAME_LEN], type[DH_TYPE_LEN], format[DH_FORMAT_LEN];
 	uint8_t direction;
 	uint8_t triggering;
+	uint16_t batch; // the most messages passed to the closure in one list, 0 passes them one at a time
 	struct Daemon *daemon;
 }Interface;
 
 typedef struct Daemon{
 	char daemonID[DH_ID_LEN], language[DH_LANG_LEN], name[DH_DAEMON_NAME_LEN];
+	// the interfaces and the interlinks from and to the daemon, which are shared with the daemons at their other ends.
+	// other threads read them without a lock, see appendShared()
 	Interface *interfaces;
 	uint16_t interface_num, interlink_num;
-	struct Interlink *interlinks;
+	uint16_t interface_cap, interlink_cap;
+	struct Interlink **interlinks;
 	void *environment;
 	DaemonInfo *info;
 	Dibs *dibs;
+	uint8_t state;    // DAEMON_STATES, a daemon is in at most one ready deque and runs on at most one worker at a time.
+	uint8_t run;      // set when it is woken to run its next form, a daemon woken only to receive does not, see worker().
+	uint64_t wake_at; // monotonic time in ms at which a sleeping daemon becomes ready, 0 if it is not sleeping.
+	uint32_t inbox;   // the number of messages pushed on its interlinks since it last received, see receiveWaiting().
+	uint32_t blocked; // the senders that wait for room while they hold its lock, they receive what is pushed to it
+	uint32_t io_pending;  // the file operations it submitted whose results it did not receive, it does not run meanwhile
+	IORequest *io_done;   // the file operations that are done, pushed by the I/O threads, see receiveIO().
+	pthread_mutex_t lock; // held while the daemon runs, and while data is delivered into its environment.
+	Handle handle;        // the daemon as long as it lives, see findDaemon()
+	Histogram runs;       // how long it ran each time a worker ran it
+	uint64_t started;     // the monotonic time in ns at which a worker last started to run it
 }Daemon;
 
 typedef struct DaemonInfo{
@@ -81,13 +153,47 @@ typedef struct DaemonInfo{
 	Interface *interfaces;
 	uint16_t interface_num;
 	int trust;
+	unsigned int heap_min, heap_max; // heap:<min>,<max> in the .daemon file, in cells.
+	unsigned int link_capacity;      // interlink:<capacity>,<yield|drop|block> in the .daemon file, for the daemon's output.
+	uint8_t link_full;
+	char image[DH_FILENAME_LEN];     // image:<filename> in the .daemon file, the heap image the daemon starts from, or empty.
 }DaemonInfo;
 
+// an interface of a registry entry in the registry index, chained in the bucket of its key.
+typedef struct RegistryEntry{
+	uint64_t key; // interfaceKey() of its name, type, format and direction
+	DaemonInfo *info;
+	Interface *interface;
+	struct RegistryEntry *next;
+}RegistryEntry;
+
+// the rank of a registry entry info that offers interface offer to connect to interface, the highest ranked is picked.
+typedef int (*InterfaceRank)(Interface *interface, DaemonInfo *info, Interface *offer);
+
 
 typedef struct Interlink{
 	//char srcID[DH_ID_LEN], destID[DH_ID_LEN];
 	char type[DH_TYPE_LEN], format[DH_FORMAT_LEN], name[DH_INTERFACE_NAME_LEN];
 	Daemon *src, *dest;
+	// a bounded lock-free ring of messages from src to dest. src is its only producer and pushes at tail, dest its only
+	// consumer and pops at head, each while it holds its daemon's lock. head and tail count up and wrap around.
+	void **ring;
+	uint32_t capacity; // a power of two
+	alignas(64) uint32_t head;
+	alignas(64) uint32_t tail; // head and tail are on separate cache lines, the producer and consumer do not share one
+	uint32_t flushed;  // the tail when src last flushed the interlink, see flushInterlinks()
+	uint8_t full;      // INTERLINK_FULL
+	// the senders that wait for room: src blocked on it, see sendInterlink(), or for a link from another dollhouse the main
+	// thread, whose message did not fit, see receiveRemote(). the dest tells them when it makes room, see madeRoom()
+	uint8_t waiting;
+	void *held;        // a message that INTERLINK_YIELD holds back until the ring has room, the dest wakes src then
+	// the counters are read by other threads, see f_stats() and dumpStats(), and are updated with relaxed atomics
+	uint32_t dropped;  // the number of messages that INTERLINK_DROP dropped, or that could not be sent to the peer
+	uint64_t sent, received; // the number of messages pushed and popped
+	// a link to or from a daemon in another dollhouse has no src or no dest. the main thread pops the messages of a link
+	// to it and sends them to the peer, and pushes the messages that arrive from the peer on a link from it.
+	Handle peer;               // 0 for a link between two daemons of this dollhouse
+	char remoteID[DH_ID_LEN];  // the daemonID of the daemon in the other dollhouse
 }Interlink;
 
 
@@ -105,6 +211,106 @@ void *allocList(size_t size, void* list, uint32_t *list_size){
 
 
 
+// a pool of objects of one size at stable addresses. the objects are allocated in chunks of DH_SLAB_CHUNK that never
+// move, and a stack of free slots makes allocating and freeing O(1). the generation of a slot counts up when its object
+// is allocated and when it is freed, it is odd while the slot is in use, so a handle to a freed object does not resolve.
+typedef struct SlabSlot{
+	uint32_t index, generation;
+	uint64_t align;   // the object follows, aligned as malloc aligns
+}SlabSlot;
+
+typedef struct Slab{
+	size_t size;      // of an object
+	char **chunks;
+	uint32_t len;     // the number of slots in the chunks
+	uint32_t *free;   // the indices of the free slots
+	uint32_t free_num;
+}Slab;
+
+// the slot at index of slab
+SlabSlot *slabSlot(Slab *slab, uint32_t index){
+	return (SlabSlot*)(slab->chunks[index/DH_SLAB_CHUNK] + (index%DH_SLAB_CHUNK)*(sizeof(SlabSlot)+slab->size));
+}
+
+// a new zeroed object of slab
+void *slabAlloc(Slab *slab){
+	if(slab->free_num==0){ // add a chunk, its slots are free
+		slab->chunks = (char**)realloc(slab->chunks, sizeof(char*)*(slab->len/DH_SLAB_CHUNK+1));
+		slab->chunks[slab->len/DH_SLAB_CHUNK] = (char*)calloc(DH_SLAB_CHUNK, sizeof(SlabSlot)+slab->size);
+		slab->free = (uint32_t*)realloc(slab->free, sizeof(uint32_t)*(slab->len+DH_SLAB_CHUNK));
+		for(int k=DH_SLAB_CHUNK; k--; ){ // the lowest index is allocated first
+			slabSlot(slab, slab->len+k)->index = slab->len+k;
+			slab->free[slab->free_num++] = slab->len+k;
+		}
+		slab->len += DH_SLAB_CHUNK;
+	}
+	SlabSlot *slot = slabSlot(slab, slab->free[--slab->free_num]);
+	slot->generation++;
+	memset(slot+1, 0, slab->size);
+	return slot+1;
+}
+
+// free an object of slab
+void slabFree(Slab *slab, void *obj){
+	SlabSlot *slot = (SlabSlot*)obj-1;
+	slot->generation++;
+	slab->free[slab->free_num++] = slot->index;
+}
+
+// the handle of an object of a slab
+Handle slabHandle(void *obj){
+	SlabSlot *slot = (SlabSlot*)obj-1;
+	return (Handle)slot->generation<<32 | slot->index;
+}
+
+// the object of handle, or nullptr if it was freed
+void *slabGet(Slab *slab, Handle handle){
+	if((uint32_t)handle >= slab->len) return nullptr;
+	SlabSlot *slot = slabSlot(slab, (uint32_t)handle);
+	return slot->generation==handle>>32 ? slot+1 : nullptr;
+}
+
+// the object at index of slab, or nullptr if the slot is free
+void *slabAt(Slab *slab, uint32_t index){
+	SlabSlot *slot = slabSlot(slab, index);
+	return slot->generation&1 ? slot+1 : nullptr;
+}
+
+
+// append item of size bytes to *list of *num items, which other threads read without a lock. a full list is copied to
+// a new one of twice its capacity *cap, which is published before the number of items that includes item, so a reader
+// that loads the number and then the list sees at least that many items. the old list is not freed, a reader may still
+// hold it. the caller serializes the appends to a list. returns 0 if it is full.
+int appendShared(void **list, uint16_t *num, uint16_t *cap, const void *item, size_t size){
+	uint16_t n = *num;
+	if(n==UINT16_MAX) return 0;
+	if(n==*cap){
+		uint16_t grown = *cap==0 ? 4 : *cap < UINT16_MAX/2 ? 2**cap : UINT16_MAX;
+		char *copy = (char*)malloc(size*grown);
+		if(!copy) return 0;
+		if(n) memcpy(copy, *list, size*n);
+		__atomic_store_n(list, (void*)copy, __ATOMIC_RELEASE);
+		*cap = grown;
+	}
+	memcpy((char*)*list + size*n, item, size);
+	__atomic_store_n(num, (uint16_t)(n+1), __ATOMIC_RELEASE);
+	return 1;
+}
+
+// the interfaces of daemon, and their number in *num. an interface registered later is not among them.
+Interface *daemonInterfaces(Daemon *daemon, int *num){
+	*num = __atomic_load_n(&daemon->interface_num, __ATOMIC_ACQUIRE);
+	return __atomic_load_n(&daemon->interfaces, __ATOMIC_ACQUIRE);
+}
+
+// the interlinks from and to daemon, and their number in *num. an interlink made later is not among them.
+Interlink **daemonInterlinks(Daemon *daemon, int *num){
+	*num = __atomic_load_n(&daemon->interlink_num, __ATOMIC_ACQUIRE);
+	return __atomic_load_n(&daemon->interlinks, __ATOMIC_ACQUIRE);
+}
+
+
+
 void eraseBuffer(Buffer buf){
 	free(buf.data);
 }
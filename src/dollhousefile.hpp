@@ -13,11 +13,19 @@
 #include <string.h>
 
 #include <unistd.h>
-
+#include <fcntl.h>
+#include <errno.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 
 
 #define DOLLHOUSE_SANDBOX_DIR "dollhouse_sandbox/"
+#define DH_FILE_BUFFER (1<<16) // bytes a file handle buffers before it writes them
+#define DH_FILE_FLUSH_MS 200   // the longest buffered bytes wait before they are written
+#define DH_FILE_HANDLES 32     // the most files that stay open for appending
+#define DH_IO_THREADS 4        // the threads that do the file operations submitted with DH_submit()
+
+void notifyScheduler();
 
 
 
@@ -26,59 +34,269 @@ int IsInSandbox(const char* filename){
 }
 
 
+// how a daemon uses a file it called dibs on. CAN_FILL writes it, the other modes only read it: DONT_CARE does without
+// it if it does not exist, WANTED and NEEDED do not, NEEDED cannot run without it.
 enum DIBS_MODES{DONT_CARE, CAN_FILL, WANTED, NEEDED};
+const char *DIBS_MODE_NAMES[] = {"dont-care", "can-fill", "wanted", "needed"};
+
+// a file that daemons called dibs on. it is mapped once, and the daemons share its pages, see DH_call_dibs().
+typedef struct SharedBuffer{
+	char filename[DH_FILENAME_LEN];
+	int fd;
+	size_t len;
+	char *read, *write; // a read-only and a writable view of the same pages, write is mapped for the first CAN_FILL dibs
+	unsigned int refs;  // the number of dibs on the file
+	uint64_t version;   // the number of changes published to the file, see DH_publish()
+	struct SharedBuffer *next;
+}SharedBuffer;
+
 typedef struct Dibs{
 	char filename[DH_FILENAME_LEN]; // DH file operations make a file buffer. This identifies the same file across two processes.
-	void *start;
+	void *start;  // the view of the file for mode, NULL if it is empty
 	size_t len;
 	DIBS_MODES mode;
+	SharedBuffer *shared;
 }Dibs;
 
+SharedBuffer *sharedBuffers = nullptr; // the files daemons called dibs on
+pthread_mutex_t dibsLock = PTHREAD_MUTEX_INITIALIZER;
+
+// a file that stays open for appending, see DH_append(). appended bytes are buffered and written behind, in one write:
+// when the buffer is full, when they waited DH_FILE_FLUSH_MS, see DH_flush_files(), or when the file is synced.
+typedef struct FileHandle{
+	char filename[DH_FILENAME_LEN];
+	int fd;
+	char *buf;
+	size_t len;
+	uint64_t dirty_at; // the monotonic time in ms at which the first buffered byte was appended, 0 if none is buffered
+	struct FileHandle *next;
+}FileHandle;
+
+enum IO_OPS{IO_READ, IO_WRITE, IO_APPEND};
+// a file operation that an I/O thread does, see DH_submit().
+typedef struct IORequest{
+	uint8_t op;          // IO_OPS
+	char filename[DH_FILENAME_LEN];
+	Buffer buf;          // the bytes to write, which are freed with the request, or the bytes read
+	int result;          // 0, or -1 if the operation failed
+	void (*done)(struct IORequest*); // called on the I/O thread when the operation is done
+	uint64_t owner;      // the handle of the daemon that submitted it
+	unsigned int slot;   // of its caller
+	struct IORequest *next;
+}IORequest;
+
+FileHandle *fileHandles = nullptr; // the most recently used first
+unsigned int fileHandleNum = 0;
+pthread_mutex_t fileLock = PTHREAD_MUTEX_INITIALIZER; // guards the file handles and their buffers
+
+
+
+// write len bytes of data to fd, returns -1 if they cannot all be written.
+int DH_write_all(int fd, const char *data, size_t len){
+	while(len){
+		ssize_t k = write(fd, data, len);
+		if(k<0 && errno==EINTR) continue;
+		if(k<=0) return -1;
+		data += k;
+		len -= k;
+	}
+	return 0;
+}
+
+// write the buffered bytes of file handle f. the caller holds fileLock. bytes that cannot be written are dropped.
+int DH_flush_handle(FileHandle *f){
+	int r = DH_write_all(f->fd, f->buf, f->len);
+	f->len = 0;
+	f->dirty_at = 0;
+	return r;
+}
+
+// flush and close the file handle *p, and remove it from the file handles. the caller holds fileLock.
+int DH_close_handle(FileHandle **p){
+	FileHandle *f = *p;
+	int r = DH_flush_handle(f);
+	*p = f->next;
+	fileHandleNum--;
+	close(f->fd);
+	free(f->buf);
+	free(f);
+	return r;
+}
+
+// the link to the file handle of file <filename>, or to the nullptr at the end of the file handles. the caller holds
+// fileLock.
+FileHandle **DH_find_handle(const char *filename){
+	FileHandle **p;
+	for(p=&fileHandles; *p && strncmp((*p)->filename, filename, DH_FILENAME_LEN)!=0; p=&(*p)->next)
+		continue;
+	return p;
+}
+
+// the file handle of file <filename>, which is opened for appending if it is not open, and is moved to the front. the
+// least recently used file handle is closed if there are more than DH_FILE_HANDLES. the caller holds fileLock.
+FileHandle *DH_handle(const char *filename){
+	FileHandle **p = DH_find_handle(filename), *f = *p;
+	if(f){
+		*p = f->next;
+	}else{
+		int fd = open(filename, O_WRONLY|O_CREAT|O_APPEND, 0644);
+		if(fd<0) return nullptr;
+		if(fileHandleNum == DH_FILE_HANDLES){
+			for(p=&fileHandles; (*p)->next; p=&(*p)->next)
+				continue;
+			DH_close_handle(p);
+		}
+		f = (FileHandle*)calloc(1, sizeof(FileHandle));
+		strncpy(f->filename, filename, DH_FILENAME_LEN-1);
+		f->fd = fd;
+		f->buf = (char*)malloc(DH_FILE_BUFFER);
+		fileHandleNum++;
+	}
+	f->next = fileHandles;
+	fileHandles = f;
+	return f;
+}
 
+// write the buffered bytes of file <filename>, or of all files if it is nullptr. returns -1 if they cannot be written.
+int DH_sync(const char *filename){
+	int r = 0;
+	pthread_mutex_lock(&fileLock);
+	for(FileHandle *f=fileHandles; f; f=f->next)
+		if(f->len && (!filename || strncmp(f->filename, filename, DH_FILENAME_LEN)==0))
+			r |= DH_flush_handle(f);
+	pthread_mutex_unlock(&fileLock);
+	return r;
+}
+
+void DH_sync_files(){
+	DH_sync(nullptr);
+}
+
+// write the buffers of the file handles whose bytes waited DH_FILE_FLUSH_MS at monotonic time now. returns the time at
+// which the next buffer is due, 0 if nothing is buffered.
+uint64_t DH_flush_files(uint64_t now){
+	uint64_t next = 0;
+	pthread_mutex_lock(&fileLock);
+	for(FileHandle *f=fileHandles; f; f=f->next){
+		if(!f->dirty_at) continue;
+		if(f->dirty_at+DH_FILE_FLUSH_MS <= now) DH_flush_handle(f);
+		else if(next==0 || f->dirty_at+DH_FILE_FLUSH_MS < next) next = f->dirty_at+DH_FILE_FLUSH_MS;
+	}
+	pthread_mutex_unlock(&fileLock);
+	return next;
+}
 
+// flush and close the file handle of file <filename>. returns -1 if it is not open or its bytes cannot be written.
+int DH_close_file(const char *filename){
+	pthread_mutex_lock(&fileLock);
+	FileHandle **p = DH_find_handle(filename);
+	int r = *p ? DH_close_handle(p) : -1;
+	pthread_mutex_unlock(&fileLock);
+	return r;
+}
+
+
+
+// read file <filename>. a regular file is mapped read-only, a pipe or a file that cannot be mapped is read with read().
+// the data is followed by a 0 that is not part of the size, and is released with DH_release(). the data is NULL if the
+// file cannot be read.
 Buffer DH_read(const char* filename){
-	if(IsInSandbox(filename)){
-		Buffer new_buffer={0};
-		FILE *fp = fopen(filename, "r");
-		if(fp==nullptr){
-			Buffer failed_buffer={0};
-			failed_buffer.size=0;
-			return failed_buffer;
+	Buffer new_buffer={0};
+	if(!IsInSandbox(filename)) return new_buffer;
+	DH_sync(filename); // read what was appended to it
+	int fd = open(filename, O_RDONLY);
+	if(fd<0) return new_buffer;
+
+	struct stat st;
+	if(fstat(fd, &st)==0 && S_ISREG(st.st_mode)){
+		size_t size = st.st_size;
+		// map the file over size+1 bytes of zeros, so a 0 follows it even when it ends at the end of a page
+		char *data = (char*)mmap(nullptr, size+1, PROT_READ, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if(data!=MAP_FAILED && (size==0 || mmap(data, size, PROT_READ, MAP_PRIVATE|MAP_FIXED, fd, 0)!=MAP_FAILED)){
+			close(fd);
+			new_buffer.data = data;
+			new_buffer.size = size;
+			return new_buffer;
 		}
-		struct stat st;
-		stat(filename, &st);
-		unsigned int size = st.st_size;
-		new_buffer.size = size;
-		new_buffer.data = (char*)calloc(sizeof(char), size);
-		fread(new_buffer.data, sizeof(char), size, fp);
-		fclose(fp);
-		return new_buffer;
-	} else{
-		Buffer failed_buffer={0};
-		failed_buffer.size=0;
-		return failed_buffer;
+		if(data!=MAP_FAILED) munmap(data, size+1);
 	}
+
+	size_t size = 0, cap = 1<<16;
+	char *data = (char*)mmap(nullptr, cap, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	while(data!=MAP_FAILED){
+		ssize_t k = read(fd, data+size, cap-size-1);
+		if(k<0 && errno==EINTR) continue;
+		if(k<=0) break;
+		size += k;
+		if(size+1==cap){
+			data = (char*)mremap(data, cap, 2*cap, MREMAP_MAYMOVE);
+			cap *= 2;
+		}
+	}
+	close(fd);
+	if(data==MAP_FAILED) return new_buffer;
+	new_buffer.data = (char*)mremap(data, cap, size+1, 0); // shrinks in place
+	new_buffer.size = size;
+	return new_buffer;
 };
 
+// release the data of a buffer that DH_read() returned.
+void DH_release(Buffer buf){
+	if(buf.data) munmap(buf.data, buf.size+1);
+}
+
+// replace the contents of file <filename> with buf. the bytes appended to it that are still buffered are dropped. buf is
+// written to a new file that is renamed over <filename>, so the mappings of DH_read() keep the contents they mapped.
 int DH_write(const char* filename, Buffer buf){
 	if(IsInSandbox(filename)){
-		FILE *fp =fopen(filename, "w");
-		if(fp==NULL) return -1;
-		fwrite(buf.data, sizeof(char), buf.size, fp);
-		fclose(fp);
-		return 0;
+		char tmp[DH_FILENAME_LEN+8];
+		struct stat st;
+		snprintf(tmp, sizeof(tmp), "%s.XXXXXX", filename);
+		pthread_mutex_lock(&fileLock);
+		FileHandle **p = DH_find_handle(filename);
+		if(*p){ // the handle appends to the file that is replaced
+			(*p)->len = 0;
+			DH_close_handle(p);
+		}
+		int fd = mkstemp(tmp), r = -1;
+		if(fd>=0){
+			r = fchmod(fd, stat(filename, &st)==0 ? st.st_mode&07777 : 0644) | DH_write_all(fd, buf.data, buf.size);
+			close(fd);
+			if(r==0) r = rename(tmp, filename);
+			if(r!=0) unlink(tmp);
+		}
+		pthread_mutex_unlock(&fileLock);
+		return r;
 	} else{
 		return -1;
 	}
 }
 
+// append buf to file <filename> through its file handle. the bytes are buffered, and are written when the buffer is full
+// or DH_FILE_FLUSH_MS later, see DH_flush_files(), or when the file is synced, read or closed.
 int DH_append(const char* filename, Buffer buf){
 	if(IsInSandbox(filename)){
-		FILE *fp =fopen(filename, "a");
-		if(fp==NULL) return -1;
-		fwrite(buf.data, sizeof(char), buf.size, fp);
-		fclose(fp);
-		return 0;
+		int r = 0, timer = 0;
+		pthread_mutex_lock(&fileLock);
+		FileHandle *f = DH_handle(filename);
+		if(!f){
+			r = -1;
+		}else{
+			if(f->len+buf.size > DH_FILE_BUFFER) r = DH_flush_handle(f); // the buffer is written first
+			if(buf.size >= DH_FILE_BUFFER){ // too many bytes to buffer
+				r |= DH_write_all(f->fd, buf.data, buf.size);
+			}else if(buf.size){
+				memcpy(f->buf+f->len, buf.data, buf.size);
+				f->len += buf.size;
+				if(!f->dirty_at){
+					f->dirty_at = monotonicMs();
+					timer = 1;
+				}
+			}
+		}
+		pthread_mutex_unlock(&fileLock);
+		if(timer) notifyScheduler(); // the main thread waits for the buffer to be due
+		return r;
 	} else {
 		return -1;
 	}
@@ -112,10 +330,155 @@ int DH_alias(const char *filename, const char *alias){
 
 
 
-int DH_call_dibs(){
+// map file <filename> shared for the first dibs on it, creating it and extending it to len bytes for CAN_FILL. the caller
+// holds dibsLock. returns nullptr if it cannot be mapped.
+SharedBuffer *DH_share(const char *filename, DIBS_MODES mode, size_t len){
+	struct stat st;
+	int fd = open(filename, mode==CAN_FILL ? O_RDWR|O_CREAT : O_RDWR, 0644);
+	if(fd<0 && mode!=CAN_FILL) fd = open(filename, O_RDONLY);
+	if(fd<0) return nullptr;
+	if(fstat(fd, &st)!=0 || !S_ISREG(st.st_mode) || (mode==CAN_FILL && len>(size_t)st.st_size && ftruncate(fd, len)!=0)){
+		close(fd);
+		return nullptr;
+	}
+	if(mode!=CAN_FILL || len<(size_t)st.st_size) len = st.st_size;
+	char *read = len ? (char*)mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, 0) : nullptr;
+	if(read==MAP_FAILED){
+		close(fd);
+		return nullptr;
+	}
+	SharedBuffer *shared = (SharedBuffer*)calloc(1, sizeof(SharedBuffer));
+	strncpy(shared->filename, filename, DH_FILENAME_LEN-1);
+	shared->fd = fd;
+	shared->len = len;
+	shared->read = read;
+	shared->next = sharedBuffers;
+	sharedBuffers = shared;
+	return shared;
+}
+
+// release the dibs on a shared buffer, which is unmapped when its last dibs is released. the caller holds dibsLock.
+void DH_unshare(SharedBuffer *shared){
+	SharedBuffer **p;
+	if(--shared->refs) return;
+	for(p=&sharedBuffers; *p!=shared; p=&(*p)->next)
+		continue;
+	*p = shared->next;
+	if(shared->read) munmap(shared->read, shared->len);
+	if(shared->write) munmap(shared->write, shared->len);
+	close(shared->fd);
+	free(shared);
+}
+
+// call dibs on file dibs->filename in dibs->mode. all daemons that call dibs on a file share one mapping of it, instead of
+// each reading and copying it. CAN_FILL creates the file if it does not exist, extends it to dibs->len bytes if it is
+// shorter and nobody else has dibs on it, and maps it writable. the other modes map it read-only, so writing to it faults.
+// sets dibs->start and dibs->len to the view of the file and returns 0, or returns -1 if the file cannot be mapped. a
+// DONT_CARE dibs on a file that cannot be mapped gets an empty view. release the dibs with DH_release_dibs().
+int DH_call_dibs(Dibs *dibs){
+	SharedBuffer *shared;
+	dibs->start = nullptr;
+	dibs->shared = nullptr;
+	if(!IsInSandbox(dibs->filename)) return -1;
+	DH_sync(dibs->filename); // map what was appended to it
+	pthread_mutex_lock(&dibsLock);
+	for(shared=sharedBuffers; shared && strncmp(shared->filename, dibs->filename, DH_FILENAME_LEN)!=0; shared=shared->next)
+		continue;
+	if(!shared) shared = DH_share(dibs->filename, dibs->mode, dibs->len);
+	if(shared && dibs->mode==CAN_FILL && !shared->write && shared->len){ // fails if the file is read-only
+		shared->write = (char*)mmap(nullptr, shared->len, PROT_READ|PROT_WRITE, MAP_SHARED, shared->fd, 0);
+		if(shared->write==MAP_FAILED){
+			shared->write = nullptr;
+			shared->refs++;
+			DH_unshare(shared);
+			shared = nullptr;
+		}
+	}
+	if(shared) shared->refs++;
+	pthread_mutex_unlock(&dibsLock);
+
+	dibs->len = 0;
+	if(!shared) return dibs->mode==DONT_CARE ? 0 : -1;
+	dibs->start = dibs->mode==CAN_FILL ? shared->write : shared->read;
+	dibs->len = shared->len;
+	dibs->shared = shared;
 	return 0;
 }
 
+// release dibs, the file is unmapped when the last dibs on it is released.
+void DH_release_dibs(Dibs *dibs){
+	if(!dibs->shared) return;
+	pthread_mutex_lock(&dibsLock);
+	DH_unshare(dibs->shared);
+	pthread_mutex_unlock(&dibsLock);
+	dibs->shared = nullptr;
+	dibs->start = nullptr;
+	dibs->len = 0;
+}
+
+// publish the changes a CAN_FILL dibs made to its file: the version of the file counts up, and a daemon that reads the new
+// version with DH_dibs_version() sees the changes made before it. returns the new version, or 0 if dibs cannot write.
+uint64_t DH_publish(Dibs *dibs){
+	if(dibs->mode!=CAN_FILL || !dibs->shared) return 0;
+	return __atomic_add_fetch(&dibs->shared->version, 1, __ATOMIC_RELEASE);
+}
+
+// the number of changes published to the file of dibs.
+uint64_t DH_dibs_version(Dibs *dibs){
+	return dibs->shared ? __atomic_load_n(&dibs->shared->version, __ATOMIC_ACQUIRE) : 0;
+}
+
+
+
+IORequest *ioQueue = nullptr, **ioTail = &ioQueue; // the submitted file operations, the first submitted first
+pthread_mutex_t ioLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t ioSubmitted = PTHREAD_COND_INITIALIZER;
+pthread_once_t ioOnce = PTHREAD_ONCE_INIT;
+
+// an I/O thread: do the submitted file operations, the blocking reads and writes of the daemons.
+void *DH_io_thread(void*){
+	while(1){
+		pthread_mutex_lock(&ioLock);
+		while(!ioQueue) pthread_cond_wait(&ioSubmitted, &ioLock);
+		IORequest *req = ioQueue;
+		if(!(ioQueue = req->next)) ioTail = &ioQueue;
+		pthread_mutex_unlock(&ioLock);
+		switch(req->op){
+			case IO_READ:   req->buf = DH_read(req->filename); req->result = req->buf.data ? 0 : -1; break;
+			case IO_WRITE:  req->result = DH_write(req->filename, req->buf); break;
+			case IO_APPEND: req->result = DH_append(req->filename, req->buf); break;
+		}
+		req->done(req);
+	}
+	return nullptr;
+}
+
+void DH_start_io(){
+	for(int k=0; k<DH_IO_THREADS; k++){
+		pthread_t thread;
+		pthread_create(&thread, nullptr, DH_io_thread, nullptr);
+		pthread_detach(thread);
+	}
+}
+
+// submit file operation req to the I/O threads, which call req->done when it is done. they are started by the first.
+void DH_submit(IORequest *req){
+	pthread_once(&ioOnce, DH_start_io);
+	req->next = nullptr;
+	pthread_mutex_lock(&ioLock);
+	*ioTail = req;
+	ioTail = &req->next;
+	pthread_cond_signal(&ioSubmitted);
+	pthread_mutex_unlock(&ioLock);
+}
+
+// free a file operation that is done, and its bytes.
+void DH_finish(IORequest *req){
+	if(req->op==IO_READ) DH_release(req->buf);
+	else free(req->buf.data);
+	free(req);
+}
+
 
 
 // too complicated and has minimal benefit.
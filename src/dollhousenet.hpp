@@ -0,0 +1,666 @@
+/*
+ * dollhousenet.hpp
+ *
+ *  Created on: Oct 16, 2026
+ *      Author: stingpie
+ */
+
+#ifndef DOLLHOUSENET_HPP_
+#define DOLLHOUSENET_HPP_
+
+#include "dollhouse.hpp"
+#include <string.h>
+#include <stdlib.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+
+
+#define DH_FRAGMENTS_MAX UINT16_MAX      // the most frames a message is sent in, DH_MESSAGE_DATA bytes each, about 12 MB
+#define DH_REASSEMBLY_TIMEOUT_MS 5000    // an incomplete message is dropped when none of its fragments arrived for this long
+#define DH_REASSEMBLY_BYTES (64<<20)     // the most bytes a reassembler allocates for the messages it collects
+#define DH_REASSEMBLY_BUCKETS 64         // initial number of buckets of the messages a reassembler collects, a power of two
+#define DH_PEER_BATCH 64                 // the most frames a peer sends with one sendmmsg() or receives with one recvmmsg()
+#define DH_PEER_BUFFER (1<<16)           // the bytes a stream peer reads at once
+#define DH_PEER_QUEUE 4096               // the frames queued to a peer above which the interlinks to it are not drained
+#define DH_PEER_SOCKET_BUFFER (1<<20)    // the bytes the kernel buffers for a peer, each way
+#define DH_PEER_ROUNDS 16                // the most batches a peer receives before the main loop serves the others
+
+
+
+// the number of frames a payload of len bytes is sent in, 0 if it is too large.
+uint32_t fragmentCount(size_t len){
+	size_t n = len ? (len+DH_MESSAGE_DATA-1)/DH_MESSAGE_DATA : 1;
+	return n <= DH_FRAGMENTS_MAX ? (uint32_t)n : 0;
+}
+
+// make frames first to first+n-1 of message head, whose payload is len bytes at payload, for a transport to send. frame k
+// is the header of head with idx k and total fragmentCount(len), and the bytes [k*DH_MESSAGE_DATA, (k+1)*DH_MESSAGE_DATA)
+// of the payload. headers[k-first] gets its header, iov[2*(k-first)] the iovec of the header and iov[2*(k-first)+1] the
+// iovec of its bytes in the payload, which are not copied. returns the number of frames made, fewer than n at the end.
+uint32_t fragmentMessage(const Message *head, const char *payload, size_t len, uint32_t first, uint32_t n, Message *headers,
+                         struct iovec *iov){
+	uint32_t total = fragmentCount(len), k;
+	for(k=0; k<n && first+k<total; k++){
+		size_t offset = (size_t)(first+k)*DH_MESSAGE_DATA;
+		memcpy(&headers[k], head, DH_MESSAGE_HEADER);
+		headers[k].idx = first+k;
+		headers[k].total = total;
+		iov[2*k].iov_base = &headers[k];
+		iov[2*k].iov_len = DH_MESSAGE_HEADER;
+		iov[2*k+1].iov_base = (void*)(payload+offset);
+		iov[2*k+1].iov_len = len-offset < DH_MESSAGE_DATA ? len-offset : DH_MESSAGE_DATA;
+	}
+	return k;
+}
+
+
+
+// a message whose fragments a reassembler collects, see reassemble().
+typedef struct Reassembly{
+	Message head;        // the header of its frames, the data is not used
+	char *data;          // its payload, total*DH_MESSAGE_DATA bytes that are allocated when its first fragment arrives
+	size_t len;          // the bytes of its payload, known when its last fragment arrived
+	uint16_t total, received;
+	uint64_t *have;      // a bit for each fragment that arrived
+	uint64_t expires;    // the monotonic time in ms at which it is dropped unless another fragment arrives
+	struct Reassembly *next;
+}Reassembly;
+
+// the messages that are being reassembled from the frames that arrive from peers, in a hash table keyed on their srcID and
+// msgID. a reassembler is used by one thread.
+typedef struct Reassembler{
+	Reassembly **buckets;
+	uint32_t bucket_num, num;
+	size_t bytes;        // allocated for the payloads of the messages it collects
+	Slab slab;           // of its Reassembly
+	uint64_t completed, expired, refused, duplicates;
+}Reassembler;
+
+void initReassembler(Reassembler *r){
+	memset(r, 0, sizeof(Reassembler));
+	r->slab.size = sizeof(Reassembly);
+	r->bucket_num = DH_REASSEMBLY_BUCKETS;
+	r->buckets = (Reassembly**)calloc(r->bucket_num, sizeof(Reassembly*));
+}
+
+// FNV-1a hash of the srcID and msgID of a message, its key in a reassembler.
+uint64_t messageKey(const char *srcID, const char *msgID){
+	uint64_t h = 14695981039346656037ULL;
+	for(int k=0; k<DH_ID_LEN; k++) h = (h ^ (uint8_t)srcID[k]) * 1099511628211ULL;
+	for(int k=0; k<DH_ID_LEN; k++) h = (h ^ (uint8_t)msgID[k]) * 1099511628211ULL;
+	return h;
+}
+
+// the link to the message of r with srcID and msgID, or to the nullptr at the end of its chain.
+Reassembly **findReassembly(Reassembler *r, const char *srcID, const char *msgID){
+	Reassembly **p = &r->buckets[messageKey(srcID, msgID) & (r->bucket_num-1)];
+	while(*p && (memcmp((*p)->head.srcID, srcID, DH_ID_LEN)!=0 || memcmp((*p)->head.msgID, msgID, DH_ID_LEN)!=0))
+		p = &(*p)->next;
+	return p;
+}
+
+// free a message that reassemble() returned, or that expired. the caller keeps its payload if it sets data to nullptr.
+void freeReassembly(Reassembler *r, Reassembly *m){
+	free(m->data);
+	free(m->have);
+	slabFree(&r->slab, m);
+}
+
+// collect frame, size bytes of a message that arrived at monotonic time now in ms. the fragments of a message may arrive
+// in any order, each is copied into its place in the payload. returns the message when all of its fragments arrived, its
+// header and its payload, which the caller frees with freeReassembly(). returns nullptr while fragments are missing, and
+// for a frame that is malformed or a duplicate, or that starts a message with more bytes than r has room for. a duplicate
+// that arrives after its message is complete starts the message again, which then expires.
+Reassembly *reassemble(Reassembler *r, const Message *frame, size_t size, uint64_t now){
+	size_t n = size-DH_MESSAGE_HEADER;
+	if(size < DH_MESSAGE_HEADER || size > sizeof(Message) || frame->idx >= frame->total ||
+	   (frame->idx < frame->total-1 && n != DH_MESSAGE_DATA)){ // only the last fragment is short
+		r->refused++;
+		return nullptr;
+	}
+	if(r->num >= r->bucket_num){ // grow to twice as many buckets, and rehash the chains
+		uint32_t buckets = 2*r->bucket_num;
+		Reassembly **index = (Reassembly**)calloc(buckets, sizeof(Reassembly*));
+		for(uint32_t b=0; b<r->bucket_num; b++){
+			for(Reassembly *m=r->buckets[b], *next; m; m=next){
+				next = m->next;
+				uint64_t key = messageKey(m->head.srcID, m->head.msgID) & (buckets-1);
+				m->next = index[key];
+				index[key] = m;
+			}
+		}
+		free(r->buckets);
+		r->buckets = index;
+		r->bucket_num = buckets;
+	}
+
+	Reassembly **p = findReassembly(r, frame->srcID, frame->msgID), *m = *p;
+	if(!m){ // its first fragment, allocate its payload
+		size_t bytes = (size_t)frame->total*DH_MESSAGE_DATA;
+		if(r->bytes+bytes > DH_REASSEMBLY_BYTES){
+			r->refused++;
+			return nullptr;
+		}
+		m = *p = (Reassembly*)slabAlloc(&r->slab);
+		memcpy(&m->head, frame, DH_MESSAGE_HEADER);
+		m->total = frame->total;
+		m->data = (char*)malloc(bytes);
+		m->have = (uint64_t*)calloc((m->total+63)/64, sizeof(uint64_t));
+		r->bytes += bytes;
+		r->num++;
+	}
+	if(frame->total != m->total){
+		r->refused++;
+		return nullptr;
+	}
+	if(m->have[frame->idx/64] & 1ull<<(frame->idx%64)){
+		r->duplicates++;
+		return nullptr;
+	}
+	m->have[frame->idx/64] |= 1ull<<(frame->idx%64);
+	memcpy(m->data+(size_t)frame->idx*DH_MESSAGE_DATA, frame->data, n);
+	if(frame->idx == m->total-1) m->len = (size_t)frame->idx*DH_MESSAGE_DATA+n;
+	m->expires = now+DH_REASSEMBLY_TIMEOUT_MS;
+	if(++m->received < m->total) return nullptr;
+
+	*p = m->next; // complete
+	r->bytes -= (size_t)m->total*DH_MESSAGE_DATA;
+	r->num--;
+	r->completed++;
+	return m;
+}
+
+// drop the messages of r that expired at monotonic time now in ms. returns the time at which the next one expires, 0 if r
+// collects none.
+uint64_t expireReassemblies(Reassembler *r, uint64_t now){
+	uint64_t next = 0;
+	for(uint32_t b=0; b<r->bucket_num; b++){
+		Reassembly **p = &r->buckets[b];
+		while(*p){
+			Reassembly *m = *p;
+			if(m->expires <= now){
+				*p = m->next;
+				r->bytes -= (size_t)m->total*DH_MESSAGE_DATA;
+				r->num--;
+				r->expired++;
+				freeReassembly(r, m);
+				continue;
+			}
+			if(next==0 || m->expires < next) next = m->expires;
+			p = &m->next;
+		}
+	}
+	return next;
+}
+
+
+// a free reassembler, with the messages it still collects.
+void freeReassembler(Reassembler *r){
+	expireReassemblies(r, UINT64_MAX);
+	free(r->buckets);
+	for(uint32_t k=0; k<r->slab.len/DH_SLAB_CHUNK; k++) free(r->slab.chunks[k]);
+	free(r->slab.chunks);
+	free(r->slab.free);
+}
+
+
+
+// a SOCK_SEQPACKET socket keeps the frames apart, a stream sends each frame after its length in 2 bytes. a stream takes
+// fewer syscalls and copies for small frames, the kernel queues each packet separately.
+enum PEER_KINDS{PEER_SEQPACKET, PEER_STREAM};
+
+// a message that is queued to a peer, which owns its payload.
+typedef struct OutMessage{
+	Message head;
+	char *payload;
+	size_t len;
+	uint32_t sent, total; // frames
+	struct OutMessage *next;
+}OutMessage;
+
+// a connection to another dollhouse on this machine, or a socket that accepts them. peers are found by their handle, the
+// main thread receives from them and closes them, any thread sends to them, see peerSend(). epoll tells the main thread
+// once when a connection becomes readable or writable, it reads until the socket is empty unless the messages it
+// received are stalled.
+typedef struct Peer{
+	int fd, epoll;
+	uint8_t kind, listening;
+	uint8_t waiting;                  // for the socket to be writable, the frames queued to it are sent then
+	uint8_t readable;                 // the socket may have frames that were not read
+	pthread_mutex_t lock;             // of the messages queued to it, and of waiting
+	OutMessage *out, **out_tail;
+	uint32_t out_frames;
+	size_t partial;                   // the bytes of the first frame a stream peer queued that are written
+	uint64_t msg_seq;                 // the last msgID it gave a message
+	Reassembler reassembler;
+	char *in;                         // the bytes a stream peer read that are not a whole frame yet
+	size_t in_len;
+	Reassembly *stalled, **stalled_tail; // the messages that arrived that peerReceive could not take yet, in order
+	uint64_t frames_sent, frames_received, messages_sent, messages_received;
+	Handle handle;
+}Peer;
+
+Slab peerSlab = {sizeof(Peer)};
+pthread_mutex_t peerLock = PTHREAD_MUTEX_INITIALIZER; // of peerSlab
+
+// drop a message that arrived from a peer.
+int dropPeerMessage(Peer *peer, Reassembly *m){
+	freeReassembly(&peer->reassembler, m);
+	return 1;
+}
+
+// called by the main thread with each message that arrives from a peer, which it frees with freeReassembly(). it returns
+// 0 when it cannot take the message yet: the peer stops reading, and passes it again in the next cycle.
+int (*peerReceive)(Peer*, Reassembly*) = dropPeerMessage;
+
+void ignorePeer(Peer*){}
+
+// called by the main thread when it connected a peer to another dollhouse, or accepted one.
+void (*peerConnected)(Peer*) = ignorePeer;
+
+// parse address, "unix:<path>", "unixpacket:<path>" or "tcp:[<host>:]<port>", the host defaults to 127.0.0.1. a unix
+// peer is a stream, a unixpacket peer sends its frames as packets. returns 0 on success.
+int peerAddress(const char *address, struct sockaddr_storage *sa, socklen_t *sa_len, uint8_t *kind){
+	memset(sa, 0, sizeof(*sa));
+	if(strncmp(address, "unix:", 5)==0 || strncmp(address, "unixpacket:", 11)==0){
+		struct sockaddr_un *un = (struct sockaddr_un*)sa;
+		const char *path = strchr(address, ':')+1;
+		if(strlen(path) >= sizeof(un->sun_path)) return -1;
+		un->sun_family = AF_UNIX;
+		strcpy(un->sun_path, path);
+		*sa_len = sizeof(struct sockaddr_un);
+		*kind = address[4]==':' ? PEER_STREAM : PEER_SEQPACKET;
+		return 0;
+	}
+	if(strncmp(address, "tcp:", 4)==0){
+		struct sockaddr_in *in = (struct sockaddr_in*)sa;
+		char host[64] = "127.0.0.1";
+		const char *port = strrchr(address+4, ':');
+		if(port){
+			if((size_t)(port-address-4) >= sizeof(host)) return -1;
+			memcpy(host, address+4, port-address-4);
+			host[port-address-4] = 0;
+			port++;
+		}else port = address+4;
+		in->sin_family = AF_INET;
+		in->sin_port = htons((uint16_t)atoi(port));
+		if(inet_pton(AF_INET, host, &in->sin_addr)!=1) return -1;
+		*sa_len = sizeof(struct sockaddr_in);
+		*kind = PEER_STREAM;
+		return 0;
+	}
+	return -1;
+}
+
+// a new peer on the nonblocking socket fd, the main thread is told about it through epoll.
+Peer *newPeer(int epoll, int fd, uint8_t kind, uint8_t listening){
+	pthread_mutex_lock(&peerLock);
+	Peer *peer = (Peer*)slabAlloc(&peerSlab);
+	peer->handle = slabHandle(peer);
+	pthread_mutex_unlock(&peerLock);
+	peer->fd = fd;
+	peer->epoll = epoll;
+	peer->kind = kind;
+	peer->listening = listening;
+	pthread_mutex_init(&peer->lock, nullptr);
+	peer->out_tail = &peer->out;
+	peer->stalled_tail = &peer->stalled;
+	if(!listening){
+		int bytes = DH_PEER_SOCKET_BUFFER;
+		setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bytes, sizeof(bytes));
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bytes, sizeof(bytes));
+		initReassembler(&peer->reassembler);
+		if(kind==PEER_STREAM){
+			int one = 1;
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); // the frames are batched already, no-op for unix
+			peer->in = (char*)malloc(DH_PEER_BUFFER);
+		}
+	}
+	struct epoll_event ev = {0};
+	ev.events = listening ? EPOLLIN : EPOLLIN | EPOLLOUT | EPOLLET;
+	ev.data.u64 = peer->handle; // a handle, an event that arrives after the peer closed finds nothing
+	peer->readable = !listening; // frames may have arrived before it was added
+	epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &ev);
+	if(!listening) peerConnected(peer);
+	return peer;
+}
+
+// accept the peers that connect to address, see peerAddress(). returns the handle of the listening peer, 0 on failure.
+Handle listenPeers(int epoll, const char *address){
+	struct sockaddr_storage sa;
+	socklen_t sa_len;
+	uint8_t kind;
+	if(peerAddress(address, &sa, &sa_len, &kind)!=0) return 0;
+	int fd = socket(sa.ss_family, (kind==PEER_SEQPACKET ? SOCK_SEQPACKET : SOCK_STREAM) | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(fd<0) return 0;
+	int one = 1;
+	if(sa.ss_family==AF_UNIX) unlink(((struct sockaddr_un*)&sa)->sun_path); // left behind by an earlier dollhouse
+	else setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if(bind(fd, (struct sockaddr*)&sa, sa_len)!=0 || listen(fd, SOMAXCONN)!=0){
+		close(fd);
+		return 0;
+	}
+	return newPeer(epoll, fd, kind, 1)->handle;
+}
+
+// connect to the dollhouse that listens on address, see peerAddress(). returns the handle of the peer, 0 on failure.
+Handle connectPeer(int epoll, const char *address){
+	struct sockaddr_storage sa;
+	socklen_t sa_len;
+	uint8_t kind;
+	if(peerAddress(address, &sa, &sa_len, &kind)!=0) return 0;
+	int fd = socket(sa.ss_family, (kind==PEER_SEQPACKET ? SOCK_SEQPACKET : SOCK_STREAM) | SOCK_CLOEXEC, 0);
+	if(fd<0) return 0;
+	if(connect(fd, (struct sockaddr*)&sa, sa_len)!=0){ // local, it does not block for long
+		close(fd);
+		return 0;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	return newPeer(epoll, fd, kind, 0)->handle;
+}
+
+// n frames at the head of the queue of peer were sent, free the messages that are sent completely.
+void peerSent(Peer *peer, uint32_t n){
+	peer->frames_sent += n;
+	peer->out_frames -= n;
+	while(n){
+		OutMessage *m = peer->out;
+		uint32_t k = m->total-m->sent < n ? m->total-m->sent : n;
+		m->sent += k;
+		n -= k;
+		if(m->sent < m->total) break;
+		peer->out = m->next;
+		if(!peer->out) peer->out_tail = &peer->out;
+		peer->messages_sent++;
+		free(m->payload);
+		free(m);
+	}
+}
+
+// send the frames queued to peer, DH_PEER_BATCH at a time, the caller holds its lock. returns 0 when all are sent, 1 when
+// the socket is full, -1 when the connection is broken.
+int flushPeer(Peer *peer){
+	Message headers[DH_PEER_BATCH];
+	struct iovec iov[3*DH_PEER_BATCH];
+	while(peer->out){
+		uint32_t n = 0;
+		for(OutMessage *m=peer->out; m && n<DH_PEER_BATCH; m=m->next)
+			n += fragmentMessage(&m->head, m->payload, m->len, m->sent, DH_PEER_BATCH-n, headers+n, iov+2*n);
+
+		if(peer->kind==PEER_SEQPACKET){ // a frame for each message of sendmmsg()
+			struct mmsghdr msgs[DH_PEER_BATCH];
+			memset(msgs, 0, sizeof(struct mmsghdr)*n);
+			for(uint32_t k=0; k<n; k++){
+				msgs[k].msg_hdr.msg_iov = &iov[2*k];
+				msgs[k].msg_hdr.msg_iovlen = 2;
+			}
+			int sent = sendmmsg(peer->fd, msgs, n, MSG_DONTWAIT | MSG_NOSIGNAL);
+			if(sent<0) return errno==EAGAIN || errno==EWOULDBLOCK ? 1 : errno==EINTR ? 0 : -1;
+			peerSent(peer, sent);
+			if((uint32_t)sent < n) return 1;
+			continue;
+		}
+
+		// a stream: the length of each frame before it, in one writev, the first frame may be written partially.
+		uint16_t lengths[DH_PEER_BATCH];
+		struct iovec stream[3*DH_PEER_BATCH];
+		size_t sizes[DH_PEER_BATCH];
+		for(int k=(int)n-1; k>=0; k--){
+			sizes[k] = sizeof(uint16_t)+iov[2*k].iov_len+iov[2*k+1].iov_len;
+			lengths[k] = htons((uint16_t)(sizes[k]-sizeof(uint16_t)));
+			stream[3*k].iov_base = &lengths[k];
+			stream[3*k].iov_len = sizeof(uint16_t);
+			stream[3*k+1] = iov[2*k];
+			stream[3*k+2] = iov[2*k+1];
+		}
+		struct iovec *first = stream;
+		for(size_t skip=peer->partial; skip; first++){
+			size_t k = first->iov_len < skip ? first->iov_len : skip;
+			first->iov_base = (char*)first->iov_base+k;
+			first->iov_len -= k;
+			skip -= k;
+			if(first->iov_len) break;
+		}
+		ssize_t written = writev(peer->fd, first, (int)(stream+3*n-first));
+		if(written<0) return errno==EAGAIN || errno==EWOULDBLOCK ? 1 : errno==EINTR ? 0 : -1;
+		size_t bytes = peer->partial+written;
+		uint32_t k = 0;
+		while(k<n && bytes>=sizes[k]) bytes -= sizes[k++];
+		peer->partial = bytes;
+		peerSent(peer, k);
+		if(k < n) return 1;
+	}
+	return 0;
+}
+
+// queue message head, with the len bytes of payload, to the peer with handle, which sends it to the other dollhouse in
+// frames. head gets a new msgID, its idx and total are set by fragmentMessage(). the peer owns the payload, which it frees
+// when it is sent, and it sends as soon as it has DH_PEER_BATCH frames. fewer frames are sent by the main thread, after
+// the daemon that sent them ran. returns -1 if there is no such peer or the payload is too large, 0 otherwise.
+int peerSend(Handle handle, const Message *head, char *payload, size_t len){
+	uint32_t total = fragmentCount(len);
+	pthread_mutex_lock(&peerLock);
+	Peer *peer = (Peer*)slabGet(&peerSlab, handle);
+	if(!peer || peer->listening || total==0){
+		pthread_mutex_unlock(&peerLock);
+		free(payload);
+		return -1;
+	}
+	pthread_mutex_lock(&peer->lock); // the main thread takes peerLock to close it, and then waits for this lock
+	pthread_mutex_unlock(&peerLock);
+
+	OutMessage *m = (OutMessage*)malloc(sizeof(OutMessage));
+	memcpy(&m->head, head, DH_MESSAGE_HEADER);
+	peer->msg_seq++;
+	memcpy(m->head.msgID, &peer->msg_seq, DH_ID_LEN); // 48 bits, little endian
+	m->payload = payload;
+	m->len = len;
+	m->sent = 0;
+	m->total = total;
+	m->next = nullptr;
+	int notify = peer->out==nullptr && !peer->waiting;
+	*peer->out_tail = m;
+	peer->out_tail = &m->next;
+	peer->out_frames += total;
+
+	if(peer->out_frames >= DH_PEER_BATCH && !peer->waiting){
+		peer->waiting = flushPeer(peer)!=0; // a broken connection is noticed by the main thread, which closes it
+		notify = 0;
+	}
+	pthread_mutex_unlock(&peer->lock);
+	if(notify) notifyScheduler();
+	return 0;
+}
+
+// the number of frames queued to the peer with handle, 0 if there is no such peer.
+uint32_t peerQueued(Handle handle){
+	uint32_t n = 0;
+	pthread_mutex_lock(&peerLock);
+	Peer *peer = (Peer*)slabGet(&peerSlab, handle);
+	if(peer){
+		pthread_mutex_lock(&peer->lock);
+		n = peer->out_frames;
+		pthread_mutex_unlock(&peer->lock);
+	}
+	pthread_mutex_unlock(&peerLock);
+	return n;
+}
+
+// nonzero if the peer with handle is connected to another dollhouse.
+int peerOpen(Handle handle){
+	pthread_mutex_lock(&peerLock);
+	Peer *peer = (Peer*)slabGet(&peerSlab, handle);
+	int open = peer && !peer->listening;
+	pthread_mutex_unlock(&peerLock);
+	return open;
+}
+
+// close a peer, with the messages queued to it and those it collects, on the main thread.
+void closePeer(Peer *peer){
+	pthread_mutex_lock(&peerLock);
+	pthread_mutex_lock(&peer->lock);
+	epoll_ctl(peer->epoll, EPOLL_CTL_DEL, peer->fd, nullptr);
+	close(peer->fd);
+	while(peer->out){
+		OutMessage *m = peer->out;
+		peer->out = m->next;
+		free(m->payload);
+		free(m);
+	}
+	while(peer->stalled){
+		Reassembly *m = peer->stalled;
+		peer->stalled = m->next;
+		freeReassembly(&peer->reassembler, m);
+	}
+	if(!peer->listening) freeReassembler(&peer->reassembler);
+	free(peer->in);
+	pthread_mutex_unlock(&peer->lock);
+	pthread_mutex_destroy(&peer->lock);
+	slabFree(&peerSlab, peer);
+	pthread_mutex_unlock(&peerLock);
+}
+
+// collect a frame that arrived from peer, and hand the message it completes to peerReceive, after the stalled ones.
+void peerFrame(Peer *peer, const Message *frame, size_t size, uint64_t now){
+	peer->frames_received++;
+	Reassembly *m = reassemble(&peer->reassembler, frame, size, now);
+	if(!m) return;
+	peer->messages_received++;
+	if(!peer->stalled && peerReceive(peer, m)) return;
+	m->next = nullptr;
+	*peer->stalled_tail = m;
+	peer->stalled_tail = &m->next;
+}
+
+// hand the stalled messages of peer to peerReceive again, returns nonzero while some are still stalled.
+int unstallPeer(Peer *peer){
+	while(peer->stalled){
+		Reassembly *m = peer->stalled, *next = m->next;
+		if(!peerReceive(peer, m)) return 1;
+		if(!(peer->stalled = next)) peer->stalled_tail = &peer->stalled;
+	}
+	return 0;
+}
+
+// receive the frames that arrived from peer, DH_PEER_BATCH at a time, on the main thread, until the socket is empty, the
+// messages are stalled or DH_PEER_ROUNDS batches were read. returns -1 when the connection is closed or broken.
+int receivePeer(Peer *peer, uint64_t now){
+	if(peer->kind==PEER_SEQPACKET){
+		Message frames[DH_PEER_BATCH];
+		struct iovec iov[DH_PEER_BATCH];
+		struct mmsghdr msgs[DH_PEER_BATCH];
+		for(int round=0; round<DH_PEER_ROUNDS; round++){
+			memset(msgs, 0, sizeof(msgs));
+			for(int k=0; k<DH_PEER_BATCH; k++){
+				iov[k].iov_base = &frames[k];
+				iov[k].iov_len = sizeof(Message);
+				msgs[k].msg_hdr.msg_iov = &iov[k];
+				msgs[k].msg_hdr.msg_iovlen = 1;
+			}
+			int n = recvmmsg(peer->fd, msgs, DH_PEER_BATCH, MSG_DONTWAIT, nullptr);
+			if(n<0) return errno==EAGAIN || errno==EWOULDBLOCK ? peer->readable = 0 : errno==EINTR ? 0 : -1;
+			if(n==0) return -1;
+			for(int k=0; k<n; k++){
+				if(msgs[k].msg_len==0) return -1; // the other dollhouse closed the connection
+				peerFrame(peer, &frames[k], msgs[k].msg_len, now);
+			}
+			if(peer->stalled) return 0;
+		}
+		return 0;
+	}
+
+	for(int round=0; round<DH_PEER_ROUNDS; round++){
+		ssize_t n = read(peer->fd, peer->in+peer->in_len, DH_PEER_BUFFER-peer->in_len);
+		if(n<0) return errno==EAGAIN || errno==EWOULDBLOCK ? peer->readable = 0 : errno==EINTR ? 0 : -1;
+		if(n==0) return -1;
+		peer->in_len += n;
+		size_t at = 0;
+		while(peer->in_len-at >= sizeof(uint16_t)){
+			uint16_t size;
+			memcpy(&size, peer->in+at, sizeof(size));
+			size = ntohs(size);
+			if(size < DH_MESSAGE_HEADER || size > sizeof(Message)) return -1; // not a dollhouse
+			if(peer->in_len-at < sizeof(uint16_t)+size) break;
+			Message frame; // aligned
+			memcpy(&frame, peer->in+at+sizeof(uint16_t), size);
+			peerFrame(peer, &frame, size, now);
+			at += sizeof(uint16_t)+size;
+		}
+		memmove(peer->in, peer->in+at, peer->in_len-at);
+		peer->in_len -= at;
+		if(peer->stalled) return 0;
+	}
+	return 0;
+}
+
+// an epoll event of the peer with handle, on the main thread: accept the peers that connect, receive the frames that
+// arrived, send the frames that waited for the socket to be writable.
+void peerEvent(Handle handle, uint32_t events, uint64_t now){
+	pthread_mutex_lock(&peerLock);
+	Peer *peer = (Peer*)slabGet(&peerSlab, handle); // only the main thread closes it
+	pthread_mutex_unlock(&peerLock);
+	if(!peer) return;
+	if(peer->listening){
+		int fd;
+		while((fd = accept4(peer->fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+			newPeer(peer->epoll, fd, peer->kind, 0);
+		return;
+	}
+	if(events & (EPOLLIN | EPOLLHUP | EPOLLERR)) peer->readable = 1;
+	if(events & EPOLLOUT){
+		pthread_mutex_lock(&peer->lock);
+		int full = peer->out ? flushPeer(peer) : 0;
+		peer->waiting = full > 0;
+		pthread_mutex_unlock(&peer->lock);
+		if(full < 0){
+			closePeer(peer);
+			return;
+		}
+	}
+	if(peer->readable && !peer->stalled && receivePeer(peer, now) < 0) closePeer(peer);
+}
+
+// on the main thread: pass the stalled messages of peers again, send the frames that are queued to them, read the frames
+// that were left to read, and drop the messages they collect that expired at monotonic time now in ms. returns the time
+// at which they are served again: now when frames are left to read, soon when messages are stalled or a packet socket is
+// full, when the next message expires otherwise, 0 if none.
+uint64_t servePeers(uint64_t now){
+	uint64_t next = 0;
+	for(uint32_t i=0; ; i++){
+		pthread_mutex_lock(&peerLock);
+		Peer *peer = i<peerSlab.len ? (Peer*)slabAt(&peerSlab, i) : nullptr;
+		int more = i<peerSlab.len;
+		pthread_mutex_unlock(&peerLock);
+		if(!more) break;
+		if(!peer || peer->listening) continue;
+		unstallPeer(peer);
+		pthread_mutex_lock(&peer->lock);
+		// epoll does not tell a packet socket that the queue of the other end has room, it is tried again
+		int full = (!peer->waiting || peer->kind==PEER_SEQPACKET) && peer->out ? flushPeer(peer) : 0;
+		peer->waiting = full > 0 || (peer->waiting && peer->out);
+		int retry = peer->waiting && peer->kind==PEER_SEQPACKET;
+		pthread_mutex_unlock(&peer->lock);
+		if(full < 0 || (peer->readable && !peer->stalled && receivePeer(peer, now) < 0)){
+			closePeer(peer);
+			continue;
+		}
+		uint64_t expires = expireReassemblies(&peer->reassembler, now);
+		if(peer->stalled || retry) expires = now+1; // until there is room
+		if(peer->readable && !peer->stalled) expires = now;
+		if(expires && (next==0 || expires < next)) next = expires;
+	}
+	return next;
+}
+
+
+
+#endif /* DOLLHOUSENET_HPP_ */